@@ -0,0 +1,110 @@
+// shared by the benchmark programs: loops, timing and JSON results
+
+#include "bench.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+int bench_quick;
+
+static FILE *out;
+static int nresults;
+
+/* a fresh loop per benchmark, so no state leaks from the previous one */
+zv_loop *bench_loop(void) {
+    zv_loop *lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(lp);
+    return lp;
+}
+
+/* after the run, so a suite does not keep every loop's fds and arrays */
+void bench_loop_free(zv_loop *lp) {
+    zv_loop_destroy(lp);
+    zv_free(lp);
+}
+
+/* monotonic, unlike zv_time() */
+zv_tstamp bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+long bench_max_rss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+int bench_open(const char *path, const char *suite) {
+    out = path ? fopen(path, "w") : stdout;
+    if (out == NULL) {
+	perror(path);
+	return -1;
+    }
+    fprintf(out, "{\"suite\": \"%s\", \"version\": \"%d.%d\", \"quick\": %s, "
+	    "\"profile\": {\"priorities\": %d, \"signals\": %d}, \"results\": [",
+	    suite, ZV_VERSION_MAJOR, ZV_VERSION_MINOR, bench_quick ? "true" : "false",
+	    NUM_PRI, ZV_ENABLE_SIGNAL);
+    nresults = 0;
+    return 0;
+}
+
+void bench_report(const char *bench, const char *name, double value, const char *unit, ...) {
+    va_list ap;
+    const char *key;
+
+    fprintf(out, "%s\n  {\"bench\": \"%s\", \"case\": \"%s\", \"value\": %.6g, \"unit\": \"%s\", \"params\": {",
+	    nresults ? "," : "", bench, name, value, unit);
+    va_start(ap, unit);
+    for (int i=0; (key = va_arg(ap, const char *)) != NULL; i++)
+	fprintf(out, "%s\"%s\": %ld", i ? ", " : "", key, va_arg(ap, long));
+    va_end(ap);
+    fprintf(out, "}}");
+    fflush(out);
+    nresults++;
+}
+
+void bench_close(void) {
+    fprintf(out, "\n]}\n");
+    if (out != stdout)
+	fclose(out);
+    out = NULL;
+}
+
+int bench_args(int argc, char *argv[], const char **path) {
+    int opt;
+
+    *path = NULL;
+    while ((opt = getopt(argc, argv, "qo:")) != -1) {
+	switch (opt) {
+	case 'q':
+	    bench_quick = 1;
+	    break;
+	case 'o':
+	    *path = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-q] [-o out.json] [bench ...]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    return optind;
+}
+
+/* with no names given every benchmark runs */
+int bench_selected(int argc, char *argv[], int first, const char *bench) {
+    if (first >= argc)
+	return 1;
+    for (int i=first; i<argc; i++) {
+	if (strcmp(argv[i], bench) == 0)
+	    return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+// shared by the benchmark programs: loops, timing and JSON results
+
+#ifndef _ZV_BENCH_H_
+#define _ZV_BENCH_H_
+
+#include "zv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* set by -q, benchmarks scale their sizes down to a smoke run */
+extern int bench_quick;
+
+zv_loop *bench_loop(void);
+void bench_loop_free(zv_loop *lp);
+zv_tstamp bench_now(void);
+long bench_max_rss_kb(void);
+
+/*
+ * Results are written as one JSON document:
+ *
+ *	{"suite": "zv_bench", "version": "0.1", "quick": false,
+ *	 "profile": {"priorities": 128, "signals": 1}, "results": [
+ *	    {"bench": "timers", "case": "start", "value": 41.2, "unit": "ns/op",
+ *	     "params": {"timers": 1000}}, ...]}
+ *
+ * `bench_report` takes the params as name, long value pairs ended with
+ * NULL. A (bench, case, params) triple names the same measurement from
+ * one release to the next.
+ */
+int  bench_open(const char *path, const char *suite);
+void bench_report(const char *bench, const char *name, double value, const char *unit, ...);
+void bench_close(void);
+
+/* parse [-q] [-o out.json] [bench ...], returns the index of the first bench name */
+int  bench_args(int argc, char *argv[], const char **path);
+int  bench_selected(int argc, char *argv[], int first, const char *bench);
+
+/* the zv_bench suite, one file each */
+void bench_pending(void);
+void bench_timers(void);
+void bench_io(void);
+void bench_wakeup(void);
+void bench_echo(void);
+void bench_fiber(void);
+void bench_virtual(void);
+void bench_fs(void);
+void bench_channel(void);
+void bench_numa(void);
+void bench_fork(void);
+void bench_bucket(void);
+void bench_cork(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ZV_BENCH_H_
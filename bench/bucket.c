@@ -0,0 +1,130 @@
+// throttled connections, a zv_timer each against a zv_bucket each
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define CONNS 1000
+#define RATE 50.0		/* requests per second and connection */
+#define DURATION 1.0
+
+/* every connection always has a request waiting, so only the throttle holds it back */
+struct conn {
+    zv_io io;
+    zv_timer resume;		/* per connection variant */
+    zv_bucket bucket;		/* bucket variant */
+};
+
+static struct conn *conns;
+static long served;
+static int timers_peak;
+
+static zv_tstamp cpu_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void timer_resume_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    struct conn *c = (struct conn *)(w -> data);
+
+    zv_io_start(lp, &c -> io);
+}
+
+static void timer_io_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    struct conn *c = (struct conn *)(w -> data);
+
+    served++;
+    zv_io_stop(lp, &c -> io);
+    zv_timer_init(&c -> resume, timer_resume_cb, 1.0 / RATE, 0.0);
+    c -> resume.data = c;
+    zv_timer_start(lp, &c -> resume);
+    if (lp -> timer_cnt > timers_peak)
+	timers_peak = lp -> timer_cnt;
+}
+
+static void bucket_io_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    struct conn *c = (struct conn *)(w -> data);
+
+    served++;
+    zv_bucket_consume(lp, &c -> bucket, &c -> io, 1.0);
+    if (lp -> timer_cnt > timers_peak)
+	timers_peak = lp -> timer_cnt;
+}
+
+static void done_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)w; (void)revents;	/* unused */
+    zv_loop_break(lp);
+}
+
+static void bucket_run(const char *name, int nconns, zv_tstamp duration, int buckets) {
+    zv_loop *lp = bench_loop();
+    uint64_t one = 1;
+
+    served = 0;
+    timers_peak = 0;
+    for (int i=0; i<nconns; i++) {
+	struct conn *c = conns + i;
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0 || fd >= ZV_OPENFD_MAX) {
+	    fprintf(stderr, "bucket: out of fds after %d connections\n", i);
+	    if (fd >= 0)
+		close(fd);
+	    nconns = i;
+	    break;
+	}
+	write(fd, &one, sizeof(one));
+	zv_io_init(&c -> io, buckets ? bucket_io_cb : timer_io_cb, fd, ZV_READ);
+	c -> io.data = c;
+	zv_timer_init(&c -> resume, timer_resume_cb, 0.0, 0.0);
+	c -> resume.data = c;
+	/* a burst of one, so each request waits for its refill */
+	zv_bucket_init(&c -> bucket, RATE, 1.0);
+	zv_io_start(lp, &c -> io);
+    }
+
+    zv_timer done;
+    zv_timer_init(&done, done_cb, duration, 0.0);
+    zv_timer_start(lp, &done);
+
+    zv_tstamp cpu = cpu_now(), start = bench_now();
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+    zv_tstamp elapsed = bench_now() - start;
+    cpu = cpu_now() - cpu;
+
+    bench_report("bucket", name, cpu * 1e9 / served, "ns/req", "conns", (long)nconns, NULL);
+    bench_report("bucket", buckets ? "bucket_rate" : "timer_rate", served / elapsed, "req/s",
+		 "conns", (long)nconns, NULL);
+    bench_report("bucket", buckets ? "bucket_timers" : "timer_timers", timers_peak, "timers",
+		 "conns", (long)nconns, NULL);
+
+    for (int i=0; i<nconns; i++) {
+	zv_bucket_release(lp, &conns[i].bucket, &conns[i].io);
+	zv_io_stop(lp, &conns[i].io);
+	zv_timer_stop(lp, &conns[i].resume);
+	close(conns[i].io.fd);
+	zv_free(conns[i].bucket.waits);
+    }
+    bench_loop_free(lp);
+}
+
+/* the CPU each throttled request costs, with the same target rate */
+void bench_bucket(void) {
+    int nconns = bench_quick ? CONNS / 10 : CONNS;
+    /* room for what the other benchmarks leave open */
+    if (nconns > ZV_OPENFD_MAX - 128)
+	nconns = ZV_OPENFD_MAX - 128;
+    zv_tstamp duration = bench_quick ? DURATION / 10 : DURATION;
+
+    conns = (struct conn *)zv_calloc(nconns, sizeof(struct conn));
+    bucket_run("timer", nconns, duration, 0);
+    bucket_run("bucket", nconns, duration, 1);
+    zv_free(conns);
+}
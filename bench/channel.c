@@ -0,0 +1,123 @@
+// messages from a producer thread through zv_channel, and through a socketpair
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define MESSAGES 2000000
+#define MSG_SIZE 64
+#define SLOTS 1024
+
+static long nmsgs, received, batches;
+
+static void channel_cb(zv_loop *lp, zv_channel *ch, const struct iovec *msgs, int cnt) {
+    received += cnt;
+    batches++;
+    if (received == nmsgs) {
+	zv_channel_stop(lp, ch);
+	zv_loop_break(lp);
+    }
+    (void)msgs;			/* unused */
+}
+
+/* spins while the ring is full, the consumer is never woken for that */
+static void *channel_producer(void *arg) {
+    zv_channel *ch = (zv_channel *)arg;
+    char msg[MSG_SIZE];
+
+    memset(msg, 'x', sizeof(msg));
+    for (long i=0; i<nmsgs; i++) {
+	while (zv_channel_send(ch, msg, sizeof(msg)) < 0)
+	    sched_yield();
+    }
+    return NULL;
+}
+
+static void socket_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    char msg[MSG_SIZE];
+
+    batches++;
+    while (read(((zv_io *)w) -> fd, msg, sizeof(msg)) == sizeof(msg)) {
+	if (++received == nmsgs) {
+	    zv_io_stop(lp, (zv_io *)w);
+	    zv_loop_break(lp);
+	    return;
+	}
+    }
+}
+
+static void *socket_producer(void *arg) {
+    int fd = *(int *)arg;
+    char msg[MSG_SIZE];
+
+    memset(msg, 'x', sizeof(msg));
+    for (long i=0; i<nmsgs; i++) {
+	while (write(fd, msg, sizeof(msg)) < 0 && errno == EAGAIN)
+	    sched_yield();
+    }
+    return NULL;
+}
+
+static void report(const char *name, zv_tstamp elapsed) {
+    bench_report("channel", name, elapsed * 1e9 / received, "ns/msg",
+		 "size", (long)MSG_SIZE, NULL);
+    bench_report("channel", name[0] == 'r' ? "ring_batch" : "socket_batch",
+		 (double)received / batches, "msgs", "size", (long)MSG_SIZE, NULL);
+}
+
+/* throughput from a thread to the loop, each read callback counts as one batch */
+void bench_channel(void) {
+    pthread_t tid;
+    nmsgs = bench_quick ? MESSAGES / 20 : MESSAGES;
+
+    zv_loop *lp = bench_loop();
+    zv_channel *ch = zv_channel_new(SLOTS, MSG_SIZE + 4);
+    if (ch == NULL)
+	return;
+    received = batches = 0;
+    zv_channel_start(lp, ch, channel_cb);
+    zv_tstamp start = bench_now();
+    if (pthread_create(&tid, NULL, channel_producer, ch) != 0) {
+	perror("pthread_create");
+	exit(1);
+    }
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+    pthread_join(tid, NULL);
+    report("ring", bench_now() - start);
+    zv_channel_free(ch);
+    bench_loop_free(lp);
+
+    /* one message per datagram, as a pipeline passing them over sockets would */
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+	perror("socketpair");
+	return;
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    lp = bench_loop();
+    zv_io io;
+    zv_io_init(&io, socket_cb, sv[0], ZV_READ);
+    zv_io_start(lp, &io);
+    received = batches = 0;
+    start = bench_now();
+    if (pthread_create(&tid, NULL, socket_producer, &sv[1]) != 0) {
+	perror("pthread_create");
+	exit(1);
+    }
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+    pthread_join(tid, NULL);
+    report("socket", bench_now() - start);
+    close(sv[0]);
+    close(sv[1]);
+    bench_loop_free(lp);
+}
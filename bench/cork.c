@@ -0,0 +1,120 @@
+// responses written in pieces, straight through write(2) and corked by the loop
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define CONNS 64
+#define ROUNDS 2000		/* requests per connection */
+#define PIECES 4		/* writes per response, header and body parts */
+#define PIECE 32
+
+struct conn {
+    zv_io srv;			/* reads a request, writes the response */
+    zv_io cli;			/* reads the response, sends the next request */
+    int got;			/* bytes of the current response */
+    int rounds;
+};
+
+static int corked, left;
+static long piece_writes;
+
+static void srv_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    int fd = ((zv_io *)w) -> fd;
+    char req[16], piece[PIECE];
+
+    if (read(fd, req, sizeof(req)) <= 0)
+	return;
+    memset(piece, 'r', sizeof(piece));
+    for (int i=0; i<PIECES; i++) {
+	if (corked)
+	    zv_write(lp, fd, piece, sizeof(piece));
+	else
+	    write(fd, piece, sizeof(piece));
+	piece_writes++;
+    }
+}
+
+static void cli_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    struct conn *c = (struct conn *)(w -> data);
+    char buf[PIECES * PIECE];
+
+    ssize_t n = read(c -> cli.fd, buf, sizeof(buf));
+    if (n <= 0)
+	return;
+    c -> got += n;
+    if (c -> got < PIECES * PIECE)
+	return;
+
+    c -> got = 0;
+    if (++c -> rounds < ROUNDS / (bench_quick ? 10 : 1)) {
+	write(c -> cli.fd, "q", 1);
+    } else {
+	zv_io_stop(lp, &c -> srv);
+	zv_io_stop(lp, &c -> cli);
+	if (--left == 0)
+	    zv_loop_break(lp);
+    }
+}
+
+static void cork_run(const char *name, int nconns) {
+    zv_loop *lp = bench_loop();
+    struct conn *conns = (struct conn *)zv_calloc(nconns, sizeof(struct conn));
+
+    corked = name[0] == 'c';
+    zv_loop_cork(lp, corked);
+    piece_writes = 0;
+    left = nconns;
+    for (int i=0; i<nconns; i++) {
+	struct conn *c = conns + i;
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+	    perror("socketpair");
+	    exit(1);
+	}
+	zv_io_init(&c -> srv, srv_cb, sv[0], ZV_READ);
+	zv_io_init(&c -> cli, cli_cb, sv[1], ZV_READ);
+	c -> cli.data = c;
+	zv_io_start(lp, &c -> srv);
+	zv_io_start(lp, &c -> cli);
+	write(sv[1], "q", 1);
+    }
+
+    zv_tstamp start = bench_now();
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+    zv_tstamp elapsed = bench_now() - start;
+
+    long responses = piece_writes / PIECES;
+    long syscalls = piece_writes;
+    if (corked) {
+	struct zv_cork_stats st;
+	zv_cork_stats(lp, &st);
+	syscalls = st.syscalls;
+    }
+    bench_report("cork", name, elapsed * 1e9 / responses, "ns/resp",
+		 "conns", (long)nconns, "pieces", (long)PIECES, NULL);
+    bench_report("cork", corked ? "corked_writes" : "direct_writes",
+		 (double)syscalls / responses, "writes/resp",
+		 "conns", (long)nconns, "pieces", (long)PIECES, NULL);
+
+    for (int i=0; i<nconns; i++) {
+	close(conns[i].srv.fd);
+	close(conns[i].cli.fd);
+    }
+    zv_free(conns);
+    bench_loop_free(lp);
+}
+
+/* the peer is on the same loop, so it always reads whole responses */
+void bench_cork(void) {
+    int nconns = bench_quick ? CONNS / 4 : CONNS;
+
+    cork_run("direct", nconns);
+    cork_run("corked", nconns);
+}
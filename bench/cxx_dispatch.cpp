@@ -0,0 +1,113 @@
+// callback dispatch through the C API against the zv.hpp trampolines
+
+#include "zv.hpp"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#define WATCHERS 1000
+#define ROUNDS 20000
+
+struct counter {
+    long hits = 0;
+    void on_idle(zv::idle &, int) { hits++; }
+};
+
+static void c_idle_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)revents;	/* unused */
+    ((counter *)(w -> data)) -> hits++;
+}
+
+/*
+ * Nanoseconds per callback, invoking WATCHERS idle watchers ROUNDS times
+ * the way `call_pending` does, so only the dispatch itself is measured.
+ */
+static double run(zv_loop *lp, zv_idle **ws, long hits_expected, counter &c) {
+    zv_tstamp start = bench_now();
+    for (int i=0; i<ROUNDS; i++) {
+	for (int j=0; j<WATCHERS; j++)
+	    zv_invoke(lp, (zv_watcher *)ws[j], ZV_IDLE);
+    }
+    zv_tstamp elapsed = bench_now() - start;
+    if (c.hits != hits_expected) {
+	fprintf(stderr, "expected %ld callbacks, got %ld\n", hits_expected, c.hits);
+	exit(1);
+    }
+    return elapsed * 1e9 / hits_expected;
+}
+
+static double bench_c() {
+    zv_loop *lp = bench_loop();
+    counter c;
+    std::vector<zv_idle> idles(WATCHERS);
+    std::vector<zv_idle *> ws;
+    for (zv_idle &w : idles) {
+	zv_idle_init(&w, c_idle_cb);
+	w.data = &c;
+	zv_idle_start(lp, &w);
+	ws.push_back(&w);
+    }
+    double ns = run(lp, ws.data(), (long)WATCHERS * ROUNDS, c);
+    for (zv_idle &w : idles)
+	zv_idle_stop(lp, &w);
+    bench_loop_free(lp);
+    return ns;
+}
+
+static double bench_method() {
+    zv::loop l(bench_loop());
+    double ns;
+    {
+	counter c;
+	std::vector<zv::idle> idles;
+	std::vector<zv_idle *> ws;
+	idles.reserve(WATCHERS);
+	for (int i=0; i<WATCHERS; i++) {
+	    idles.emplace_back(l);
+	    idles.back().set<counter, &counter::on_idle>(&c);
+	    idles.back().start();
+	    ws.push_back(idles.back().raw());
+	}
+	ns = run(l.raw(), ws.data(), (long)WATCHERS * ROUNDS, c);
+    }
+    /* once the wrappers have stopped their watchers */
+    bench_loop_free(l.raw());
+    return ns;
+}
+
+static double bench_lambda() {
+    zv::loop l(bench_loop());
+    double ns;
+    {
+	counter c;
+	auto f = [&c](zv::idle &, int) { c.hits++; };
+	std::vector<zv::idle> idles;
+	std::vector<zv_idle *> ws;
+	idles.reserve(WATCHERS);
+	for (int i=0; i<WATCHERS; i++) {
+	    idles.emplace_back(l);
+	    idles.back().set(&f);
+	    idles.back().start();
+	    ws.push_back(idles.back().raw());
+	}
+	ns = run(l.raw(), ws.data(), (long)WATCHERS * ROUNDS, c);
+    }
+    /* once the wrappers have stopped their watchers */
+    bench_loop_free(l.raw());
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path;
+    bench_args(argc, argv, &path);
+
+    if (bench_open(path, "zv_bench_cxx") < 0)
+	return 1;
+    bench_report("dispatch", "c", bench_c(), "ns/callback", "watchers", (long)WATCHERS, NULL);
+    bench_report("dispatch", "method", bench_method(), "ns/callback", "watchers", (long)WATCHERS, NULL);
+    bench_report("dispatch", "lambda", bench_lambda(), "ns/callback", "watchers", (long)WATCHERS, NULL);
+    bench_close();
+    return 0;
+}
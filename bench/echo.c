@@ -0,0 +1,207 @@
+// loopback TCP echo server, driven by a load generator thread
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define REQUESTS 200000
+#define MSG_SIZE 64
+
+struct conn {
+    zv_io io;
+    struct conn *next;
+};
+
+struct server {
+    zv_loop *lp;
+    zv_io listener;
+    struct conn *conns;
+    struct sockaddr_in addr;
+};
+
+struct load {
+    struct server *srv;
+    int nconns;
+    long nrequests;
+    zv_tstamp elapsed;
+};
+
+// ===============================
+// server side, on the loop thread
+
+static void conn_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    zv_io *io = (zv_io *)w;
+    char buf[4096];
+
+    ssize_t n = read(io -> fd, buf, sizeof(buf));
+    if (n > 0) {
+	/* replies are small and read before the next request, they never block */
+	if (write(io -> fd, buf, n) != n)
+	    perror("echo write");
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+	zv_io_stop(lp, io);
+	close(io -> fd);
+	io -> fd = -1;
+    }
+}
+
+static void accept_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    struct server *srv = (struct server *)(w -> data);
+    int one = 1;
+    int fd;
+
+    while ((fd = accept(srv -> listener.fd, NULL, NULL)) >= 0) {
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	struct conn *c = (struct conn *)zv_calloc(1, sizeof(struct conn));
+	zv_io_init(&c -> io, conn_cb, fd, ZV_READ);
+	zv_io_start(lp, &c -> io);
+	c -> next = srv -> conns;
+	srv -> conns = c;
+    }
+}
+
+static void server_start(struct server *srv) {
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+	perror("socket");
+	exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&srv -> addr, 0, sizeof(srv -> addr));
+    srv -> addr.sin_family = AF_INET;
+    srv -> addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(srv -> addr);
+    if (bind(fd, (struct sockaddr *)&srv -> addr, len) < 0 ||
+	listen(fd, 1024) < 0 ||
+	getsockname(fd, (struct sockaddr *)&srv -> addr, &len) < 0) {
+	perror("echo listen");
+	exit(1);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    zv_io_init(&srv -> listener, accept_cb, fd, ZV_READ);
+    srv -> listener.data = srv;
+    zv_io_start(srv -> lp, &srv -> listener);
+}
+
+static void server_stop(struct server *srv) {
+    zv_io_stop(srv -> lp, &srv -> listener);
+    close(srv -> listener.fd);
+
+    while (srv -> conns) {
+	struct conn *c = srv -> conns;
+	srv -> conns = c -> next;
+	if (c -> io.fd >= 0) {
+	    zv_io_stop(srv -> lp, &c -> io);
+	    close(c -> io.fd);
+	}
+	zv_free(c);
+    }
+}
+
+// ===============================
+// load generator, on its own thread with blocking sockets
+
+static void read_full(int fd, char *buf, int len) {
+    while (len > 0) {
+	ssize_t n = read(fd, buf, len);
+	if (n <= 0) {
+	    perror("echo read");
+	    exit(1);
+	}
+	buf += n;
+	len -= n;
+    }
+}
+
+/* every connection has one request in flight, sent together and read back in turn */
+static void *generator(void *arg) {
+    struct load *ld = (struct load *)arg;
+    int *fds = (int *)zv_calloc(ld -> nconns, sizeof(int));
+    char msg[MSG_SIZE], reply[MSG_SIZE];
+    int one = 1;
+
+    memset(msg, 'x', sizeof(msg));
+    for (int i=0; i<ld -> nconns; i++) {
+	fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[i] < 0 ||
+	    connect(fds[i], (struct sockaddr *)&ld -> srv -> addr, sizeof(ld -> srv -> addr)) < 0) {
+	    perror("echo connect");
+	    exit(1);
+	}
+	setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    long rounds = ld -> nrequests / ld -> nconns;
+    zv_tstamp start = bench_now();
+    for (long r=0; r<rounds; r++) {
+	for (int i=0; i<ld -> nconns; i++) {
+	    if (write(fds[i], msg, sizeof(msg)) != sizeof(msg)) {
+		perror("echo write");
+		exit(1);
+	    }
+	}
+	for (int i=0; i<ld -> nconns; i++)
+	    read_full(fds[i], reply, sizeof(reply));
+    }
+    ld -> elapsed = bench_now() - start;
+    ld -> nrequests = rounds * ld -> nconns;
+
+    for (int i=0; i<ld -> nconns; i++)
+	close(fds[i]);
+    zv_free(fds);
+
+    zv_loop_break(ld -> srv -> lp);
+    zv_loop_wakeup(ld -> srv -> lp);
+    return NULL;
+}
+
+static void run(int nconns) {
+    struct server srv;
+    struct load ld;
+    pthread_t tid;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.lp = bench_loop();
+    server_start(&srv);
+
+    ld.srv = &srv;
+    ld.nconns = nconns;
+    ld.nrequests = bench_quick ? REQUESTS / 10 : REQUESTS;
+    if (pthread_create(&tid, NULL, generator, &ld) != 0) {
+	perror("pthread_create");
+	exit(1);
+    }
+    zv_loop_run(srv.lp, ZV_RUN_DEFAULT);
+    pthread_join(tid, NULL);
+    server_stop(&srv);
+
+    bench_report("echo", "throughput", ld.nrequests / ld.elapsed, "req/s",
+		 "connections", (long)nconns, "size", (long)MSG_SIZE, NULL);
+    bench_report("echo", "round_trip", ld.elapsed * 1e6 * nconns / ld.nrequests, "us",
+		 "connections", (long)nconns, "size", (long)MSG_SIZE, NULL);
+    bench_loop_free(srv.lp);
+}
+
+void bench_echo(void) {
+    static const int conns[] = { 1, 16, 64 };
+
+    for (int i=0; i<(int)(sizeof(conns) / sizeof(conns[0])); i++)
+	run(conns[i]);
+}
@@ -0,0 +1,74 @@
+// fiber context switches and many concurrent sleeping fibers
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SWITCHES 10000000
+#define FIBERS 30000
+
+static void pingpong(void *arg) {
+    (void)arg;			/* unused */
+    for (;;)
+	zv_fiber_suspend();
+}
+
+static int finished;
+
+static void sleeper(void *arg) {
+    zv_fiber_sleep(*(zv_tstamp *)arg);
+    finished++;
+}
+
+/* each round trip is a switch into the fiber and one back out */
+static void bench_switch(void) {
+    zv_loop *lp = bench_loop();
+    zv_fiber *f = zv_fiber_new(lp, pingpong, NULL);
+    long switches = bench_quick ? SWITCHES / 10 : SWITCHES;
+
+    zv_tstamp start = bench_now();
+    for (long i=0; i<switches/2; i++)
+	zv_fiber_resume(f);
+    zv_tstamp elapsed = bench_now() - start;
+
+    bench_report("fiber", "switch", elapsed * 1e9 / switches, "ns", NULL);
+    bench_loop_free(lp);
+}
+
+/*
+ * Every fiber stack costs two mappings (the guard page and the stack),
+ * so the count is bounded by vm.max_map_count / 2.
+ */
+static void bench_concurrent(int nfibers) {
+    zv_loop *lp = bench_loop();
+    zv_tstamp after = 0.1;
+
+    long rss = bench_max_rss_kb();
+    zv_tstamp start = bench_now();
+    int spawned = 0;
+    for (; spawned<nfibers; spawned++) {
+	zv_fiber *f = zv_fiber_new(lp, sleeper, &after);
+	if (f == NULL)
+	    break;
+	zv_fiber_resume(f);
+    }
+    zv_tstamp spawn = bench_now() - start;
+    finished = 0;
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+
+    if (finished != spawned) {
+	fprintf(stderr, "%d of %d fibers finished\n", finished, spawned);
+	exit(1);
+    }
+    bench_report("fiber", "spawn", spawn * 1e6 / spawned, "us/fiber",
+		 "fibers", (long)spawned, NULL);
+    bench_report("fiber", "memory", (double)(bench_max_rss_kb() - rss) / spawned, "KiB/fiber",
+		 "fibers", (long)spawned, NULL);
+    bench_loop_free(lp);
+}
+
+void bench_fiber(void) {
+    bench_switch();
+    bench_concurrent(bench_quick ? FIBERS / 10 : FIBERS);
+}
@@ -0,0 +1,124 @@
+// zv_loop_fork in prefork workers, against the size of the watcher set
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#define WATCHERS 16000		/* capped by the fd table */
+#define WORKERS 64
+
+struct fork_result {
+    double elapsed;
+    int ok;			/* the worker's own fd woke its loop */
+};
+
+static void ready_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    uint64_t cnt;
+
+    if (read(((zv_io *)w) -> fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+	*(int *)(w -> data) = 1;
+    zv_loop_break(lp);
+}
+
+/* the watched fds are shared by all workers, so each checks its loop with an fd of its own */
+static void fork_worker(zv_loop *lp, int out) {
+    struct fork_result r = { 0.0, 0 };
+
+    zv_tstamp start = bench_now();
+    zv_loop_fork(lp);
+    r.elapsed = bench_now() - start;
+
+    zv_io own;
+    uint64_t one = 1;
+    zv_io_init(&own, ready_cb, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), ZV_READ);
+    own.data = &r.ok;
+    zv_io_start(lp, &own);
+    if (write(own.fd, &one, sizeof(one)) == sizeof(one))
+	zv_loop_run(lp, ZV_RUN_ONCE);
+
+    write(out, &r, sizeof(r));
+    _exit(0);
+}
+
+static void fork_run(int nwatchers, int nworkers) {
+    zv_loop *lp = bench_loop();
+    zv_io *ios = (zv_io *)zv_calloc(nwatchers, sizeof(zv_io));
+    int pfd[2];
+
+    for (int i=0; i<nwatchers; i++) {
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0 || fd >= ZV_OPENFD_MAX) {
+	    fprintf(stderr, "fork: out of fds after %d watchers\n", i);
+	    if (fd >= 0)
+		close(fd);
+	    nwatchers = i;
+	    break;
+	}
+	zv_io_init(ios + i, ready_cb, fd, ZV_READ);
+	zv_io_start(lp, ios + i);
+    }
+    /* registers everything with the backend, without blocking */
+    zv_loop_run(lp, ZV_RUN_NOWAIT);
+
+    if (pipe(pfd) < 0) {
+	perror("pipe");
+	return;
+    }
+    for (int i=0; i<nworkers; i++) {
+	pid_t pid = fork();
+	if (pid == 0)
+	    fork_worker(lp, pfd[1]);
+	if (pid < 0) {
+	    perror("fork");
+	    nworkers = i;
+	    break;
+	}
+    }
+
+    double total = 0.0, worst = 0.0;
+    int ok = 0;
+    for (int i=0; i<nworkers; i++) {
+	struct fork_result r;
+	if (read(pfd[0], &r, sizeof(r)) != sizeof(r))
+	    break;
+	total += r.elapsed;
+	worst = r.elapsed > worst ? r.elapsed : worst;
+	ok += r.ok;
+    }
+    while (wait(NULL) > 0)
+	;
+    if (ok != nworkers)
+	fprintf(stderr, "fork: %d of %d workers were not woken\n", nworkers - ok, nworkers);
+
+    bench_report("fork", "rebuild", total * 1e6 / nworkers, "us",
+		 "watchers", (long)nwatchers, "workers", (long)nworkers, NULL);
+    bench_report("fork", "rebuild_max", worst * 1e6, "us",
+		 "watchers", (long)nwatchers, "workers", (long)nworkers, NULL);
+    bench_report("fork", "per_watcher", total * 1e9 / nworkers / nwatchers, "ns",
+		 "watchers", (long)nwatchers, "workers", (long)nworkers, NULL);
+
+    for (int i=0; i<nwatchers; i++) {
+	zv_io_stop(lp, ios + i);
+	close(ios[i].fd);
+    }
+    close(pfd[0]);
+    close(pfd[1]);
+    zv_free(ios);
+    bench_loop_free(lp);
+}
+
+/* the rebuild should follow the watchers, not the fd table */
+void bench_fork(void) {
+    int most = ZV_OPENFD_MAX - 64 < WATCHERS ? ZV_OPENFD_MAX - 64 : WATCHERS;
+    int workers = bench_quick ? WORKERS / 16 : WORKERS;
+
+    if (bench_quick)
+	most /= 10;
+    fork_run(most / 16, workers);
+    fork_run(most, workers);
+}
@@ -0,0 +1,102 @@
+// file reads through zv_fs_read, io_uring or the thread pool
+
+#include "bench.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define READS 100000
+#define FILE_SIZE (16 << 20)
+#define BLOCK 4096
+
+struct reader {
+    zv_fs_req req;
+    char buf[BLOCK];
+};
+
+static long issued, completed, failed, reads;
+static unsigned long rnd_state;
+
+static off_t random_block(void) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return (off_t)(rnd_state % (FILE_SIZE / BLOCK)) * BLOCK;
+}
+
+/* each reader reissues itself until all reads are out */
+static void read_cb(zv_loop *lp, zv_fs_req *req) {
+    struct reader *r = (struct reader *)req;
+    completed++;
+    if (req -> result != BLOCK)
+	failed++;
+    if (issued < reads) {
+	issued++;
+	zv_fs_read(lp, &r -> req, req -> fd, r -> buf, BLOCK, random_block(), read_cb);
+    }
+}
+
+/*
+ * Random 4k reads of a file in the page cache, `depth` of them in
+ * flight, so what is measured is the round trip through the loop.
+ * Skipped for io_uring when the kernel lacks it.
+ */
+static void run(int fd, int depth, int uring) {
+    zv_loop *lp = bench_loop();
+    if (zv_fs_set_uring(lp, uring) != uring) {
+	bench_loop_free(lp);
+	return;
+    }
+    struct reader *readers = (struct reader *)zv_calloc(depth, sizeof(struct reader));
+    zv_fs_set_limit(lp, depth);
+    reads = bench_quick ? READS / 10 : READS;
+    issued = completed = failed = 0;
+    rnd_state = 88172645463325252UL;
+
+    zv_tstamp start = bench_now();
+    for (int i=0; i<depth; i++) {
+	issued++;
+	zv_fs_read(lp, &readers[i].req, fd, readers[i].buf, BLOCK, random_block(), read_cb);
+    }
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+    zv_tstamp elapsed = bench_now() - start;
+
+    if (failed)
+	fprintf(stderr, "fs: %ld of %ld reads failed\n", failed, completed);
+    bench_report("fs", "read", elapsed * 1e9 / completed, "ns/op",
+		 "depth", (long)depth, "uring", (long)zv_fs_uring(lp), NULL);
+    zv_free(readers);
+    bench_loop_free(lp);
+}
+
+void bench_fs(void) {
+    char path[] = "/tmp/zv_bench_fsXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+	perror("mkstemp");
+	return;
+    }
+    unlink(path);
+
+    char *block = (char *)zv_calloc(1, BLOCK);
+    for (off_t off=0; off<FILE_SIZE; off+=BLOCK) {
+	if (pwrite(fd, block, BLOCK, off) != BLOCK) {
+	    perror("pwrite");
+	    close(fd);
+	    zv_free(block);
+	    return;
+	}
+    }
+    zv_free(block);
+
+    /* both backends, the pool is what runs where io_uring does not */
+    int depths[] = {1, 16, 64};
+    for (int uring=1; uring>=0; uring--) {
+	for (unsigned i=0; i<sizeof(depths)/sizeof(depths[0]); i++)
+	    run(fd, depths[i], uring);
+    }
+    close(fd);
+}
@@ -0,0 +1,85 @@
+// io dispatch over many socketpairs, a few of them active
+
+#include "bench.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#define EVENTS 1000000
+
+static long hits;
+
+static void read_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)revents;	/* unused */
+    char c;
+    if (read(((zv_io *)w) -> fd, &c, 1) == 1)
+	hits++;
+}
+
+/*
+ * Nanoseconds per dispatched event, from the poll to the callback, with
+ * `nsocks` idle watchers registered and `nactive` of them readable each
+ * iteration. Only the loop is timed, not the writes that wake it.
+ */
+static void run(int nsocks, int nactive) {
+    zv_loop *lp = bench_loop();
+    int (*fds)[2] = zv_calloc(nsocks, sizeof(*fds));
+    zv_io *ios = (zv_io *)zv_calloc(nsocks, sizeof(zv_io));
+    long rounds = (bench_quick ? EVENTS / 10 : EVENTS) / nactive;
+    int stride = nsocks / nactive;
+
+    for (int i=0; i<nsocks; i++) {
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0) {
+	    perror("socketpair");
+	    exit(1);
+	}
+	fcntl(fds[i][0], F_SETFL, O_NONBLOCK);
+	zv_io_init(ios + i, read_cb, fds[i][0], ZV_READ);
+	zv_io_start(lp, ios + i);
+    }
+    zv_loop_run(lp, ZV_RUN_NOWAIT);	/* register the fds with the backend */
+
+    hits = 0;
+    zv_tstamp elapsed = 0.0;
+    for (long r=0; r<rounds; r++) {
+	int off = (int)(r % stride);
+	for (int i=0; i<nactive; i++)
+	    write(fds[i * stride + off][1], "x", 1);
+
+	long want = hits + nactive;
+	zv_tstamp start = bench_now();
+	while (hits < want)
+	    zv_loop_run(lp, ZV_RUN_ONCE);
+	elapsed += bench_now() - start;
+    }
+    bench_report("io", "dispatch", elapsed * 1e9 / hits, "ns/event",
+		 "sockets", (long)nsocks, "active", (long)nactive, NULL);
+
+    for (int i=0; i<nsocks; i++) {
+	zv_io_stop(lp, ios + i);
+	close(fds[i][0]);
+	close(fds[i][1]);
+    }
+    zv_free(ios);
+    zv_free(fds);
+    bench_loop_free(lp);
+}
+
+void bench_io(void) {
+    static const int socks[] = { 10, 100, 400, 4000 };
+    static const int active[] = { 1, 10, 100 };
+    int maxsocks = (ZV_OPENFD_MAX - 64) / 2;	/* leave room for the loop's own fds */
+
+    for (int i=0; i<(int)(sizeof(socks) / sizeof(socks[0])); i++) {
+	if (socks[i] > maxsocks)
+	    break;
+	for (int j=0; j<(int)(sizeof(active) / sizeof(active[0])); j++) {
+	    if (active[j] <= socks[i])
+		run(socks[i], active[j]);
+	}
+    }
+}
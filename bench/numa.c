@@ -0,0 +1,139 @@
+// zv_loop_new_on placing a loop on the running CPU, against a loop left alone
+
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#define EVENTS 200000
+
+struct numa_run {
+    int placed;
+    int cpu;			/* where the loop was placed, -1 if not */
+    int node;
+    int incoming;		/* CPU zv_incoming_cpu saw, -1 if unknown */
+    double elapsed;
+    long events;
+};
+
+static void count_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)revents;	/* unused */
+    uint64_t cnt;
+
+    if (read(((zv_io *)w) -> fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+	*(long *)(w -> data) += 1;
+}
+
+/* a datagram to a steered socket of our own, received on our CPU over loopback */
+static int steer_check(zv_loop *lp) {
+    int one = 1;
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+	return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	getsockname(fd, (struct sockaddr *)&sa, &len) < 0 ||
+	zv_loop_steer(lp, fd) < 0 ||
+	sendto(fd, "s", 1, 0, (struct sockaddr *)&sa, sizeof(sa)) != 1) {
+	close(fd);
+	return -1;
+    }
+    char buf[1];
+    recv(fd, buf, sizeof(buf), 0);
+    int cpu = zv_incoming_cpu(fd);
+    close(fd);
+    return cpu;
+}
+
+/* the placement pins the thread and sets its memory policy, so it gets one of its own */
+static void *numa_thread(void *arg) {
+    struct numa_run *r = (struct numa_run *)arg;
+    zv_loop *lp;
+
+    r -> cpu = r -> node = r -> incoming = -1;
+    if (r -> placed) {
+	int cpu = sched_getcpu();
+	lp = cpu >= 0 ? zv_loop_new_on(&cpu, 1) : NULL;
+	if (lp == NULL)
+	    return NULL;
+	unsigned now, node;
+	if (syscall(SYS_getcpu, &now, &node, NULL) < 0 || lp -> cpu != cpu ||
+	    (int)now != cpu || lp -> node != (int)node) {
+	    fprintf(stderr, "numa: loop placed on cpu %d node %d, thread on cpu %d node %d\n",
+		    lp -> cpu, lp -> node, (int)now, (int)node);
+	    exit(1);
+	}
+	r -> cpu = lp -> cpu;
+	r -> node = lp -> node;
+	r -> incoming = steer_check(lp);
+    } else {
+	lp = bench_loop();
+    }
+
+    zv_io io;
+    uint64_t one = 1;
+    zv_io_init(&io, count_cb, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), ZV_READ);
+    io.data = &r -> events;
+    zv_io_start(lp, &io);
+
+    long want = bench_quick ? EVENTS / 10 : EVENTS;
+    zv_tstamp start = bench_now();
+    while (r -> events < want) {
+	write(io.fd, &one, sizeof(one));
+	zv_loop_run(lp, ZV_RUN_ONCE);
+    }
+    r -> elapsed = bench_now() - start;
+
+    zv_io_stop(lp, &io);
+    close(io.fd);
+    /* the placed loop stays mapped, like the default one */
+    if (r -> placed)
+	zv_loop_destroy(lp);
+    else
+	bench_loop_free(lp);
+    return NULL;
+}
+
+static void numa_run(int placed) {
+    struct numa_run r;
+    pthread_t tid;
+
+    memset(&r, 0, sizeof(r));
+    r.placed = placed;
+    if (pthread_create(&tid, NULL, numa_thread, &r) != 0) {
+	perror("pthread_create");
+	exit(1);
+    }
+    pthread_join(tid, NULL);
+    if (r.events == 0) {
+	fprintf(stderr, "numa: no loop could be placed\n");
+	return;
+    }
+
+    bench_report("numa", placed ? "placed" : "unplaced", r.elapsed * 1e9 / r.events, "ns/event",
+		 "node", (long)r.node, NULL);
+    if (placed && r.incoming >= 0 && r.incoming != r.cpu)
+	fprintf(stderr, "numa: received on cpu %d, the loop is on %d\n", r.incoming, r.cpu);
+}
+
+/* on one node this only shows the placement costs nothing on the hot path */
+void bench_numa(void) {
+    numa_run(0);
+    numa_run(1);
+}
@@ -0,0 +1,66 @@
+// zv_feed_event / call_pending throughput
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define EVENTS 1000000
+
+static long hits;
+
+static void count_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)w; (void)revents;	/* unused */
+    hits++;
+}
+
+/*
+ * Nanoseconds per event, feeding `nwatchers` watchers one by one or as a
+ * batch, then dispatching them all. The watchers never get started, so
+ * nothing but the pending queue is measured.
+ */
+static void run(int nwatchers, int batch) {
+    zv_loop *lp = bench_loop();
+    zv_io *ios = (zv_io *)zv_calloc(nwatchers, sizeof(zv_io));
+    zv_watcher **ws = (zv_watcher **)zv_calloc(nwatchers, sizeof(zv_watcher *));
+    long events = bench_quick ? EVENTS / 10 : EVENTS;
+    long rounds = events / nwatchers;
+
+    for (int i=0; i<nwatchers; i++) {
+	zv_io_init(ios + i, count_cb, -1, ZV_READ);
+	ws[i] = (zv_watcher *)(ios + i);
+    }
+
+    hits = 0;
+    zv_tstamp start = bench_now();
+    for (long r=0; r<rounds; r++) {
+	if (batch) {
+	    queue_events(lp, ws, nwatchers, ZV_READ);
+	} else {
+	    for (int i=0; i<nwatchers; i++)
+		zv_feed_event(lp, ws[i], ZV_READ);
+	}
+	call_pending(lp);
+    }
+    zv_tstamp elapsed = bench_now() - start;
+
+    if (hits != rounds * nwatchers) {
+	fprintf(stderr, "expected %ld callbacks, got %ld\n", rounds * nwatchers, hits);
+	exit(1);
+    }
+    bench_report("pending", batch ? "queue_events" : "feed_event",
+		 elapsed * 1e9 / hits, "ns/event", "watchers", (long)nwatchers, NULL);
+
+    zv_free(ws);
+    zv_free(ios);
+    bench_loop_free(lp);
+}
+
+void bench_pending(void) {
+    static const int sizes[] = { 1, 100, 1000, 10000 };
+
+    for (int i=0; i<(int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+	run(sizes[i], 0);
+	run(sizes[i], 1);
+    }
+}
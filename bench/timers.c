@@ -0,0 +1,104 @@
+// timer start / stop / restart / expire churn
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long fired;
+
+static void fired_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)w; (void)revents;	/* unused */
+    fired++;
+}
+
+/* deterministic, so every run churns the heap the same way */
+static unsigned long rnd_state;
+
+static double rnd(void) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return (rnd_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void shuffle(zv_timer **ts, int n) {
+    for (int i=n-1; i>0; i--) {
+	int j = (int)(rnd() * (i + 1));
+	zv_timer *t = ts[i];
+	ts[i] = ts[j];
+	ts[j] = t;
+    }
+}
+
+static void report(const char *name, zv_tstamp elapsed, int n) {
+    bench_report("timers", name, elapsed * 1e9 / n, "ns/op", "timers", (long)n, NULL);
+}
+
+/*
+ * Deadlines are spread over a second, so nothing expires while the heap
+ * is churned. Restarting is a stop and a start with a later deadline, the
+ * way an idle timeout is pushed back on every read.
+ */
+static void run(int n) {
+    zv_loop *lp = bench_loop();
+    zv_timer *timers = (zv_timer *)zv_calloc(n, sizeof(zv_timer));
+    zv_timer **order = (zv_timer **)zv_calloc(n, sizeof(zv_timer *));
+    zv_tstamp start;
+
+    rnd_state = 88172645463325252UL;
+    for (int i=0; i<n; i++) {
+	zv_timer_init(timers + i, fired_cb, 1.0 + rnd(), 0.0);
+	order[i] = timers + i;
+    }
+
+    start = bench_now();
+    for (int i=0; i<n; i++)
+	zv_timer_start(lp, timers + i);
+    report("start", bench_now() - start, n);
+
+    shuffle(order, n);
+    start = bench_now();
+    for (int i=0; i<n; i++) {
+	zv_timer_stop(lp, order[i]);
+	zv_timer_init(order[i], fired_cb, 1.0 + rnd(), 0.0);
+	zv_timer_start(lp, order[i]);
+    }
+    report("restart", bench_now() - start, n);
+
+    shuffle(order, n);
+    start = bench_now();
+    for (int i=0; i<n; i++)
+	zv_timer_stop(lp, order[i]);
+    report("stop", bench_now() - start, n);
+
+    /* all due within a millisecond, expired by a single iteration */
+    for (int i=0; i<n; i++) {
+	zv_timer_init(timers + i, fired_cb, rnd() * 0.001, 0.0);
+	zv_timer_start(lp, timers + i);
+    }
+    struct timespec ts = { 0, 2000000 };
+    nanosleep(&ts, NULL);
+
+    fired = 0;
+    start = bench_now();
+    zv_loop_run(lp, ZV_RUN_NOWAIT);
+    zv_tstamp elapsed = bench_now() - start;
+    if (fired != n) {
+	fprintf(stderr, "expected %d timers to fire, got %ld\n", n, fired);
+	exit(1);
+    }
+    report("expire", elapsed, n);
+
+    zv_free(order);
+    zv_free(timers);
+    bench_loop_free(lp);
+}
+
+void bench_timers(void) {
+    int max = bench_quick ? 10000 : 1000000;
+
+    for (int n=1000; n<=max; n*=10)
+	run(n);
+}
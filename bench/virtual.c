@@ -0,0 +1,148 @@
+// minutes of production timer load on a mock backend and virtual clock
+
+#include "bench.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TIMERS 100000
+#define MINUTES 10.0
+#define IDLE_TIMEOUT 30.0
+
+/* deterministic, so every run replays the same hour */
+static unsigned long rnd_state;
+
+static double rnd(void) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return (rnd_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct conn {
+    zv_io io;
+    zv_timer idle;		/* pushed back by every read */
+};
+
+static long events;
+
+static void request_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)w; (void)revents;	/* unused */
+    events++;
+}
+
+static void idle_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)w; (void)revents;	/* unused */
+    events++;
+}
+
+/* a read resets the idle timeout and scripts the next one, a second away on average */
+static void read_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    struct conn *c = (struct conn *)(w -> data);
+
+    events++;
+    zv_timer_stop(lp, &c -> idle);
+    zv_timer_init(&c -> idle, idle_cb, IDLE_TIMEOUT, 0.0);
+    zv_timer_start(lp, &c -> idle);
+    zv_mock_ready(lp, lp -> zv_now + 2.0 * rnd(), c -> io.fd, ZV_READ);
+}
+
+static void end_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)w; (void)revents;	/* unused */
+    zv_loop_break(lp);
+}
+
+/*
+ * Request timeouts repeating every 1 to 60 seconds, and connections
+ * whose idle timeout is pushed back by scripted reads. The fds only
+ * exist in the mock backend, taken from the top of the fd table. With
+ * `record`, the loop's input is recorded there. Returns the real time
+ * the loop ran.
+ */
+static zv_tstamp virtual_run(int ntimers, int nconns, zv_tstamp span, const char *record,
+			     int *iterations) {
+    zv_loop *lp = bench_loop();
+    zv_mock_init(lp, 0.0);
+    rnd_state = 88172645463325252UL;
+
+    zv_timer *timers = (zv_timer *)zv_calloc(ntimers, sizeof(zv_timer));
+    for (int i=0; i<ntimers; i++) {
+	zv_tstamp every = 1.0 + 59.0 * rnd();
+	zv_timer_init(timers + i, request_cb, every * rnd(), every);
+	zv_timer_start(lp, timers + i);
+    }
+
+    struct conn *conns = (struct conn *)zv_calloc(nconns, sizeof(struct conn));
+    for (int i=0; i<nconns; i++) {
+	int fd = ZV_OPENFD_MAX - nconns + i;
+	zv_io_init(&conns[i].io, read_cb, fd, ZV_READ);
+	conns[i].io.data = conns + i;
+	zv_io_start(lp, &conns[i].io);
+	zv_timer_init(&conns[i].idle, idle_cb, IDLE_TIMEOUT, 0.0);
+	zv_timer_start(lp, &conns[i].idle);
+	zv_mock_ready(lp, rnd(), fd, ZV_READ);
+    }
+
+    zv_timer end;
+    zv_timer_init(&end, end_cb, span, 0.0);
+    zv_timer_start(lp, &end);
+
+    if (record && zv_record_start(lp, record) < 0)
+	record = NULL;
+    events = 0;
+    *iterations = lp -> loop_cnt;
+    zv_tstamp start = bench_now();
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+    zv_tstamp elapsed = bench_now() - start;
+    *iterations = lp -> loop_cnt - *iterations;
+    if (record)
+	zv_record_stop(lp);
+
+    zv_free(conns);
+    zv_free(timers);
+    bench_loop_free(lp);
+    return elapsed;
+}
+
+/* the same run again, recorded, then replayed on stubs */
+void bench_virtual(void) {
+    int ntimers = bench_quick ? TIMERS / 10 : TIMERS;
+    int nconns = ZV_OPENFD_MAX / 2;
+    zv_tstamp span = (bench_quick ? MINUTES / 2 : MINUTES) * 60.0;
+    long secs = (long)span;
+    int iterations;
+
+    zv_tstamp elapsed = virtual_run(ntimers, nconns, span, NULL, &iterations);
+    bench_report("virtual", "events", (double)events, "events",
+		 "timers", (long)ntimers, "conns", (long)nconns, "seconds", secs, NULL);
+    bench_report("virtual", "dispatch", elapsed * 1e9 / events, "ns/event",
+		 "timers", (long)ntimers, "conns", (long)nconns, "seconds", secs, NULL);
+    bench_report("virtual", "speedup", span / elapsed, "x",
+		 "timers", (long)ntimers, "conns", (long)nconns, "seconds", secs, NULL);
+    bench_report("virtual", "iterations", (double)iterations, "loops",
+		 "timers", (long)ntimers, "conns", (long)nconns, "seconds", secs, NULL);
+
+    char path[] = "/tmp/zv_bench_recordXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+	perror("mkstemp");
+	return;
+    }
+    close(fd);
+
+    elapsed = virtual_run(ntimers, nconns, span, path, &iterations);
+    bench_report("virtual", "recorded", elapsed * 1e9 / events, "ns/event",
+		 "timers", (long)ntimers, "conns", (long)nconns, "seconds", secs, NULL);
+
+    struct zv_replay_stats st;
+    if (zv_replay(path, 0.0, NULL, &st) == 0) {
+	bench_report("virtual", "replay_events", (double)st.events, "events",
+		     "timers", (long)ntimers, "conns", (long)nconns, "seconds", secs, NULL);
+	bench_report("virtual", "replay", st.elapsed * 1e9 / st.events, "ns/event",
+		     "timers", (long)ntimers, "conns", (long)nconns, "seconds", secs, NULL);
+    }
+    unlink(path);
+}
@@ -0,0 +1,99 @@
+// cross-thread zv_loop_wakeup latency
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#if ZV_ENABLE_CHECK
+#define SAMPLES 100000
+
+struct pingpong {
+    zv_loop *lp;
+    zv_check check;
+    zv_tstamp *lat;
+    int nsamples;
+
+    zv_tstamp sent;		/* written before `req` is published */
+    int req;
+    int ack;
+};
+
+/* checks run at the end of every iteration, so also right after a wakeup */
+static void check_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    struct pingpong *pp = (struct pingpong *)(w -> data);
+    int req = __atomic_load_n(&pp -> req, __ATOMIC_ACQUIRE);
+    if (req == pp -> ack)
+	return;
+
+    pp -> lat[req - 1] = bench_now() - pp -> sent;
+    __atomic_store_n(&pp -> ack, req, __ATOMIC_RELEASE);
+    if (req == pp -> nsamples) {
+	zv_check_stop(lp, &pp -> check);
+	zv_loop_break(lp);
+    }
+}
+
+static void *pinger(void *arg) {
+    struct pingpong *pp = (struct pingpong *)arg;
+
+    for (int i=1; i<=pp -> nsamples; i++) {
+	/* let the loop go back to sleep in the poll first */
+	while (__atomic_load_n(&pp -> ack, __ATOMIC_ACQUIRE) != i - 1)
+	    sched_yield();
+	sched_yield();
+
+	pp -> sent = bench_now();
+	__atomic_store_n(&pp -> req, i, __ATOMIC_RELEASE);
+	zv_loop_wakeup(pp -> lp);
+    }
+    return NULL;
+}
+
+static int cmp_tstamp(const void *a, const void *b) {
+    zv_tstamp x = *(const zv_tstamp *)a, y = *(const zv_tstamp *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* from zv_loop_wakeup on another thread to a check callback on the loop thread */
+void bench_wakeup(void) {
+    struct pingpong pp;
+    pthread_t tid;
+
+    memset(&pp, 0, sizeof(pp));
+    pp.lp = bench_loop();
+    pp.nsamples = bench_quick ? SAMPLES / 10 : SAMPLES;
+    pp.lat = (zv_tstamp *)zv_calloc(pp.nsamples, sizeof(zv_tstamp));
+    zv_check_init(&pp.check, check_cb);
+    pp.check.data = &pp;
+    zv_check_start(pp.lp, &pp.check);
+
+    if (pthread_create(&tid, NULL, pinger, &pp) != 0) {
+	perror("pthread_create");
+	exit(1);
+    }
+    zv_loop_run(pp.lp, ZV_RUN_DEFAULT);
+    pthread_join(tid, NULL);
+
+    qsort(pp.lat, pp.nsamples, sizeof(zv_tstamp), cmp_tstamp);
+    zv_tstamp sum = 0.0;
+    for (int i=0; i<pp.nsamples; i++)
+	sum += pp.lat[i];
+
+    long n = pp.nsamples;
+    bench_report("wakeup", "mean", sum * 1e6 / n, "us", "samples", n, NULL);
+    bench_report("wakeup", "p50", pp.lat[n / 2] * 1e6, "us", "samples", n, NULL);
+    bench_report("wakeup", "p99", pp.lat[n * 99 / 100] * 1e6, "us", "samples", n, NULL);
+    bench_report("wakeup", "max", pp.lat[n - 1] * 1e6, "us", "samples", n, NULL);
+    zv_free(pp.lat);
+    bench_loop_free(pp.lp);
+}
+#else
+/* the loop side is a check watcher, which this build leaves out */
+void bench_wakeup(void) {
+}
+#endif // ZV_ENABLE_CHECK
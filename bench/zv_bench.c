@@ -0,0 +1,36 @@
+// the loop benchmark suite, results as JSON on stdout or in -o's file
+
+#include "bench.h"
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} benches[] = {
+    { "pending", bench_pending },
+    { "timers", bench_timers },
+    { "io", bench_io },
+    { "wakeup", bench_wakeup },
+    { "echo", bench_echo },
+    { "fiber", bench_fiber },
+    { "virtual", bench_virtual },
+    { "fs", bench_fs },
+    { "channel", bench_channel },
+    { "numa", bench_numa },
+    { "fork", bench_fork },
+    { "bucket", bench_bucket },
+    { "cork", bench_cork },
+};
+
+int main(int argc, char *argv[]) {
+    const char *path;
+    int first = bench_args(argc, argv, &path);
+
+    if (bench_open(path, "zv_bench") < 0)
+	return 1;
+    for (int i=0; i<(int)(sizeof(benches) / sizeof(benches[0])); i++) {
+	if (bench_selected(argc, argv, first, benches[i].name))
+	    benches[i].run();
+    }
+    bench_close();
+    return 0;
+}
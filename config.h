@@ -6,16 +6,62 @@
 
 #define CLOCK_TIME_BACKEND
 
+#define HAVE_EXECINFO_H
+/* #undef HAVE_SYS_SDT_H */
+#define HAVE_SYS_EVENTFD_H
+#define HAVE_LINUX_IO_URING_H
+#define HAVE_MEMFD_CREATE
+#define HAVE_LINUX_MEMPOLICY_H
+
+/*
+ * Build profile. Each setting can also be passed with -D, which is how
+ * the CMake options reach the sources, so nothing here overrides them.
+ * A single priority compiles the pending queue down to one FIFO.
+ */
+#ifndef ZV_MAX_PRI
 #define ZV_MAX_PRI 127
+#endif
+#ifndef ZV_MIN_PRI
 #define ZV_MIN_PRI 0
+#endif
 #define NUM_PRI (ZV_MAX_PRI - ZV_MIN_PRI + 1)
 
+/* optional watcher types, 0 leaves them out of the library */
+#ifndef ZV_ENABLE_SIGNAL
+#define ZV_ENABLE_SIGNAL 1
+#endif
+#ifndef ZV_ENABLE_IDLE
+#define ZV_ENABLE_IDLE 1
+#endif
+#ifndef ZV_ENABLE_PREPARE
+#define ZV_ENABLE_PREPARE 1
+#endif
+#ifndef ZV_ENABLE_CHECK
+#define ZV_ENABLE_CHECK 1
+#endif
+#ifndef ZV_ENABLE_EMBED
+#define ZV_ENABLE_EMBED 1
+#endif
+#ifndef ZV_ENABLE_CHILD
+#define ZV_ENABLE_CHILD 1
+#endif
+#ifndef ZV_ENABLE_STAT
+#define ZV_ENABLE_STAT 1
+#endif
+#ifndef ZV_ENABLE_PERIODIC
+#define ZV_ENABLE_PERIODIC 1
+#endif
+
+#if ZV_ENABLE_EMBED && !ZV_ENABLE_PREPARE
+#error "zv_embed needs zv_prepare"
+#endif
+
 #define DEFEAUL_PRI ((ZV_MAX_PRI - ZV_MIN_PRI + 1) / 2)
 
 #define SIGNUM 32
 
 #ifdef EPOLL_BACKEND
-#define EPOLL_EVENTMAX 64
+#define EPOLL_EVENTBLK 64
 #endif // EPOLL_BACKEND
 
 #define ZV_OPENFD_MAX 1024
@@ -8,21 +8,63 @@
 
 static struct zv_timer *sen_timer(void) {
     struct zv_timer *sen_timer;
-    sen_timer = (struct zv_timer *)calloc(1, sizeof(struct zv_timer));
-    if (sen_timer == NULL)
-	zv_err("calloc error");
+    sen_timer = (struct zv_timer *)zv_calloc(1, sizeof(struct zv_timer));
     sen_timer -> at = -1.0;
 
     return sen_timer;
 }
 
+/* place `w` at slot `i` and remember where it is */
+static inline void theap_set(struct zv_loop *lp, int i, struct zv_timer *w) {
+    lp -> timers[i] = w;
+    w -> idx = i;
+}
+
+static void theap_siftup(struct zv_loop *lp, int i) {
+    struct zv_timer *w = lp -> timers[i];
+
+    for (; (lp -> timers[i/2] -> at) > w -> at; i /= 2)
+	theap_set(lp, i, lp -> timers[i/2]);
+    theap_set(lp, i, w);
+}
+
+static void theap_siftdown(struct zv_loop *lp, int i) {
+    int child;
+    struct zv_timer *w = lp -> timers[i];
+
+    for (; i*2 <= lp -> timer_cnt; i = child) {
+	child = 2*i;
+	if (child != lp -> timer_cnt &&
+	    (lp -> timers[child] -> at) > (lp -> timers[child+1] -> at))
+	    child++;
+	if (w -> at > (lp -> timers[child] -> at))
+	    theap_set(lp, i, lp -> timers[child]);
+	else
+	    break;
+    }
+    theap_set(lp, i, w);
+}
+
+/* both arrays always have room for `timer_max` timers */
+static void theap_resize(struct zv_loop *lp, int max) {
+    lp -> timers = (struct zv_timer **)zv_realloc(lp -> timers, sizeof(void *) * (max + 1));
+    lp -> timer_due = (struct zv_timer **)zv_realloc(lp -> timer_due, sizeof(void *) * max);
+    lp -> timer_max = max;
+}
+
+/* floor(log2(n)), the depth of a heap with n timers */
+static int theap_depth(int n) {
+    int d = 0;
+    while (n >>= 1)
+	d++;
+    return d;
+}
+
 void theap_init(struct zv_loop *lp) {
     assert(lp);
 
-    lp -> timers = (struct zv_timer **)calloc((TIMER_BLK+1), sizeof(void *));
-    if (lp -> timers == NULL) {
-	zv_err("calloc error");
-    }
+    lp -> timers = (struct zv_timer **)zv_calloc((TIMER_BLK+1), sizeof(void *));
+    lp -> timer_due = (struct zv_timer **)zv_calloc(TIMER_BLK, sizeof(void *));
 
     lp -> timer_cnt = 0;
     lp -> timer_max = TIMER_BLK;
@@ -34,10 +76,11 @@ void theap_init(struct zv_loop *lp) {
 void theap_destroy(struct zv_loop *lp) {
     assert(lp);
 
-    free(lp -> timers);
+    zv_free(lp -> timers[0]);
+    zv_free(lp -> timers);
+    zv_free(lp -> timer_due);
     lp -> timers = NULL;	/* protect again dangling pointers */
-    if (errno)
-	zv_err("free error");
+    lp -> timer_due = NULL;
     lp -> timer_cnt = 0;
     lp -> timer_max = 0;
 }
@@ -45,37 +88,33 @@ void theap_destroy(struct zv_loop *lp) {
 void theap_makeempty(struct zv_loop *lp) {
     assert(lp);
 
-    lp -> timers = (struct zv_timer **)calloc((TIMER_BLK+1), sizeof(void *));
-    if (lp -> timers == NULL)
-	zv_err("calloc error");
+    struct zv_timer *sen = lp -> timers[0];
+    for (int i=1; i<=lp -> timer_cnt; i++)
+	lp -> timers[i] -> idx = 0;
+    zv_free(lp -> timers);
+    zv_free(lp -> timer_due);
+    lp -> timers = (struct zv_timer **)zv_calloc((TIMER_BLK+1), sizeof(void *));
+    lp -> timer_due = (struct zv_timer **)zv_calloc(TIMER_BLK, sizeof(void *));
     lp -> timer_cnt = 0;
     lp -> timer_max = TIMER_BLK;
-    lp -> timers[0] = sen_timer();
+    lp -> timers[0] = sen;
 }
 
 void theap_insert(struct zv_timer *w, struct zv_loop *lp) {
     assert(lp && lp -> timers);
     assert(w && w -> at >= 0);
     
-    if (lp -> timer_cnt == lp -> timer_max) {
-	lp -> timer_max += TIMER_BLK;
-	lp -> timers = (struct zv_timer **)realloc(lp -> timers,
-						   sizeof(void *) * (lp -> timer_max + 1));
-	if (lp -> timers == NULL)
-	    zv_err("realloc error");
-    }
-    int i;
+    if (lp -> timer_cnt == lp -> timer_max)
+	theap_resize(lp, lp -> timer_max + TIMER_BLK);
 
-    for (i = ++(lp -> timer_cnt); (lp -> timers[i/2] -> at) > w -> at; i /= 2) {
-	lp -> timers[i] = lp -> timers[i/2];
-    }
-    lp -> timers[i] = w;
+    lp -> timers[++(lp -> timer_cnt)] = w;
+    theap_siftup(lp, lp -> timer_cnt);
 }
 
 struct zv_timer *theap_findmin(struct zv_loop *lp) {
     assert(lp);
     if (theap_isempty(lp))
-	zv_err("timer heap is empty");
+	zv_err(1, "timer heap is empty");
 
     return lp -> timers[1];
 }
@@ -83,27 +122,139 @@ struct zv_timer *theap_findmin(struct zv_loop *lp) {
 struct zv_timer *theap_deletemin(struct zv_loop *lp) {
     assert(lp);
     if (theap_isempty(lp))
-	zv_err("timer heap is empty");
+	zv_err(1, "timer heap is empty");
     
-    int i, child;
-    struct zv_timer *min_timer, *last_timer;
+    struct zv_timer *min_timer = lp -> timers[1];
+    theap_delete(min_timer, lp);
 
-    min_timer = lp -> timers[1];
-    last_timer = lp -> timers[(lp -> timer_cnt)--];
-    
-    for (i = 1; i*2 <= lp -> timer_cnt; i=child) {
-	child = 2*i;
-	if (child != lp -> timer_cnt &&
-	    (lp -> timers[child] -> at) > (lp -> timers[child+1] -> at))
-	    child++;
-	if (last_timer -> at > (lp -> timers[child] -> at))
-	    lp -> timers[i] = lp -> timers[child];
-	else
-	    break;
+    return min_timer;
+}
+
+/* remove `w` from wherever it is in the heap */
+void theap_delete(struct zv_timer *w, struct zv_loop *lp) {
+    assert(lp && w);
+    assert(w -> idx > 0 && w -> idx <= lp -> timer_cnt && lp -> timers[w -> idx] == w);
+
+    int i = w -> idx;
+    struct zv_timer *last_timer = lp -> timers[(lp -> timer_cnt)--];
+    w -> idx = 0;
+    if (last_timer == w)
+	return;
+
+    theap_set(lp, i, last_timer);
+    if ((lp -> timers[i/2] -> at) > last_timer -> at)
+	theap_siftup(lp, i);
+    else
+	theap_siftdown(lp, i);
+}
+
+/* restore the heap property over all `timer_cnt` timers in O(n) */
+void theap_buildheap(struct zv_loop *lp) {
+    assert(lp && lp -> timers);
+
+    for (int i=1; i<=lp -> timer_cnt; i++)
+	lp -> timers[i] -> idx = i;
+    for (int i=lp -> timer_cnt/2; i>0; i--)
+	theap_siftdown(lp, i);
+}
+
+static void theap_collect(struct zv_loop *lp, int i, zv_tstamp now, int *cnt) {
+    /* a subtree whose root is not due has nothing due either */
+    if (i > lp -> timer_cnt || lp -> timers[i] -> at > now)
+	return;
+    lp -> timer_due[(*cnt)++] = lp -> timers[i];
+    theap_collect(lp, i*2, now, cnt);
+    theap_collect(lp, i*2 + 1, now, cnt);
+}
+
+/*
+ * Take every timer due by `now` out of the heap, into `timer_due`, and
+ * return how many there are. A few are popped one by one, oldest first.
+ * When popping would cost more than rebuilding, the rest of the heap is
+ * compacted and rebuilt instead, and the batch comes out in heap order.
+ */
+int theap_expire(struct zv_loop *lp, zv_tstamp now) {
+    assert(lp && lp -> timers);
+
+    int cnt = 0;
+    theap_collect(lp, 1, now, &cnt);
+    if (cnt == 0)
+	return 0;
+
+    if (cnt * theap_depth(lp -> timer_cnt) <= lp -> timer_cnt) {
+	for (int i=0; i<cnt; i++)
+	    lp -> timer_due[i] = theap_deletemin(lp);
+	return cnt;
     }
-    lp -> timers[i] = last_timer;
 
-    return min_timer;
+    for (int i=0; i<cnt; i++)
+	lp -> timer_due[i] -> idx = 0;
+    int n = 0;
+    for (int i=1; i<=lp -> timer_cnt; i++) {
+	if (lp -> timers[i] -> idx)
+	    lp -> timers[++n] = lp -> timers[i];
+    }
+    lp -> timer_cnt = n;
+    theap_buildheap(lp);
+    return cnt;
+}
+
+/* insert `cnt` timers, rebuilding the heap once if that is cheaper */
+void theap_bulkinsert(struct zv_timer **timers, int cnt, struct zv_loop *lp) {
+    assert(lp && lp -> timers);
+
+    int total = lp -> timer_cnt + cnt;
+    if (cnt * theap_depth(total) <= total) {
+	for (int i=0; i<cnt; i++)
+	    theap_insert(timers[i], lp);
+	return;
+    }
+
+    if (total > lp -> timer_max)
+	theap_resize(lp, (total + TIMER_BLK - 1) / TIMER_BLK * TIMER_BLK);
+    for (int i=0; i<cnt; i++) {
+	assert(timers[i] -> at >= 0);
+	lp -> timers[++(lp -> timer_cnt)] = timers[i];
+    }
+    theap_buildheap(lp);
+}
+
+/* give back the space above the current size, in TIMER_BLK steps */
+void theap_shrink(struct zv_loop *lp) {
+    assert(lp && lp -> timers);
+
+    int max = (lp -> timer_cnt + TIMER_BLK - 1) / TIMER_BLK * TIMER_BLK;
+    if (max < TIMER_BLK)
+	max = TIMER_BLK;
+    if (max == lp -> timer_max)
+	return;
+    theap_resize(lp, max);
+}
+
+static void theap_coalesce(struct zv_loop *lp, int i, zv_tstamp *wakeup) {
+    /* a subtree whose root is not due by `wakeup` has nothing due either */
+    if (i > lp -> timer_cnt || lp -> timers[i] -> at > *wakeup)
+	return;
+    if (lp -> timers[i] -> latest < *wakeup)
+	*wakeup = lp -> timers[i] -> latest;
+    theap_coalesce(lp, i*2, wakeup);
+    theap_coalesce(lp, i*2 + 1, wakeup);
+}
+
+/*
+ * The latest time to wake up at, such that every timer due by then still
+ * fires within its slack. Only the timers in that batch are visited.
+ */
+zv_tstamp theap_wakeup(struct zv_loop *lp) {
+    assert(lp);
+    if (theap_isempty(lp))
+	zv_err(1, "timer heap is empty");
+
+    zv_tstamp wakeup = lp -> timers[1] -> latest;
+    if (wakeup < lp -> timers[1] -> at)
+	wakeup = lp -> timers[1] -> at;
+    theap_coalesce(lp, 1, &wakeup);
+    return wakeup;
 }
 
 int theap_isempty(struct zv_loop *lp) {
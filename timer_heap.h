@@ -3,6 +3,10 @@
 
 #define TIMER_BLK 128
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct zv_loop;
 struct zv_timer;
 
@@ -12,8 +16,17 @@ void theap_makeempty(struct zv_loop *lp);
 void theap_insert(struct zv_timer *w, struct zv_loop *lp);
 struct zv_timer *theap_deletemin(struct zv_loop *lp);
 struct zv_timer *theap_findmin(struct zv_loop *lp);
+void theap_delete(struct zv_timer *w, struct zv_loop *lp);
+int theap_expire(struct zv_loop *lp, double now);
+void theap_bulkinsert(struct zv_timer **timers, int cnt, struct zv_loop *lp);
 /* int theap_isfull(struct zv_loop *lp); */
 int theap_isempty(struct zv_loop *lp);
-/* void theap_buildheap(struct zv_loop *lp, struct zv_timer **timers); */
+double theap_wakeup(struct zv_loop *lp);
+void theap_shrink(struct zv_loop *lp);
+void theap_buildheap(struct zv_loop *lp);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* TIMER_HEAP_H */
@@ -0,0 +1,46 @@
+// replay a zv_record_start() file on this build, and print how it went as JSON;
+// run it on two builds to compare dispatch overhead and scheduling order
+
+#include "zv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+int main(int argc, char *argv[]) {
+    const char *order = NULL;
+    double cost_us = 0.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:")) != -1) {
+	switch (opt) {
+	case 'c':
+	    cost_us = atof(optarg);
+	    break;
+	case 'd':
+	    order = optarg;
+	    break;
+	default:
+	    optind = argc + 1;
+	    break;
+	}
+    }
+    if (optind != argc - 1) {
+	fprintf(stderr, "usage: %s [-c callback_us] [-d order.txt] record.bin\n", argv[0]);
+	return 1;
+    }
+
+    struct zv_replay_stats st;
+    if (zv_replay(argv[optind], cost_us * 1e-6, order, &st) < 0)
+	return 1;
+
+    /* what is left once the stubs' own cost is taken out */
+    double overhead = st.events ? (st.elapsed - st.events * cost_us * 1e-6) * 1e9 / st.events : 0.0;
+    printf("{\"record\": \"%s\", \"priorities\": %d, \"events\": %" PRIu64
+	   ", \"iterations\": %" PRIu64 ", \"span\": %.6f, \"elapsed\": %.6f"
+	   ", \"overhead_ns\": %.1f, \"order\": \"%016" PRIx64 "\"}\n",
+	   argv[optind], NUM_PRI, st.events, st.iterations, st.span, st.elapsed,
+	   overhead, st.order);
+    return 0;
+}
@@ -0,0 +1,71 @@
+// convert a zv_trace_dump() file into Chrome trace event JSON, which
+// chrome://tracing and ui.perfetto.dev both open directly
+
+#include "zv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char *type_name(int type) {
+    switch (type) {
+    case ZV_TIMEDOUT: return "timer";
+    case ZV_SIGNAL: return "signal";
+    case ZV_IDLE: return "idle";
+    case ZV_PREPARE: return "prepare";
+    case ZV_CHECK: return "check";
+    default: return "io";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s trace.bin [out.json]\n", argv[0]);
+	return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+	perror(argv[1]);
+	return 1;
+    }
+    FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (out == NULL) {
+	perror(argv[2]);
+	return 1;
+    }
+
+    struct zv_trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	memcmp(hdr.magic, ZV_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	hdr.reclen != sizeof(struct zv_trace_rec)) {
+	fprintf(stderr, "%s: not a libzv trace\n", argv[1]);
+	return 1;
+    }
+
+    struct zv_trace_rec rec;
+    uint64_t base = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint64_t i=0; i<hdr.count; i++) {
+	if (fread(&rec, sizeof(rec), 1, in) != 1) {
+	    fprintf(stderr, "%s: truncated after %" PRIu64 " records\n", argv[1], i);
+	    break;
+	}
+	if (i == 0)
+	    base = rec.start;
+	/* one track per priority, timestamps in us */
+	fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"zv\",\"ph\":\"X\","
+		"\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"watcher\":\"0x%" PRIx64 "\",\"revents\":%d,\"priority\":%d}}",
+		i ? "," : "", type_name(rec.type),
+		(rec.start - base) / 1e3, (rec.end - rec.start) / 1e3, rec.priority,
+		rec.watcher, rec.revents, rec.priority);
+    }
+    fprintf(out, "\n]}\n");
+
+    fclose(in);
+    if (out != stdout)
+	fclose(out);
+    return 0;
+}
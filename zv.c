@@ -1,5 +1,6 @@
 #include "config.h"
 #include "zv.h"
+#include "zv_probes.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,8 +17,17 @@
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <math.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif // HAVE_SYS_EVENTFD_H
 
 #define ARRAY_BLK 128
+#define TIME_JUMP 1.0		/* wall clock drift from the monotonic clock taken as a jump */
 
 #define __FILENAME__ (strrchr(__FILE__, '/') ? (strrchr(__FILE__, '/') + 1) : __FILE__)
 
@@ -32,6 +42,27 @@
 
 void epoll_init(zv_loop *lp);
 void epoll_destroy(zv_loop *lp);
+void epoll_shrink(zv_loop *lp);
+
+void fiber_stacks_shrink(zv_loop *lp, int keep);
+
+uint64_t trace_clock(void);
+void trace_event(zv_loop *lp, zv_watcher *w, int revents, int pri, uint64_t start);
+
+void record_event(zv_loop *lp, int type, int arg, uint64_t value);
+void record_time(zv_loop *lp, zv_tstamp now);
+
+void aio_submit(zv_loop *lp);
+void aio_fork(zv_loop *lp);
+void aio_destroy(zv_loop *lp);
+void rate_destroy(zv_loop *lp);
+void cork_flush(zv_loop *lp);
+void cork_destroy(zv_loop *lp);
+void watchdog_fork(zv_loop *lp);
+void mock_destroy(zv_loop *lp);
+
+void ref_loop(zv_loop *lp);
+void unref_loop(zv_loop *lp);
 
 // ===============================
 zv_tstamp zv_time(void) {
@@ -41,17 +72,39 @@ zv_tstamp zv_time(void) {
     if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
 	zv_err(1, "clock_gettime error");
     }
-    now = ts.tv_sec * 1e-9 + ts.tv_nsec;
+    now = ts.tv_sec + ts.tv_nsec * 1e-9;
 #else
     struct timeval tv;
     if (gettimeofday(&tv, NULL) < 0) {
 	zv_err(1, "gettimeofday error");
     }
-    now = tv.tv_sec * 1e-6 + tv.tv_usec;
+    now = tv.tv_sec + tv.tv_usec * 1e-6;
 #endif
     return now;
 }
 
+/* never jumps, only used to measure how far the wall clock did */
+static zv_tstamp mono_time(void) {
+#ifdef CLOCK_TIME_BACKEND
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+	zv_err(1, "clock_gettime error");
+    }
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return zv_time();
+#endif
+}
+
+/* what the loop counts time with, the system clocks unless zv_loop_set_clock */
+static zv_tstamp loop_time(zv_loop *lp) {
+    return lp -> clock_now ? lp -> clock_now(lp) : zv_time();
+}
+
+static zv_tstamp loop_mono(zv_loop *lp) {
+    return lp -> clock_mono ? lp -> clock_mono(lp) : mono_time();
+}
+
 void zv_err(int flag, const char *fmt, ...) {
     va_list args;
     fprintf(stderr, "[ERROR:%s:%d]: ", __FILENAME__, __LINE__);
@@ -82,13 +135,76 @@ void zv_debug(const char *fmt, ...) {
 }
 
 // ===============================
+// memory allocation
+
+static void *zv_realloc_default(void *ptr, long size) {
+    if (size)
+	return realloc(ptr, size);
+    free(ptr);
+    return NULL;
+}
+
+static void *(*zv_alloc)(void *ptr, long size) = zv_realloc_default;
+static int zv_allocated;	/* set by the first allocation, the allocator is fixed from then on */
+
+/*
+ * `cb` has realloc semantics, except that a size of 0 must free `ptr`.
+ * Call it before anything is allocated: blocks from the old allocator
+ * would be freed with the new one, so a later swap is refused with -1.
+ */
+int zv_set_allocator(void *(*cb)(void *ptr, long size)) {
+    if (__atomic_load_n(&zv_allocated, __ATOMIC_RELAXED)) {
+	errno = EBUSY;
+	zv_err(0, "the allocator must be set before the first allocation");
+	return -1;
+    }
+    zv_alloc = cb ? cb : zv_realloc_default;
+    return 0;
+}
+
+void *zv_realloc(void *ptr, long size) {
+    if (ptr == NULL && !__atomic_load_n(&zv_allocated, __ATOMIC_RELAXED))
+	__atomic_store_n(&zv_allocated, 1, __ATOMIC_RELAXED);
+    ptr = zv_alloc(ptr, size);
+    if (ptr == NULL && size)
+	zv_err(1, "cannot allocate %ld bytes", size);
+    return ptr;
+}
+
+void *zv_calloc(long cnt, long size) {
+    long total;
+
+    if (cnt < 0 || size < 0 || __builtin_mul_overflow(cnt, size, &total)) {
+	errno = EOVERFLOW;
+	zv_err(1, "cannot allocate %ld elements of %ld bytes", cnt, size);
+    }
+    void *ptr = zv_realloc(NULL, total);
+    memset(ptr, 0, total);
+    return ptr;
+}
+
+void zv_free(void *ptr) {
+    if (ptr)
+	zv_alloc(ptr, 0);
+}
+
 // alloc array dynamically
 static void* array_alloc(void *arr, int cnt, int size) {
-    void *narr = realloc(arr, cnt * size);
-    if (narr == NULL)
-	zv_err(1, "realloc error");
+    return zv_realloc(arr, (long)cnt * size);
+}
+
+// shrink an array to the ARRAY_BLK multiple that still holds `used` slots
+static void *array_shrink(void *arr, int *max, int used, int size) {
+    int nmax = (used + ARRAY_BLK - 1) / ARRAY_BLK * ARRAY_BLK;
+    if (nmax >= *max)
+	return arr;
 
-    return narr;
+    *max = nmax;
+    if (nmax == 0) {
+	zv_free(arr);
+	return NULL;
+    }
+    return array_alloc(arr, nmax, size);
 }
 
 // ===============================
@@ -97,18 +213,60 @@ static void* array_alloc(void *arr, int cnt, int size) {
 static int adjust_pri(zv_watcher *w) {
     assert(w);
 
+#if NUM_PRI == 1
+    return ZV_MIN_PRI;
+#else
     int pri = w -> priority;
     if (pri < ZV_MIN_PRI)
 	pri = ZV_MIN_PRI;
     if (pri > ZV_MAX_PRI)
 	pri = ZV_MAX_PRI;
     return pri;
+#endif // NUM_PRI == 1
 }
 
-/* feed an occurred event to `zv_loop` */
-void zv_feed_event(zv_loop *lp, zv_watcher *w, int revents) {
+#if NUM_PRI == 1
+/*
+ * With a single priority the pending array is a FIFO, events are queued
+ * at `pendingtail` and never look for a free slot.
+ */
+static void feed_event_from(zv_loop *lp, zv_watcher *w, int revents, int *from) {
+    (void)from;			/* unused */
+
+    ZV_PROBE3(feed_event, lp, w, revents);
+
+    if (w -> pending) {
+	struct ANPENDING *pending = (lp -> anpendings)[0] + (w -> pending - 1);
+	assert(pending -> active);
+
+	pending -> events |= revents;
+	return;
+    }
+
+    int idx = lp -> pendingtail++;
+    if (idx == lp -> pendingmax[0]) {
+	(lp -> anpendings)[0] = array_alloc((lp -> anpendings)[0],
+					    lp -> pendingmax[0] + ARRAY_BLK,
+					    sizeof(struct ANPENDING));
+	lp -> pendingmax[0] += ARRAY_BLK;
+    }
+    w -> pending = idx + 1;
+    lp -> pendingcnt += 1;
+    (lp -> anpendings)[0][idx].active = 1;
+    (lp -> anpendings)[0][idx].events = revents;
+    (lp -> anpendings)[0][idx].watcher = w;
+}
+#else
+/*
+ * Feed to the first free pending slot at or after `*from`. Slots only get
+ * freed by `call_pending`, so a batch can carry on scanning where the
+ * previous event of the same priority went.
+ */
+static void feed_event_from(zv_loop *lp, zv_watcher *w, int revents, int *from) {
     int pri = adjust_pri(w);
 
+    ZV_PROBE3(feed_event, lp, w, revents);
+
     if (w -> pending) {
 	/* if watcher is already in pending list */
 	struct ANPENDING *pending = (lp -> anpendings)[pri] + (w -> pending -1);
@@ -120,7 +278,7 @@ void zv_feed_event(zv_loop *lp, zv_watcher *w, int revents) {
 
     int idx;
     struct ANPENDING pending;
-    for (idx = 0; idx < (lp -> pendingmax)[pri]; idx++) {
+    for (idx = from[pri]; idx < (lp -> pendingmax)[pri]; idx++) {
 	pending = (lp -> anpendings)[pri][idx];
 	if (pending.active == 0)
 	    break;
@@ -130,36 +288,47 @@ void zv_feed_event(zv_loop *lp, zv_watcher *w, int revents) {
 	(lp -> anpendings)[pri] = array_alloc((lp -> anpendings)[pri],
 		    lp -> pendingmax[pri]+ARRAY_BLK,
 		    sizeof(struct ANPENDING));
+	/* new slots must read as free */
+	memset((lp -> anpendings)[pri] + idx, 0, ARRAY_BLK * sizeof(struct ANPENDING));
 	lp -> pendingmax[pri] += ARRAY_BLK;
     }
     w -> pending = idx + 1;
+    lp -> pendingcnt += 1;
     (lp -> anpendings)[pri][idx].active = 1;
     (lp -> anpendings)[pri][idx].events = revents;
     (lp -> anpendings)[pri][idx].watcher = w;
+    from[pri] = idx + 1;
 }
+#endif // NUM_PRI == 1
 
-/* void queue_events(zv_loop *lp, zv_watcher **w, int eventcnt, int type) { */
-/*     for (int i=0; i<eventcnt; i++) { */
-/* 	zv_feed_event(lp, w[i], type); */
-/*     } */
-/* } */
+/* feed an occurred event to `zv_loop` */
+void zv_feed_event(zv_loop *lp, zv_watcher *w, int revents) {
+    int from[NUM_PRI];
+
+    from[adjust_pri(w)] = 0;
+    feed_event_from(lp, w, revents, from);
+}
+
+/* feed the same event to a batch of watchers */
+void queue_events(zv_loop *lp, zv_watcher **w, int eventcnt, int type) {
+    int from[NUM_PRI] = {0};
+
+    for (int i=0; i<eventcnt; i++)
+	feed_event_from(lp, w[i], type, from);
+}
 
 // ===============================
 /* file desriptor related events */
 
 // feed events happened on fd to `zv_loop`
 void fd_event(zv_loop *lp, int fd, int revents) {
-    assert(fd >= 0 && fd <= ZV_OPENFD_MAX);
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
 
-    struct ANFD *anfdp = (lp -> anfds)[fd];
-    assert(anfdp);
-    
-    struct ANFD anfd;
-    for (int i=0; i<(lp -> anfds_max)[fd]; i++) {
-	anfd = *(anfdp + i);
-	if (anfd.active && (anfd.events & revents)) {
-	    zv_feed_event(lp, anfd.watcher, revents & anfd.events);
-	}
+    if (lp -> record)
+	record_event(lp, ZV_REC_FD, fd, revents);
+    for (zv_io *w = (lp -> anfds)[fd].head; w; w = w -> next) {
+	if (w -> events & revents)
+	    zv_feed_event(lp, (zv_watcher *)w, revents & w -> events);
     }
 }
 
@@ -172,56 +341,47 @@ int fd_valid(int fd) {
 
 // kill a fd
 void fd_kill(zv_loop *lp, int fd) {
-    assert(fd >= 0 && fd <= ZV_OPENFD_MAX);
-
-    struct ANFD *anfdp = (lp -> anfds)[fd];
-    if (anfdp == NULL)
-	return;
-
-    struct ANFD *anfd;
-    for (int i=0; i<(lp -> anfds_max)[fd]; i++) {
-	anfd = (anfdp + i);
-	if (anfd -> active) {
-	    zv_io_stop(lp, (zv_io *)(anfd -> watcher));
-	    anfd -> active = 0;
-	    // events on fd are interrupted, so we sent an error
-	    zv_feed_event(lp, anfd -> watcher, ZV_ERROR | ZV_READ | ZV_WRITE);
-	}
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
+
+    zv_io *w, *next;
+    for (w = (lp -> anfds)[fd].head; w; w = next) {
+	next = w -> next;
+	zv_io_stop(lp, w);
+	// events on fd are interrupted, so we sent an error
+	zv_feed_event(lp, (zv_watcher *)w, ZV_ERROR | ZV_READ | ZV_WRITE);
     }
-    (lp -> backend_modify)(lp, fd, -1);
 }
 
+// queue fd for `fd_reify`, at most once per iteration
 void fd_change(zv_loop *lp, int fd) {
-    assert(fd >= 0 && fd <= ZV_OPENFD_MAX);
-    assert(fd_valid(fd));
-    
-    lp -> fdchanges[fd] = 1;
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
+
+    struct ANFD *anfd = (lp -> anfds) + fd;
+    if (anfd -> reify)
+	return;
+    anfd -> reify = 1;
+    (lp -> fdchanges)[(lp -> fdchange_cnt)++] = fd;
 }
 
 void fd_reify(zv_loop *lp) {
     assert(lp);
 
-    struct ANFD *anfd;
-    for (int fd = 0; fd<ZV_OPENFD_MAX; fd++) {
-	if ((lp -> fdchanges)[fd]) {
-	    int events = ZV_NONE;
-	    for (int j=0; j<(lp -> anfds_max)[fd]; j++) {
-		anfd = ((lp -> anfds)[fd] + j) ;
-		if (anfd -> active == 0)
-		    continue;
-		
-		zv_io *w = (zv_io *)(anfd -> watcher);
-		if (w -> active == 0)
-		    continue;
-		if (w -> events != anfd -> events) {
-		    anfd -> events = w -> events;
-		}
-		events |= w -> events;
-	    }
+    for (int i=0; i<(lp -> fdchange_cnt); i++) {
+	int fd = (lp -> fdchanges)[i];
+	struct ANFD *anfd = (lp -> anfds) + fd;
+	int events = ZV_NONE;
+
+	for (zv_io *w = anfd -> head; w; w = w -> next)
+	    events |= w -> events;
+	anfd -> reify = 0;
+
+	/* an fd without watchers was already removed by `delete_anfd` */
+	if (anfd -> head && events != anfd -> events) {
+	    anfd -> events = events;
 	    lp -> backend_modify(lp, fd, events);
-	    (lp -> fdchanges)[fd] = 0;
 	}
     }
+    lp -> fdchange_cnt = 0;
 }
 
 // ===============================
@@ -238,7 +398,9 @@ int clear_pending(zv_loop *lp, zv_watcher *w) {
 	pending -> events = ZV_NONE;
 	pending -> active = 0;
 	pending -> watcher = NULL;
-	    
+	w -> pending = 0;
+	lp -> pendingcnt -= 1;
+
 	return events;
     }
     return 0;    
@@ -246,81 +408,161 @@ int clear_pending(zv_loop *lp, zv_watcher *w) {
 
 void zv_invoke(zv_loop *lp, zv_watcher *w, int revents) {
     assert(lp && w);
-    
-    (w -> cb)(lp, w, revents);
+
+    /* the callback may free `w` or toggle tracing, so sample both up front */
+    struct zv_trace *trace = lp -> trace;
+    uint64_t start = trace ? trace_clock() : 0;
+    int pri = w -> priority;
+    ZV_PROBE3(invoke_start, lp, w, revents);
+
+    /* the watchdog thread samples `cb_watcher`, keep this to plain stores on each side */
+    w_cb cb = w -> cb;
+    __atomic_store_n(&lp -> cb_fn, cb, __ATOMIC_RELAXED);
+    __atomic_store_n(&lp -> cb_watcher, w, __ATOMIC_RELEASE);
+    cb(lp, w, revents);
+    __atomic_store_n(&lp -> cb_watcher, NULL, __ATOMIC_RELEASE);
+
+    ZV_PROBE2(invoke_end, lp, w);
+    if (trace && lp -> trace == trace)
+	trace_event(lp, w, revents, pri, start);
 }
 
+#if NUM_PRI == 1
+/*
+ * Run what was queued when the call started, in order. Events fed by the
+ * callbacks are moved to the front for the next call, so a watcher that
+ * feeds itself does not run twice in one pass.
+ */
+void call_pending(zv_loop *lp) {
+    struct ANPENDING *pending;
+    int end = lp -> pendingtail;
+
+    for (int i=0; i<end; i++) {
+	/* callbacks may feed events and grow the array, so index it every time */
+	pending = (lp -> anpendings)[0] + i;
+	if (!pending -> active)
+	    continue;
+
+	zv_watcher *w = pending -> watcher;
+	int events = pending -> events;
+	pending -> active = 0;
+	w -> pending = 0;
+	lp -> pendingcnt -= 1;
+
+	zv_invoke(lp, w, events);
+    }
+
+    int left = 0;
+    for (int i=end; i<lp -> pendingtail; i++) {
+	pending = (lp -> anpendings)[0] + i;
+	if (!pending -> active)
+	    continue;
+	(lp -> anpendings)[0][left] = *pending;
+	pending -> active = 0;
+	pending -> watcher -> pending = ++left;
+    }
+    lp -> pendingtail = left;
+}
+#else
 void call_pending(zv_loop *lp) {
     for (int pri = ZV_MAX_PRI; pri >= ZV_MIN_PRI; pri--) {
-	struct ANPENDING *pendings = (lp -> anpendings)[pri];
 	struct ANPENDING *pending;
+	/* callbacks may feed events and grow the array, so index it every time */
 	for (int i=0; i<(lp -> pendingmax)[pri]; i++) {
-	    pending = (pendings + i);
-	    if (pending -> active) {
-		assert(pending -> watcher);
+	    pending = (lp -> anpendings)[pri] + i;
+	    if (!pending -> active)
+		continue;
+	    assert(pending -> watcher);
 
-		zv_invoke(lp, pending -> watcher, pending -> events);
-	    }
+	    zv_watcher *w = pending -> watcher;
+	    int events = pending -> events;
 	    pending -> active = 0;
 	    pending -> events = ZV_NONE;
 	    pending -> watcher = NULL;
+	    w -> pending = 0;
+	    lp -> pendingcnt -= 1;
+
+	    zv_invoke(lp, w, events);
 	}
     }
 }
+#endif // NUM_PRI == 1
 
 
 // ==================================
 // timers
 
+/*
+ * Push `at` up to the next multiple of the slack, timers sharing a slack
+ * then expire together instead of each waking the loop.
+ */
+static void timer_round(zv_timer *w) {
+    w -> latest = w -> at + w -> slack;
+    if (w -> slack > 0.0)
+	w -> at = ceil(w -> at / w -> slack) * w -> slack;
+}
+
+static void zv_stop(zv_loop *lp, zv_watcher *w);
+
 void timers_reify(zv_loop *lp) {
     assert(lp);
     
     zv_tstamp now = lp -> zv_now;
 
-    zv_timer *top;
-    while (!theap_isempty(lp) &&
-	   (top = theap_deletemin(lp)) && (top -> at < now)) {
-	if (top -> repeat > 0.0) {
-	    top -> at = now + top -> repeat;
-	    theap_insert(top, lp);
+    int cnt = theap_expire(lp, now);
+    if (cnt == 0)
+	return;
+
+    /* move the repeating timers to the front of the batch */
+    zv_timer **due = lp -> timer_due;
+    int rearm = 0;
+    for (int i=0; i<cnt; i++) {
+	zv_timer *w = due[i];
+	if (w -> repeat > 0.0) {
+	    w -> at = now + w -> repeat;
+	    timer_round(w);
+	    due[i] = due[rearm];
+	    due[rearm++] = w;
 	} else {
-	    zv_timer_stop(lp, top);
+	    zv_stop(lp, (zv_watcher *)w);
 	}
-	if (top -> active)
-	    zv_feed_event(lp, (zv_watcher *)top, ZV_TIMEDOUT);
     }
+    /* fewer timers than were just taken out, so `timer_due` does not move */
+    theap_bulkinsert(due, rearm, lp);
 
-    lp -> zv_now = zv_time();
+    if (lp -> record) {
+	for (int i=0; i<cnt; i++)
+	    record_event(lp, ZV_REC_TIMER, 0, (uintptr_t)due[i]);
+    }
+    queue_events(lp, (zv_watcher **)due, cnt, ZV_TIMEDOUT);
 }
 
 // ===================================
 // idles
 
+#if ZV_ENABLE_IDLE
 void idles_reify(zv_loop *lp) {
     assert(lp);
 
     zv_idle **idles;
     for (int pri = ZV_MAX_PRI; pri >= ZV_MIN_PRI; pri--) {
-	if ((lp -> idle_cnt)[pri] == 0)
-	    continue;
 	idles = (lp -> idles)[pri];
-	for (int i=0; i<(lp -> idle_cnt)[pri]; i++) {
-	    zv_idle *idle = idles[i];
-	    if (idle -> active) {
-		zv_feed_event(lp, (zv_watcher *)idle, ZV_IDLE);
-	    }
-	}
+	for (int i=0; i<(lp -> idle_cnt)[pri]; i++)
+	    zv_feed_event(lp, (zv_watcher *)idles[i], ZV_IDLE);
     }
 }
+#endif // ZV_ENABLE_IDLE
 
 // ====================================
 // signals
 
+#if ZV_ENABLE_SIGNAL
 static int pipefd[2];
-static zv_io *sig_io;
+static zv_io sig_io;
 static int sigrefs[SIGNUM];
 static zv_signal **signals[SIGNUM];
 static int signals_max[SIGNUM];
+static int signals_cnt[SIGNUM];
 
 /* we use a thread to receive signals */
 void * sig_handler(void *arg) {
@@ -340,25 +582,168 @@ void * sig_handler(void *arg) {
 }
 
 static void sig_cb(zv_loop *lp, zv_watcher *w, int revents) {
-    int signo, n;
+    (void)w;			/* unused */
+    unsigned char signo;
+    int n;
     if (revents & ZV_READ) {
 	n = read(pipefd[0], &signo, 1);
 	if (n != 1) {
 	    zv_err(1, "read from signal pipe error");
 	}
+	if (lp -> record)
+	    record_event(lp, ZV_REC_SIGNAL, signo, pipefd[0]);
 	zv_feed_signal(lp, signo);
     }
 }
 
+/* the signal thread is started by the first run of the default loop */
+static void sig_start(zv_loop *lp) {
+    sigset_t mask;
+    pthread_t tid;
+    pthread_attr_t attr;
+    int err;
+    sigfillset(&mask);
+    sigdelset(&mask, ZV_WATCHDOG_SIGNO); /* sent to this thread only */
+    if (sigprocmask(SIG_SETMASK, &mask, NULL) < 0)
+	zv_err(1, "sigprocmask error");
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, sig_handler, NULL);
+    if (err)
+	zv_err(1, "pthread_create error: %s", strerror(err));
+    pthread_attr_destroy(&attr);
+    lp -> sig_started = 1;
+}
+
+/* a forked child gets a pipe of its own, the next run starts its signal thread */
+static void sig_fork(zv_loop *lp) {
+    ref_loop(lp);
+    zv_io_stop(lp, &sig_io);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    if (pipe(pipefd) < 0)
+	zv_err(1, "pipe error");
+    zv_io_init(&sig_io, sig_cb, pipefd[0], ZV_READ);
+    zv_io_start(lp, &sig_io);
+    unref_loop(lp);
+    lp -> sig_started = 0;
+}
+#endif // ZV_ENABLE_SIGNAL
+
 // ====================================
 // zv_loop
 
+void ref_loop(zv_loop *lp) {
+    (lp -> activecnt)++;
+}
+
+void unref_loop(zv_loop *lp) {
+    (lp -> activecnt)--;
+}
+
+static void wakeup_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)w; (void)revents;	/* unused */
+    char buf[64];
+
+    /*
+     * Drain first: a wakeup between clearing and draining would be eaten
+     * with the flag left set, and no later one would write again. One
+     * that finds the flag still set is coalesced into this iteration, the
+     * exchange makes what it published visible to the callbacks after.
+     */
+    while (read((lp -> wakeup_fd)[0], buf, sizeof(buf)) > 0)
+	;
+    __atomic_exchange_n(&lp -> wakeup_pending, 0, __ATOMIC_ACQ_REL);
+}
+
+/* an fd any thread can write to, so a blocking poll returns */
+static void wakeup_init(zv_loop *lp) {
+#ifdef HAVE_SYS_EVENTFD_H
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+	zv_err(1, "eventfd error");
+    (lp -> wakeup_fd)[0] = (lp -> wakeup_fd)[1] = fd;
+#else
+    if (pipe(lp -> wakeup_fd) < 0)
+	zv_err(1, "pipe error");
+    for (int i=0; i<2; i++) {
+	fcntl((lp -> wakeup_fd)[i], F_SETFL, O_NONBLOCK);
+	fcntl((lp -> wakeup_fd)[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif // HAVE_SYS_EVENTFD_H
+    lp -> wakeup_pending = 0;
+
+    /* internal, must not keep the loop alive */
+    zv_io_init(&lp -> wakeup_io, wakeup_cb, (lp -> wakeup_fd)[0], ZV_READ);
+    zv_io_start(lp, &lp -> wakeup_io);
+    unref_loop(lp);
+}
+
+void zv_loop_wakeup(zv_loop *lp) {
+    assert(lp);
+
+    if (__atomic_exchange_n(&lp -> wakeup_pending, 1, __ATOMIC_ACQ_REL))
+	return;			/* already on its way */
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t one = 1;
+    write((lp -> wakeup_fd)[1], &one, sizeof(one));
+#else
+    char one = 1;
+    write((lp -> wakeup_fd)[1], &one, 1);
+#endif // HAVE_SYS_EVENTFD_H
+}
+
+/* pollable fd that turns readable when the loop has events, for embedding */
+int zv_backend_fd(zv_loop *lp) {
+    assert(lp);
+
+    return lp -> backend_fd;
+}
+
+/* make `zv_loop_run` return after the current iteration, from any thread */
+void zv_loop_break(zv_loop *lp) {
+    assert(lp);
+
+    __atomic_store_n(&lp -> loop_done, 1, __ATOMIC_RELEASE);
+    if (!pthread_equal(pthread_self(), lp -> tid))
+	zv_loop_wakeup(lp);
+}
+
+/*
+ * Count time with `now` (wall clock, what timers and periodics use) and
+ * `mono` (must never jump, only used to spot wall clock jumps) instead of
+ * the system clocks. NULL restores the system's, a NULL `mono` follows
+ * `now`. Timers started before keep their deadline on the old clock.
+ */
+void zv_loop_set_clock(zv_loop *lp, zv_tstamp (*now)(zv_loop *lp),
+		       zv_tstamp (*mono)(zv_loop *lp)) {
+    assert(lp);
+
+    lp -> clock_now = now;
+    lp -> clock_mono = mono ? mono : now;
+    lp -> zv_now = loop_time(lp);
+    lp -> mn_now = loop_mono(lp);
+}
+
+/* the time on the loop's clock right now, `zv_now` is as of the last poll */
+zv_tstamp zv_loop_time(zv_loop *lp) {
+    assert(lp);
+    return loop_time(lp);
+}
+
 void zv_loop_init(zv_loop *lp) {
     assert(lp);
 
+    lp -> clock_now = NULL;
+    lp -> clock_mono = NULL;
+    lp -> mock = NULL;
     lp -> zv_now = zv_time();
+    lp -> mn_now = mono_time();
     lp -> loop_cnt = 0;
     lp -> backend = 0;
+    lp -> backend_fork = NULL;
 
 
 #ifdef EPOLL_BACKEND
@@ -380,11 +765,14 @@ void zv_loop_init(zv_loop *lp) {
 #endif // POLL_BACKEND    
 
     for (int fd=0; fd<ZV_OPENFD_MAX; fd++) {
-	(lp -> anfds)[fd] = NULL;
-	(lp -> anfds_max)[fd] = 0;
-	(lp -> anfds_cnt)[fd] = 0;
-	(lp -> fdchanges)[fd] = 0;
+	(lp -> anfds)[fd].head = NULL;
+	(lp -> anfds)[fd].events = ZV_NONE;
+	(lp -> anfds)[fd].reify = 0;
     }
+    lp -> fd_cnt = 0;
+    lp -> fdchange_cnt = 0;
+    lp -> pendingcnt = 0;
+    lp -> pendingtail = 0;
 
     for (int pri=ZV_MIN_PRI; pri<=ZV_MAX_PRI; pri++) {
 	(lp -> anpendings)[pri] = NULL;
@@ -397,15 +785,110 @@ void zv_loop_init(zv_loop *lp) {
 
     theap_init(lp);
 
+    lp -> periodics = NULL;
+    lp -> periodic_max = lp -> periodic_cnt = 0;
+
     lp -> prepares = NULL;
     lp -> prepare_max = lp -> prepare_cnt = 0;
     
     lp -> checks = NULL;
     lp -> check_max = lp -> check_cnt = 0;
 
+    lp -> idleall = 0;
     lp -> is_default = 0;
     lp -> activecnt = 0;
     lp -> loop_cnt = 0;
+    lp -> loop_done = 0;
+    lp -> sig_started = 0;
+    lp -> tid = pthread_self();
+    lp -> cpu = -1;
+    lp -> node = -1;
+
+    lp -> cb_watcher = NULL;
+    lp -> cb_fn = NULL;
+    lp -> watchdog = NULL;
+    lp -> trace = NULL;
+    lp -> record = NULL;
+    lp -> aio = NULL;
+    lp -> rate = NULL;
+    lp -> cork = NULL;
+
+    zv_pool_init(&(lp -> pools)[ZV_POOL_IO], sizeof(zv_io), ZV_POOL_SLAB);
+    zv_pool_init(&(lp -> pools)[ZV_POOL_TIMER], sizeof(zv_timer), ZV_POOL_SLAB);
+    zv_pool_init(&(lp -> pools)[ZV_POOL_SIGNAL], sizeof(zv_signal), ZV_POOL_SLAB);
+    zv_pool_init(&(lp -> pools)[ZV_POOL_IDLE], sizeof(zv_idle), ZV_POOL_SLAB);
+    zv_pool_init(&(lp -> pools)[ZV_POOL_PREPARE], sizeof(zv_prepare), ZV_POOL_SLAB);
+    zv_pool_init(&(lp -> pools)[ZV_POOL_CHECK], sizeof(zv_check), ZV_POOL_SLAB);
+    for (int i=0; i<ZV_POOL_MEMCLS; i++)
+	zv_pool_init(&(lp -> pools)[ZV_POOL_MEM + i], ZV_POOL_MEMMIN << i, ZV_POOL_MEMSLAB);
+    lp -> fiber_stacks = NULL;
+    lp -> fiber_stack_cnt = 0;
+    lp -> shrink_arrays = 0;
+
+    lp -> fs_fd = -1;
+    lp -> fs_hash = NULL;
+    lp -> fs_hashmax = lp -> fs_hashcnt = 0;
+    lp -> fs_changes = NULL;
+
+    wakeup_init(lp);
+}
+
+/*
+ * Give back everything zv_loop_init and the loop's use of it acquired,
+ * but not the memory of `lp` itself. The watchers are the caller's and
+ * are not called again, corked output not yet written is dropped and no
+ * zv_fs request may be in flight. Not for the default loop, whose
+ * signal thread keeps using it.
+ */
+void zv_loop_destroy(zv_loop *lp) {
+    assert(lp && !lp -> is_default);
+
+    if (lp -> watchdog)
+	zv_watchdog_stop(lp);
+    if (lp -> trace)
+	zv_trace_stop(lp);
+    if (lp -> record)
+	zv_record_stop(lp);
+    if (lp -> aio)
+	aio_destroy(lp);
+    if (lp -> rate)
+	rate_destroy(lp);
+    if (lp -> cork)
+	cork_destroy(lp);
+
+    if (lp -> fs_fd >= 0)
+	close(lp -> fs_fd);
+    zv_free(lp -> fs_hash);
+    lp -> fs_fd = -1;
+    lp -> fs_hash = NULL;
+    lp -> fs_hashmax = lp -> fs_hashcnt = 0;
+
+    close((lp -> wakeup_fd)[0]);
+    if ((lp -> wakeup_fd)[1] != (lp -> wakeup_fd)[0])
+	close((lp -> wakeup_fd)[1]);
+
+    mock_destroy(lp);
+#ifdef EPOLL_BACKEND
+    epoll_destroy(lp);
+#endif // EPOLL_BACKEND
+
+    for (int pri=ZV_MIN_PRI; pri<=ZV_MAX_PRI; pri++) {
+	zv_free((lp -> anpendings)[pri]);
+	zv_free((lp -> idles)[pri]);
+	(lp -> anpendings)[pri] = NULL;
+	(lp -> idles)[pri] = NULL;
+    }
+    theap_destroy(lp);
+    zv_free(lp -> periodics);
+    zv_free(lp -> prepares);
+    zv_free(lp -> checks);
+    lp -> periodics = NULL;
+    lp -> prepares = NULL;
+    lp -> checks = NULL;
+
+    for (int i=0; i<ZV_POOL_NUM; i++)
+	zv_pool_destroy(&(lp -> pools)[i]);
+    fiber_stacks_shrink(lp, 0);
 }
 
 pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -415,98 +898,232 @@ zv_loop *zv_default_loop() {
     
     pthread_mutex_lock(&init_mutex);
     if (lp == NULL) {
-	lp = (zv_loop *)calloc(1, sizeof(zv_loop));
-	if (lp == NULL)
-	    zv_err(1, "calloc error");
+	lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
 	zv_loop_init(lp);
 	lp -> is_default = 1;
 	
+#if ZV_ENABLE_SIGNAL
 	// only default loop deals with signal	
 	if (pipe(pipefd) < 0)
 	    zv_err(1, "pipe error");
-	zv_io_init(sig_io, sig_cb, pipefd[1], ZV_READ);
-	zv_io_start(lp, sig_io);
+	zv_io_init(&sig_io, sig_cb, pipefd[0], ZV_READ);
+	zv_io_start(lp, &sig_io);
+	unref_loop(lp);
+#endif // ZV_ENABLE_SIGNAL
     }
     pthread_mutex_unlock(&init_mutex);
 
     return lp;    
 }
 
-void ref_loop(zv_loop *lp) {
-    (lp -> activecnt)++;
+/* trim every array to what its live entries need */
+static void loop_shrink_arrays(zv_loop *lp) {
+    int used;
+
+    for (int pri = ZV_MIN_PRI; pri <= ZV_MAX_PRI; pri++) {
+#if NUM_PRI == 1
+	used = lp -> pendingtail;
+#else
+	for (used = (lp -> pendingmax)[pri]; used > 0; used--) {
+	    if ((lp -> anpendings)[pri][used - 1].active)
+		break;
+	}
+#endif // NUM_PRI == 1
+	(lp -> anpendings)[pri] = array_shrink((lp -> anpendings)[pri], &(lp -> pendingmax)[pri],
+					       used, sizeof(struct ANPENDING));
+
+	(lp -> idles)[pri] = array_shrink((lp -> idles)[pri], &(lp -> idle_max)[pri],
+					  (lp -> idle_cnt)[pri], sizeof(void *));
+    }
+
+    lp -> periodics = array_shrink(lp -> periodics, &lp -> periodic_max,
+				   lp -> periodic_cnt, sizeof(void *));
+    lp -> prepares = array_shrink(lp -> prepares, &lp -> prepare_max,
+				  lp -> prepare_cnt, sizeof(void *));
+    lp -> checks = array_shrink(lp -> checks, &lp -> check_max,
+				lp -> check_cnt, sizeof(void *));
+
+#if ZV_ENABLE_SIGNAL
+    if (lp -> is_default) {
+	for (int signo = 0; signo < SIGNUM; signo++) {
+	    signals[signo] = array_shrink(signals[signo], &signals_max[signo],
+					  signals_cnt[signo], sizeof(void *));
+	}
+    }
+#endif // ZV_ENABLE_SIGNAL
+
+    theap_shrink(lp);
+#ifdef EPOLL_BACKEND
+    epoll_shrink(lp);
+#endif // EPOLL_BACKEND
+
+    lp -> shrink_arrays = 0;
 }
 
-void unref_loop(zv_loop *lp) {
-    (lp -> activecnt)--;
+/*
+ * Give back memory kept since a load spike. Empty watcher slabs and unused
+ * fiber stacks are freed right away, the internal arrays are trimmed before
+ * the next iteration when called from a callback.
+ */
+void zv_loop_shrink(zv_loop *lp) {
+    assert(lp);
+
+    for (int i=0; i<ZV_POOL_NUM; i++)
+	zv_pool_shrink(&(lp -> pools)[i], 1);
+    fiber_stacks_shrink(lp, 1);
+
+    lp -> shrink_arrays = 1;
+    if (lp -> cb_watcher == NULL)
+	loop_shrink_arrays(lp);
 }
 
-void zv_loop_run(zv_loop *lp) {
+#if ZV_ENABLE_STAT
+static void stat_fork(zv_loop *lp);
+#endif // ZV_ENABLE_STAT
+
+/*
+ * Call in a forked child before running `lp` there. The backend is
+ * rebuilt from the fds that have watchers, the same as the parent's,
+ * and the loop's own fds, which the parent keeps using, are replaced.
+ * Threads do not survive fork, the signal thread, the fs pool and the
+ * watchdog are started again. No zv_fs request may be in flight, and
+ * loops embedded in `lp` need their own call, then a restart of their
+ * zv_embed since their backend fd changes.
+ */
+void zv_loop_fork(zv_loop *lp) {
     assert(lp);
 
-    if (lp -> is_default) {
-	sigset_t mask;
-	pthread_t tid;
-	pthread_attr_t attr;
-	int err;
-	sigfillset(&mask);
-	if (sigprocmask(SIG_SETMASK, &mask, NULL) < 0)
-	    zv_err(1, "sigprocmask error");
-
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	err = pthread_create(&tid, &attr, sig_handler, NULL);
-	if (err)
-	    zv_err(1, "pthread_create error: %s", strerror(err));
-	pthread_attr_destroy(&attr);
-    }
-    
+    if (lp -> backend_fork)
+	lp -> backend_fork(lp);
+
+    ref_loop(lp);
+    zv_io_stop(lp, &lp -> wakeup_io);
+    close((lp -> wakeup_fd)[0]);
+    if ((lp -> wakeup_fd)[1] != (lp -> wakeup_fd)[0])
+	close((lp -> wakeup_fd)[1]);
+    wakeup_init(lp);
+
+#if ZV_ENABLE_SIGNAL
+    if (lp -> is_default)
+	sig_fork(lp);
+#endif // ZV_ENABLE_SIGNAL
+#if ZV_ENABLE_STAT
+    if (lp -> fs_fd >= 0)
+	stat_fork(lp);
+#endif // ZV_ENABLE_STAT
+    if (lp -> aio)
+	aio_fork(lp);
+    if (lp -> watchdog)
+	watchdog_fork(lp);
+    lp -> tid = pthread_self();
+}
+
+#if ZV_ENABLE_PERIODIC
+static void periodics_reschedule(zv_loop *lp);
+#endif // ZV_ENABLE_PERIODIC
+
+/* refresh the loop time, periodics follow the wall clock when it jumps */
+static void time_update(zv_loop *lp) {
+    zv_tstamp mn = loop_mono(lp);
+    zv_tstamp now = loop_time(lp);
+#if ZV_ENABLE_PERIODIC
+    int jumped = fabs((now - lp -> zv_now) - (mn - lp -> mn_now)) > TIME_JUMP;
+#endif // ZV_ENABLE_PERIODIC
+
+    lp -> zv_now = now;
+    lp -> mn_now = mn;
+#if ZV_ENABLE_PERIODIC
+    if (jumped && lp -> periodic_cnt)
+	periodics_reschedule(lp);
+#endif // ZV_ENABLE_PERIODIC
+}
+
+/* how long the backend may block, negative means until an fd is ready */
+static zv_tstamp loop_timeout(zv_loop *lp, int flags) {
+    if ((flags & ZV_RUN_NOWAIT) || lp -> pendingcnt || lp -> idleall ||
+	__atomic_load_n(&lp -> loop_done, __ATOMIC_ACQUIRE))
+	return 0.0;
+    if (theap_isempty(lp))
+	return -1.0;
+
+    zv_tstamp block = theap_wakeup(lp) - loop_time(lp);
+    return block > 0.0 ? block : 0.0;
+}
+
+/*
+ * ZV_RUN_ONCE runs a single iteration, blocking for events if needed,
+ * ZV_RUN_NOWAIT runs a single iteration without blocking. Returns the
+ * number of watchers still holding the loop.
+ */
+int zv_loop_run(zv_loop *lp, int flags) {
+    assert(lp);
+
+    lp -> tid = pthread_self();
+#if ZV_ENABLE_SIGNAL
+    if (lp -> is_default && !lp -> sig_started)
+	sig_start(lp);
+#endif // ZV_ENABLE_SIGNAL
+
     call_pending(lp);		/* incase there is any pending events */
 
     do {
-	lp -> loop_cnt += 1;
+	if (lp -> shrink_arrays)
+	    loop_shrink_arrays(lp);
+	__atomic_store_n(&lp -> loop_cnt, lp -> loop_cnt + 1, __ATOMIC_RELAXED);
+#if ZV_ENABLE_PREPARE
 	// prepare events
-	if (lp -> prepare_cnt) {
-	    int cnt = lp -> prepare_cnt;
-	    zv_prepare *w;
-	    for (int i=0; i<(lp -> prepare_max); i++) {
-		w = (lp -> prepares)[i];
-		if (w && w -> active) {
-		    zv_feed_event(lp, (zv_watcher *)w, ZV_PREPARE);
-		    cnt--;
-		}
-		if (cnt == 0)
-		    break;
-	    }
-	}
+	for (int i=0; i<(lp -> prepare_cnt); i++)
+	    zv_feed_event(lp, (zv_watcher *)(lp -> prepares)[i], ZV_PREPARE);
 	call_pending(lp);
+#endif // ZV_ENABLE_PREPARE
+
+	// writes corked before the loop started or by prepares, a short one waits on an fd
+	if (lp -> cork)
+	    cork_flush(lp);
 
 	// fd events
 	fd_reify(lp);
 
-	// caculate blocking time
-	zv_tstamp block = (theap_findmin(lp) -> at) - lp -> zv_now;
+	// file requests queued by the callbacks go out in one batch
+	if (lp -> aio)
+	    aio_submit(lp);
+
+	// caculate blocking time, callbacks may have moved the clock
+	time_update(lp);
+	zv_tstamp block = loop_timeout(lp, flags);
+	ZV_PROBE2(poll_start, lp, (long)(block * 1000));
 	(lp -> backend_poll)(lp, block);
+	ZV_PROBE1(poll_end, lp);
+	time_update(lp);
+	if (lp -> record)
+	    record_time(lp, lp -> zv_now);
 
 	timers_reify(lp);
 
+#if ZV_ENABLE_IDLE
+	/* idle watchers only run when nothing else is due */
+	if (lp -> idleall && !lp -> pendingcnt)
+	    idles_reify(lp);
+#endif // ZV_ENABLE_IDLE
+
 	call_pending(lp);
 
+#if ZV_ENABLE_CHECK
 	/* checks */
-	if (lp -> check_cnt) {
-	    int cnt = lp -> check_cnt;
-	    zv_check *w;
-	    for (int i=0; i<(lp -> check_max); i++) {
-		w = (lp -> checks)[i];
-		if (w && w -> active) {
-		    zv_feed_event(lp, (zv_watcher *)w, ZV_CHECK);
-		    cnt--;
-		}
-		if (cnt == 0)
-		    break;
-	    }
-	}
+	for (int i=0; i<(lp -> check_cnt); i++)
+	    zv_feed_event(lp, (zv_watcher *)(lp -> checks)[i], ZV_CHECK);
 	call_pending(lp);	
-    } while (lp -> activecnt);
+#endif // ZV_ENABLE_CHECK
+
+	// writes corked by this iteration's callbacks, once per fd
+	if (lp -> cork)
+	    cork_flush(lp);
+    } while (lp -> activecnt &&
+	     !(flags & (ZV_RUN_ONCE | ZV_RUN_NOWAIT)) &&
+	     !__atomic_load_n(&lp -> loop_done, __ATOMIC_ACQUIRE));
+
+    __atomic_store_n(&lp -> loop_done, 0, __ATOMIC_RELEASE);
+    return lp -> activecnt;
 }
 
 
@@ -521,6 +1138,8 @@ static void zv_init(zv_watcher *w, w_cb cb) {
     w -> cb = cb;
 }
 
+/* signals and idles start out at the ends of the priority range */
+#if ZV_ENABLE_SIGNAL || ZV_ENABLE_IDLE
 static void zv_set_priority(zv_watcher *w, int npri, int *opri) {
     assert(w);
 
@@ -530,6 +1149,7 @@ static void zv_set_priority(zv_watcher *w, int npri, int *opri) {
     w -> priority = npri;
     adjust_pri(w);    
 }
+#endif // ZV_ENABLE_SIGNAL || ZV_ENABLE_IDLE
 
 static void zv_start(zv_loop *lp, zv_watcher *w) {
     adjust_pri(w);
@@ -543,42 +1163,40 @@ static void zv_stop(zv_loop *lp, zv_watcher *w) {
 }
 
 static void add_anfd(zv_loop *lp, int fd, zv_io *w) {
-    assert(fd >= 0 && fd <= ZV_OPENFD_MAX);
-    
-    int idx;
-    struct ANFD *anfds = (lp -> anfds)[fd];
-    for (idx = 0; idx <= (lp -> anfds_max)[fd]; idx++) {
-	if (anfds[idx].active == 0)
-	    break;
-    }
-    if (idx == (lp -> anfds_max)[fd]) {
-	(lp -> anfds)[fd] = array_alloc((lp -> anfds)[fd],
-					(lp -> anfds_max)[fd] + ARRAY_BLK,
-					sizeof(struct ANFD));
-	(lp -> anfds_max)[fd] += ARRAY_BLK;
-	anfds = (lp -> anfds)[fd];
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
+
+    struct ANFD *anfd = (lp -> anfds) + fd;
+    if (anfd -> head == NULL) {
+	anfd -> slot = lp -> fd_cnt;
+	(lp -> fds)[(lp -> fd_cnt)++] = fd;
     }
-    anfds[idx].watcher = (zv_watcher *)w;
-    anfds[idx].events = w -> events;
-    anfds[idx].active = w -> active;
-    (lp -> anfds_cnt)[fd] += 1;
+    w -> next = anfd -> head;
+    anfd -> head = w;
 }
 
 static void delete_anfd(zv_loop *lp, int fd, zv_io *w) {
-    assert(fd >= 0 && fd <= ZV_OPENFD_MAX);
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
 
-    int idx;
-    struct ANFD *anfds = (lp -> anfds)[fd];
-    for (idx = 0; idx < (lp -> anfds_max)[fd]; idx++) {
-	if (anfds[idx].watcher == (zv_watcher *)w) {
-	    anfds[idx].active = 0;
-	    anfds[idx].watcher = NULL;
-	    (lp -> anfds_cnt)[fd] -= 1;
+    struct ANFD *anfd = (lp -> anfds) + fd;
+    zv_io **wp;
+    for (wp = &anfd -> head; *wp; wp = &(*wp) -> next) {
+	if (*wp == w) {
+	    *wp = w -> next;
 	    break;
 	}
     }
-    if ((lp -> anfds_cnt)[fd] == 0) {
+    w -> next = NULL;
+
+    if (anfd -> head == NULL) {
+	int last = (lp -> fds)[--(lp -> fd_cnt)];
+	(lp -> fds)[anfd -> slot] = last;
+	(lp -> anfds)[last].slot = anfd -> slot;
+
+	/* drop it now, the fd may be closed and reused before `fd_reify` */
+	anfd -> events = ZV_NONE;
 	(lp -> backend_modify)(lp, fd, -1);
+    } else {
+	fd_change(lp, fd);
     }
 }
 
@@ -588,11 +1206,13 @@ void zv_io_init(zv_io *w, w_cb cb, int fd, int events) {
 
     w -> fd = fd;
     w -> events = events;
+    w -> next = NULL;
 }
 
 void zv_io_start(zv_loop *lp, zv_io *w) {
     assert(lp && w);
-    assert(w -> fd <= ZV_OPENFD_MAX && w -> fd >= 0);
+    assert(w -> fd < ZV_OPENFD_MAX && w -> fd >= 0);
+    assert(lp -> mock || fd_valid(w -> fd));	/* mock fds only exist in the script */
     
     if (w -> active)
 	return;
@@ -621,9 +1241,27 @@ void zv_timer_init(zv_timer *w, w_cb cb, zv_tstamp after, zv_tstamp repeat) {
     zv_init((zv_watcher *)w, cb);
 
     w -> at = zv_time() + after;
-    if (repeat > 0.0) {
-	w -> repeat = repeat;
-    }
+    w -> latest = w -> at;
+    w -> slack = 0.0;
+    w -> repeat = repeat > 0.0 ? repeat : 0.0;
+    w -> idx = 0;
+    w -> sysclock = 1;
+}
+
+/* let the loop fire `w` up to `slack` seconds late, to batch wakeups */
+void zv_timer_set_slack(zv_timer *w, zv_tstamp slack) {
+    assert(w && slack >= 0.0);
+
+    w -> slack = slack;
+}
+
+/* `at` is already on the loop's clock */
+void timer_start_at(zv_loop *lp, zv_timer *w) {
+    zv_start(lp, (zv_watcher *)w);
+
+    w -> sysclock = 0;
+    timer_round(w);
+    theap_insert(w, lp);
 }
 
 void zv_timer_start(zv_loop *lp, zv_timer *w) {
@@ -631,18 +1269,30 @@ void zv_timer_start(zv_loop *lp, zv_timer *w) {
 
     if (w -> active)
 	return;
-    zv_start(lp, (zv_watcher *)w);
 
-    theap_insert(w, lp);
+    /*
+     * zv_timer_init had no loop and used the system clock, keep what is
+     * left. A restarted timer keeps its deadline on the loop's clock.
+     */
+    if (lp -> clock_now && w -> sysclock) {
+	w -> at += lp -> clock_now(lp) - zv_time();
+	if (w -> at < 0.0)
+	    w -> at = 0.0;
+    }
+    timer_start_at(lp, w);
 }
 
 void zv_timer_stop(zv_loop *lp, zv_timer *w) {
     assert(lp && w);
     clear_pending(lp, (zv_watcher *)w);
-    w -> repeat = 0.0;
+    if (!w -> active)
+	return;
+
+    theap_delete(w, lp);
     zv_stop(lp, ( zv_watcher *)w);
 }
 
+#if ZV_ENABLE_SIGNAL
 /* zv_signal */
 void zv_signal_init(zv_signal *w, w_cb cb, int signo) {
     assert(w);
@@ -663,28 +1313,22 @@ void zv_signal_start(zv_loop *lp, zv_signal *w) {
     zv_start(lp, (zv_watcher *)w);    
     sigrefs[w -> signo] += 1;
 
-    int idx, signo = w -> signo;
-    zv_signal **sigs = signals[signo];
-    
-    for (idx = 0; idx < signals_max[signo]; idx++) {
-	if (sigs[idx] == NULL || sigs[idx] -> active == 0)
-	    break;
-    }
-    if (idx == signals_max[signo]) {
+    int signo = w -> signo;
+    if (signals_cnt[signo] == signals_max[signo]) {
 	signals[signo] = array_alloc(signals[signo],
 				     signals_max[signo] + ARRAY_BLK,
 				     sizeof(void *));
 	signals_max[signo] += ARRAY_BLK;
-	sigs = signals[signo];
     }
-    sigs[idx] = w;
-    w -> idx = idx;
+    w -> idx = signals_cnt[signo]++;
+    signals[signo][w -> idx] = w;
 }
 
 void zv_signal_stop(zv_loop *lp, zv_signal *w) {
     assert(lp && w);
     assert(w -> signo >= 0 && w -> signo <= SIGNUM);
 
+    clear_pending(lp, (zv_watcher *)w);
     if (!w -> active)
 	return;
     if (!lp -> is_default)
@@ -693,8 +1337,10 @@ void zv_signal_stop(zv_loop *lp, zv_signal *w) {
     zv_stop(lp, (zv_watcher *)w);
     sigrefs[w -> signo] -= 1;
 
+    /* move the last one into the hole */
     zv_signal **sigs = signals[w -> signo];
-    sigs[w -> idx] = NULL;
+    sigs[w -> idx] = sigs[--signals_cnt[w -> signo]];
+    sigs[w -> idx] -> idx = w -> idx;
 }
 
 void zv_feed_signal(zv_loop *lp, int signo) {
@@ -704,14 +1350,13 @@ void zv_feed_signal(zv_loop *lp, int signo) {
     if (!lp -> is_default)
 	return;
 
-    zv_signal **sigs = signals[signo];   
-    for (int idx = 0; idx<signals_max[signo]; idx++) {
-	if (sigs[idx] && sigs[idx] -> active) {
-	    zv_feed_event(lp, (zv_watcher *)sigs[idx], ZV_SIGNAL);
-	}
-    }
+    zv_signal **sigs = signals[signo];
+    for (int idx = 0; idx<signals_cnt[signo]; idx++)
+	zv_feed_event(lp, (zv_watcher *)sigs[idx], ZV_SIGNAL);
 }
+#endif // ZV_ENABLE_SIGNAL
 
+#if ZV_ENABLE_IDLE
 /* zv_idle */
 void zv_idle_init(zv_idle *w, w_cb cb) {
     assert(w);
@@ -727,37 +1372,36 @@ void zv_idle_start(zv_loop *lp, zv_idle *w) {
 	return;
     zv_start(lp, (zv_watcher *)w);
 
-    int pri = w -> priority, idx;
-    zv_idle **idles = (lp -> idles)[pri];
-    zv_idle *idle;
-    for (idx = 0; idx < (lp -> idle_max)[pri]; idx++) {
-	idle = idles[idx];
-	if (idle == NULL || idle -> active == 0) {
-	    break;
-	}
-    }
-    if (idx == (lp -> idle_max)[pri]) {
+    int pri = adjust_pri((zv_watcher *)w);
+    if ((lp -> idle_cnt)[pri] == (lp -> idle_max)[pri]) {
 	(lp -> idles)[pri] = array_alloc((lp -> idles)[pri],
 					 (lp -> idle_max)[pri] + ARRAY_BLK,
 					 sizeof(void *));
 	(lp -> idle_max)[pri] += ARRAY_BLK;
-	idles = (lp -> idles)[pri];
     }
-    idles[idx] = w;
-    w -> idx = idx;
-    (lp -> idle_cnt)[pri] += 1;
+    w -> idx = (lp -> idle_cnt)[pri]++;
+    (lp -> idles)[pri][w -> idx] = w;
+    lp -> idleall += 1;
 }
 
 void zv_idle_stop(zv_loop *lp, zv_idle *w) {
     assert(lp && w);
 
+    clear_pending(lp, (zv_watcher *)w);
     if (!w -> active)
 	return;
     zv_stop(lp, (zv_watcher *)w);
 
-    (lp -> idles)[w -> priority][w -> idx] = NULL;
+    /* move the last one into the hole */
+    int pri = adjust_pri((zv_watcher *)w);
+    zv_idle **idles = (lp -> idles)[pri];
+    idles[w -> idx] = idles[--(lp -> idle_cnt)[pri]];
+    idles[w -> idx] -> idx = w -> idx;
+    lp -> idleall -= 1;
 }
+#endif // ZV_ENABLE_IDLE
 
+#if ZV_ENABLE_PREPARE
 /* zv_prepare */
 void zv_prepare_init(zv_prepare *w, w_cb cb) {
     assert(w);
@@ -771,35 +1415,31 @@ void zv_prepare_start(zv_loop *lp, zv_prepare *w) {
 	return;
     zv_start(lp, (zv_watcher *)w);
 
-    int idx;
-    zv_prepare **prepares = (lp -> prepares), *prepare;
-    for (idx = 0; idx < (lp -> prepare_max); idx++) {
-	prepare = prepares[idx];
-	if (prepare == NULL || prepare -> active == 0) {
-	    break;
-	}
-    }
-    if (idx == (lp -> prepare_max)) {
+    if ((lp -> prepare_cnt) == (lp -> prepare_max)) {
 	(lp -> prepares) = array_alloc((lp -> prepares),
 				       (lp -> prepare_max) + ARRAY_BLK,
 				       sizeof(void *));
 	lp -> prepare_max += ARRAY_BLK;
-	prepares = (lp -> prepares);
     }
-    prepares[idx] = w;
-    w -> idx = idx;
-    lp -> prepare_cnt += 1;
+    w -> idx = (lp -> prepare_cnt)++;
+    (lp -> prepares)[w -> idx] = w;
 }
 
 void zv_prepare_stop(zv_loop *lp, zv_prepare *w) {
     assert(lp && w);
+    clear_pending(lp, (zv_watcher *)w);
     if (!w -> active)
 	return;
 
     zv_stop(lp, (zv_watcher *)w);
-    (lp -> prepares)[w -> idx] = NULL;
+    /* move the last one into the hole */
+    zv_prepare **prepares = (lp -> prepares);
+    prepares[w -> idx] = prepares[--(lp -> prepare_cnt)];
+    prepares[w -> idx] -> idx = w -> idx;
 }
+#endif // ZV_ENABLE_PREPARE
 
+#if ZV_ENABLE_CHECK
 /* zv_check */
 void zv_check_init(zv_check *w, w_cb cb) {
     assert(w);
@@ -814,30 +1454,739 @@ void zv_check_start(zv_loop *lp, zv_check *w) {
 	return;
     zv_start(lp, (zv_watcher *)w);
 
-    int idx;
-    zv_check **checks = (lp -> checks), *check;
-    for (idx = 0; idx < (lp -> check_max); idx++) {
-	check = checks[idx];
-	if (check == NULL || check -> active == 0)
-	    break;
-    }
-    if (idx == (lp -> check_max)) {
+    if ((lp -> check_cnt) == (lp -> check_max)) {
 	(lp -> checks) = array_alloc((lp -> checks),
 				     (lp -> check_max) + ARRAY_BLK,
 				     sizeof(void *));
 	(lp -> check_max) += ARRAY_BLK;
-	checks = (lp -> checks);
     }
-    checks[idx] = w;
-    w -> idx = idx;
-    (lp -> check_cnt) += 1;
+    w -> idx = (lp -> check_cnt)++;
+    (lp -> checks)[w -> idx] = w;
 }
 
 void zv_check_stop(zv_loop *lp, zv_check *w) {
     assert(lp && w);
+    clear_pending(lp, (zv_watcher *)w);
+    if (!w -> active)
+	return;
+
+    zv_stop(lp, (zv_watcher *)w);
+    /* move the last one into the hole */
+    zv_check **checks = (lp -> checks);
+    checks[w -> idx] = checks[--(lp -> check_cnt)];
+    checks[w -> idx] -> idx = w -> idx;
+}
+#endif // ZV_ENABLE_CHECK
+
+#if ZV_ENABLE_EMBED
+/* zv_embed */
+static void embed_io_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    zv_embed *embed = (zv_embed *)(w -> data);
+
+    if (embed -> cb)
+	zv_feed_event(lp, (zv_watcher *)embed, ZV_EMBED);
+    else
+	zv_embed_sweep(lp, embed);
+}
+
+static void embed_prepare_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)revents;	/* unused */
+    zv_embed *embed = (zv_embed *)(w -> data);
+
+    /* watchers started on `other` since its last run must reach its backend
+       before we block on its backend fd */
+    fd_reify(embed -> other);
+}
+
+void zv_embed_init(zv_embed *w, w_cb cb, zv_loop *other) {
+    assert(w && other);
+    assert(!other -> is_default);
+
+    zv_init((zv_watcher *)w, cb);
+    w -> other = other;
+
+    zv_io_init(&w -> io, embed_io_cb, zv_backend_fd(other), ZV_READ);
+    w -> io.data = w;
+    zv_prepare_init(&w -> prepare, embed_prepare_cb);
+    w -> prepare.data = w;
+}
+
+/*
+ * Only the backend of `other` is watched, its timers and idle watchers run
+ * when one of its fds is ready or when the loop is swept.
+ */
+void zv_embed_start(zv_loop *lp, zv_embed *w) {
+    assert(lp && w);
+
+    if (w -> active)
+	return;
+    zv_start(lp, (zv_watcher *)w);
+
+    w -> io.priority = w -> priority;
+    zv_io_start(lp, &w -> io);
+    zv_prepare_start(lp, &w -> prepare);
+    /* internal, `w` already holds the loop */
+    unref_loop(lp);
+    unref_loop(lp);
+}
+
+void zv_embed_stop(zv_loop *lp, zv_embed *w) {
+    assert(lp && w);
+
+    clear_pending(lp, (zv_watcher *)w);
+    if (!w -> active)
+	return;
+
+    ref_loop(lp);
+    ref_loop(lp);
+    zv_io_stop(lp, &w -> io);
+    zv_prepare_stop(lp, &w -> prepare);
+    zv_stop(lp, (zv_watcher *)w);
+}
+
+/* one non-blocking iteration of the embedded loop */
+void zv_embed_sweep(zv_loop *lp, zv_embed *w) {
+    (void)lp;			/* unused */
+    assert(w);
+
+    zv_loop_run(w -> other, ZV_RUN_NOWAIT);
+}
+#endif // ZV_ENABLE_EMBED
+
+#if ZV_ENABLE_CHILD
+/* zv_child */
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif // P_PIDFD
+
+/* rebuild the status `waitpid` would have given */
+static int child_status(const siginfo_t *si) {
+    switch (si -> si_code) {
+    case CLD_EXITED:
+	return (si -> si_status & 0xff) << 8;
+    case CLD_KILLED:
+	return si -> si_status & 0x7f;
+    case CLD_DUMPED:
+	return (si -> si_status & 0x7f) | 0x80;
+    default:
+	return 0;
+    }
+}
+
+static void child_reap(zv_loop *lp, zv_child *w) {
+    siginfo_t si;
+    int ret = -1;
+
+    memset(&si, 0, sizeof(si));
+    if (w -> io.fd >= 0)
+	ret = waitid(P_PIDFD, w -> io.fd, &si, WEXITED | WNOHANG);
+    if (ret < 0 && (w -> io.fd < 0 || errno == EINVAL))
+	ret = waitid(P_PID, w -> pid, &si, WEXITED | WNOHANG);
+    if (ret < 0) {
+	/* not our child or reaped elsewhere, its pidfd would stay readable */
+	zv_err(0, "cannot reap child %d", w -> pid);
+	w -> rpid = -1;
+	zv_child_stop(lp, w);
+	zv_feed_event(lp, (zv_watcher *)w, ZV_CHILD | ZV_ERROR);
+	return;
+    }
+    if (si.si_pid == 0)
+	return;			/* still running */
+
+    w -> rpid = si.si_pid;
+    w -> rstatus = child_status(&si);
+    zv_child_stop(lp, w);
+    zv_feed_event(lp, (zv_watcher *)w, ZV_CHILD);
+}
+
+static void child_io_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    child_reap(lp, (zv_child *)(w -> data));
+}
+
+#if ZV_ENABLE_SIGNAL
+static void child_sig_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    child_reap(lp, (zv_child *)(w -> data));
+}
+#endif // ZV_ENABLE_SIGNAL
+
+void zv_child_init(zv_child *w, w_cb cb, int pid) {
+    assert(w && pid > 0);
+
+    zv_init((zv_watcher *)w, cb);
+    w -> pid = pid;
+    w -> rpid = 0;
+    w -> rstatus = 0;
+
+    zv_io_init(&w -> io, child_io_cb, -1, ZV_READ);
+    w -> io.data = w;
+#if ZV_ENABLE_SIGNAL
+    zv_signal_init(&w -> sig, child_sig_cb, SIGCHLD);
+    w -> sig.data = w;
+#endif // ZV_ENABLE_SIGNAL
+}
+
+/*
+ * The pidfd of `pid` is watched like any other fd, so this works on every
+ * loop. Without pidfd_open(2) we fall back to SIGCHLD, which only the
+ * default loop receives, and only in builds with signal watchers.
+ */
+void zv_child_start(zv_loop *lp, zv_child *w) {
+    assert(lp && w);
+
+    if (w -> active)
+	return;
+
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, w -> pid, 0);
+#else
+    int fd = -1;
+    errno = ENOSYS;
+#endif // SYS_pidfd_open
+    if (fd < 0 && (!ZV_ENABLE_SIGNAL || errno != ENOSYS || !lp -> is_default)) {
+	zv_err(0, "cannot watch child %d", w -> pid);
+	w -> rpid = -1;
+	zv_feed_event(lp, (zv_watcher *)w, ZV_CHILD | ZV_ERROR);
+	return;
+    }
+    zv_start(lp, (zv_watcher *)w);
+
+    /* internal, `w` already holds the loop */
+    if (fd >= 0) {
+	w -> io.fd = fd;
+	w -> io.priority = w -> priority;
+	zv_io_start(lp, &w -> io);
+	unref_loop(lp);
+    }
+#if ZV_ENABLE_SIGNAL
+    else {
+	w -> sig.priority = w -> priority;
+	zv_signal_start(lp, &w -> sig);
+	unref_loop(lp);
+	/* the child may be gone already, its SIGCHLD with it */
+	child_reap(lp, w);
+    }
+#endif // ZV_ENABLE_SIGNAL
+}
+
+void zv_child_stop(zv_loop *lp, zv_child *w) {
+    assert(lp && w);
+
+    clear_pending(lp, (zv_watcher *)w);
     if (!w -> active)
 	return;
 
+    ref_loop(lp);
+    if (w -> io.fd >= 0) {
+	zv_io_stop(lp, &w -> io);
+	close(w -> io.fd);
+	w -> io.fd = -1;
+    }
+#if ZV_ENABLE_SIGNAL
+    else {
+	zv_signal_stop(lp, &w -> sig);
+    }
+#endif // ZV_ENABLE_SIGNAL
     zv_stop(lp, (zv_watcher *)w);
-    (lp -> checks)[w -> idx] = NULL;
+}
+#endif // ZV_ENABLE_CHILD
+
+#if ZV_ENABLE_STAT
+/* zv_stat */
+#define STAT_INTERVAL 5.0	/* default polling interval */
+#define STAT_HASHBLK 16
+
+#define STAT_CHANGED 0x01
+#define STAT_REWATCH 0x02	/* the watch no longer follows `path` */
+#define STAT_IGNORED 0x04	/* and the kernel already dropped it */
+
+#define STAT_MASK (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+static void stat_hash_insert(zv_loop *lp, zv_stat *w) {
+    if (lp -> fs_hashcnt >= lp -> fs_hashmax) {
+	/* wds are handed out sequentially, so masking spreads them well */
+	int nmax = lp -> fs_hashmax ? lp -> fs_hashmax * 2 : STAT_HASHBLK;
+	zv_stat **nhash = (zv_stat **)zv_calloc(nmax, sizeof(void *));
+	for (int i=0; i<(lp -> fs_hashmax); i++) {
+	    zv_stat *s, *next;
+	    for (s = (lp -> fs_hash)[i]; s; s = next) {
+		next = s -> hnext;
+		s -> hnext = nhash[s -> wd & (nmax - 1)];
+		nhash[s -> wd & (nmax - 1)] = s;
+	    }
+	}
+	zv_free(lp -> fs_hash);
+	lp -> fs_hash = nhash;
+	lp -> fs_hashmax = nmax;
+    }
+
+    zv_stat **bucket = (lp -> fs_hash) + (w -> wd & (lp -> fs_hashmax - 1));
+    w -> hnext = *bucket;
+    *bucket = w;
+    lp -> fs_hashcnt += 1;
+}
+
+/* stop following `path` through inotify */
+static void stat_unwatch(zv_loop *lp, zv_stat *w, int ignored) {
+    if (w -> wd < 0)
+	return;
+
+    zv_stat **wp, *s;
+    int shared = 0;
+    for (wp = (lp -> fs_hash) + (w -> wd & (lp -> fs_hashmax - 1)); *wp; ) {
+	s = *wp;
+	if (s == w) {
+	    *wp = s -> hnext;
+	    continue;
+	}
+	if (s -> wd == w -> wd)
+	    shared = 1;
+	wp = &s -> hnext;
+    }
+    lp -> fs_hashcnt -= 1;
+
+    /* the same inode watched twice shares one wd */
+    if (!ignored && !shared)
+	inotify_rm_watch(lp -> fs_fd, w -> wd);
+    w -> wd = -1;
+}
+
+static void stat_watch(zv_loop *lp, zv_stat *w);
+
+static void stat_mark(zv_loop *lp, zv_stat *w, int flags) {
+    if (!w -> changed) {
+	w -> cnext = lp -> fs_changes;
+	lp -> fs_changes = w;
+    }
+    w -> changed |= STAT_CHANGED | flags;
+}
+
+static void stat_now(zv_stat *w) {
+    if (stat(w -> path, &w -> attr) < 0)
+	memset(&w -> attr, 0, sizeof(w -> attr));
+}
+
+static int stat_differ(const struct stat *a, const struct stat *b) {
+    return a -> st_dev != b -> st_dev || a -> st_ino != b -> st_ino ||
+	a -> st_mode != b -> st_mode || a -> st_nlink != b -> st_nlink ||
+	a -> st_uid != b -> st_uid || a -> st_gid != b -> st_gid ||
+	a -> st_rdev != b -> st_rdev || a -> st_size != b -> st_size ||
+	a -> st_mtim.tv_sec != b -> st_mtim.tv_sec ||
+	a -> st_mtim.tv_nsec != b -> st_mtim.tv_nsec ||
+	a -> st_ctim.tv_sec != b -> st_ctim.tv_sec ||
+	a -> st_ctim.tv_nsec != b -> st_ctim.tv_nsec;
+}
+
+/*
+ * A file renamed over `path`, or `path` unlinked, while the old inode is
+ * still open somewhere only shows as IN_ATTRIB on the old inode, so a
+ * watch that no longer matches `path` moves along here too.
+ */
+static void stat_check(zv_loop *lp, zv_stat *w, int flags) {
+    struct stat attr = w -> attr;
+
+    stat_now(w);
+    if (w -> wd >= 0 && (attr.st_dev != w -> attr.st_dev || attr.st_ino != w -> attr.st_ino))
+	flags |= STAT_REWATCH;
+    if (flags & STAT_REWATCH) {
+	stat_unwatch(lp, w, flags & STAT_IGNORED);
+	stat_watch(lp, w);
+    }
+    if (stat_differ(&attr, &w -> attr)) {
+	w -> prev = attr;
+	zv_feed_event(lp, (zv_watcher *)w, ZV_STAT);
+    }
+}
+
+/* every inotify event read in one go turns into at most one stat() per watcher */
+static void stat_io_cb(zv_loop *lp, zv_watcher *iow, int revents) {
+    (void)iow; (void)revents;	/* unused */
+    char buf[sizeof(struct inotify_event) * 16 + NAME_MAX + 1]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(lp -> fs_fd, buf, sizeof(buf))) > 0) {
+	struct inotify_event *ev;
+	for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev -> len) {
+	    ev = (struct inotify_event *)p;
+
+	    if (ev -> mask & IN_Q_OVERFLOW) {
+		/* events were lost, look at everything */
+		for (int i=0; i<(lp -> fs_hashmax); i++) {
+		    for (zv_stat *w = (lp -> fs_hash)[i]; w; w = w -> hnext)
+			stat_mark(lp, w, 0);
+		}
+		continue;
+	    }
+
+	    int flags = 0;
+	    if (ev -> mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+		flags |= STAT_REWATCH;
+	    if (ev -> mask & IN_IGNORED)
+		flags |= STAT_IGNORED;
+	    for (zv_stat *w = (lp -> fs_hash)[ev -> wd & (lp -> fs_hashmax - 1)]; w; w = w -> hnext) {
+		if (w -> wd == ev -> wd)
+		    stat_mark(lp, w, flags);
+	    }
+	}
+    }
+
+    zv_stat *w;
+    while ((w = lp -> fs_changes)) {
+	lp -> fs_changes = w -> cnext;
+	int flags = w -> changed;
+	w -> changed = 0;
+	stat_check(lp, w, flags);
+    }
+}
+
+static int stat_fs_init(zv_loop *lp) {
+    if (lp -> fs_fd >= 0)
+	return 0;
+
+    lp -> fs_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (lp -> fs_fd < 0)
+	return -1;
+
+    /* internal, the zv_stat watchers hold the loop */
+    zv_io_init(&lp -> fs_io, stat_io_cb, lp -> fs_fd, ZV_READ);
+    zv_io_start(lp, &lp -> fs_io);
+    unref_loop(lp);
+    return 0;
+}
+
+static void stat_timer_cb(zv_loop *lp, zv_watcher *tw, int revents) {
+    (void)revents;		/* unused */
+    zv_stat *w = (zv_stat *)(tw -> data);
+
+    /* `path` may have become watchable */
+    stat_check(lp, w, STAT_REWATCH);
+}
+
+/* watch through inotify if we can, poll otherwise */
+static void stat_watch(zv_loop *lp, zv_stat *w) {
+    if (stat_fs_init(lp) == 0)
+	w -> wd = inotify_add_watch(lp -> fs_fd, w -> path, STAT_MASK);
+
+    if (w -> wd >= 0) {
+	stat_hash_insert(lp, w);
+	if (w -> timer.active) {
+	    ref_loop(lp);
+	    zv_timer_stop(lp, &w -> timer);
+	}
+    } else if (!w -> timer.active) {
+	zv_timer_init(&w -> timer, stat_timer_cb, w -> interval, w -> interval);
+	w -> timer.data = w;
+	zv_timer_start(lp, &w -> timer);
+	unref_loop(lp);
+    }
+}
+
+/* the inotify fd is shared with the parent, watch everything again on a new one */
+static void stat_fork(zv_loop *lp) {
+    zv_stat *all = NULL, *w, *next;
+
+    for (int i=0; i<(lp -> fs_hashmax); i++) {
+	for (w = (lp -> fs_hash)[i]; w; w = next) {
+	    next = w -> hnext;
+	    w -> hnext = all;
+	    all = w;
+	    w -> wd = -1;
+	    w -> changed = 0;
+	}
+	(lp -> fs_hash)[i] = NULL;
+    }
+    lp -> fs_hashcnt = 0;
+    lp -> fs_changes = NULL;
+
+    ref_loop(lp);
+    zv_io_stop(lp, &lp -> fs_io);
+    close(lp -> fs_fd);
+    lp -> fs_fd = -1;
+
+    for (w = all; w; w = next) {
+	next = w -> hnext;
+	w -> hnext = NULL;
+	stat_watch(lp, w);
+    }
+}
+
+void zv_stat_init(zv_stat *w, w_cb cb, const char *path, zv_tstamp interval) {
+    assert(w && path);
+
+    zv_init((zv_watcher *)w, cb);
+    w -> path = path;
+    w -> interval = interval > 0.0 ? interval : STAT_INTERVAL;
+    w -> wd = -1;
+    w -> changed = 0;
+    w -> hnext = w -> cnext = NULL;
+    memset(&w -> attr, 0, sizeof(w -> attr));
+    memset(&w -> prev, 0, sizeof(w -> prev));
+    zv_timer_init(&w -> timer, stat_timer_cb, w -> interval, w -> interval);
+    w -> timer.data = w;
+}
+
+void zv_stat_start(zv_loop *lp, zv_stat *w) {
+    assert(lp && w);
+
+    if (w -> active)
+	return;
+    zv_start(lp, (zv_watcher *)w);
+
+    stat_now(w);
+    w -> prev = w -> attr;
+    stat_watch(lp, w);
+}
+
+void zv_stat_stop(zv_loop *lp, zv_stat *w) {
+    assert(lp && w);
+
+    clear_pending(lp, (zv_watcher *)w);
+    if (!w -> active)
+	return;
+
+    if (w -> changed) {
+	zv_stat **wp;
+	for (wp = &lp -> fs_changes; *wp != w; wp = &(*wp) -> cnext)
+	    ;
+	*wp = w -> cnext;
+	w -> changed = 0;
+    }
+    stat_unwatch(lp, w, 0);
+    if (w -> timer.active) {
+	ref_loop(lp);
+	zv_timer_stop(lp, &w -> timer);
+    }
+    zv_stop(lp, (zv_watcher *)w);
+}
+#endif // ZV_ENABLE_STAT
+
+#if ZV_ENABLE_PERIODIC
+/* zv_periodic */
+
+/* the next wall clock time after `now`, a whole number of intervals past `offset` */
+static zv_tstamp periodic_next(zv_periodic *w, zv_tstamp now) {
+    if (w -> reschedule_cb) {
+	zv_tstamp at = w -> reschedule_cb(w, now);
+	return at > now ? at : now;
+    }
+    if (w -> interval > 0.0)
+	return w -> offset + (floor((now - w -> offset) / w -> interval) + 1.0) * w -> interval;
+    return w -> offset;
+}
+
+/* the periodic holds the loop, its timer does not */
+static void periodic_arm(zv_loop *lp, zv_periodic *w, zv_tstamp now) {
+    zv_timer *t = &w -> timer;
+
+    t -> at = periodic_next(w, now);
+    if (t -> at < 0.0)
+	t -> at = 0.0;
+    timer_start_at(lp, t);
+    unref_loop(lp);
+}
+
+static void periodic_timer_cb(zv_loop *lp, zv_watcher *tw, int revents) {
+    (void)revents;		/* unused */
+    zv_periodic *w = (zv_periodic *)(tw -> data);
+
+    /* expiring stopped the timer, which unrefs a loop it was not holding */
+    ref_loop(lp);
+    if (w -> reschedule_cb || w -> interval > 0.0) {
+	periodic_arm(lp, w, lp -> zv_now);
+    } else {
+	zv_periodic_stop(lp, w);
+    }
+    zv_feed_event(lp, (zv_watcher *)w, ZV_PERIODIC);
+}
+
+/* the wall clock jumped, fire on the schedule of the new time */
+static void periodics_reschedule(zv_loop *lp) {
+    for (int i=0; i<lp -> periodic_cnt; i++) {
+	zv_periodic *w = (lp -> periodics)[i];
+	zv_timer *t = &w -> timer;
+	if (!t -> active)
+	    continue;
+	t -> at = periodic_next(w, lp -> zv_now);
+	if (t -> at < 0.0)
+	    t -> at = 0.0;
+	t -> latest = t -> at;
+    }
+    theap_buildheap(lp);
+}
+
+void zv_periodic_init(zv_periodic *w, w_cb cb, zv_tstamp offset, zv_tstamp interval,
+		      zv_tstamp (*reschedule_cb)(zv_periodic *w, zv_tstamp now)) {
+    assert(w && interval >= 0.0);
+
+    zv_init((zv_watcher *)w, cb);
+    w -> offset = offset;
+    w -> interval = interval;
+    w -> reschedule_cb = reschedule_cb;
+    w -> idx = 0;
+    zv_timer_init(&w -> timer, periodic_timer_cb, 0.0, 0.0);
+    w -> timer.data = w;
+}
+
+void zv_periodic_start(zv_loop *lp, zv_periodic *w) {
+    assert(lp && w);
+    if (w -> active)
+	return;
+    zv_start(lp, (zv_watcher *)w);
+
+    if ((lp -> periodic_cnt) == (lp -> periodic_max)) {
+	(lp -> periodics) = array_alloc((lp -> periodics),
+					(lp -> periodic_max) + ARRAY_BLK,
+					sizeof(void *));
+	lp -> periodic_max += ARRAY_BLK;
+    }
+    w -> idx = (lp -> periodic_cnt)++;
+    (lp -> periodics)[w -> idx] = w;
+
+    /* the timer callback runs at the periodic's priority */
+    w -> timer.priority = w -> priority;
+    periodic_arm(lp, w, loop_time(lp));
+}
+
+void zv_periodic_stop(zv_loop *lp, zv_periodic *w) {
+    assert(lp && w);
+    clear_pending(lp, (zv_watcher *)w);
+    if (!w -> active)
+	return;
+
+    if (w -> timer.active) {
+	ref_loop(lp);
+	zv_timer_stop(lp, &w -> timer);
+    }
+    zv_stop(lp, (zv_watcher *)w);
+    /* move the last one into the hole */
+    zv_periodic **periodics = (lp -> periodics);
+    periodics[w -> idx] = periodics[--(lp -> periodic_cnt)];
+    periodics[w -> idx] -> idx = w -> idx;
+}
+#endif // ZV_ENABLE_PERIODIC
+
+// =================================
+// pooled watchers
+
+static void *watcher_new(zv_loop *lp, int type, int size) {
+    void *w = zv_pool_get(&(lp -> pools)[type]);
+    memset(w, 0, size);
+    return w;
+}
+
+static void watcher_free(zv_loop *lp, int type, zv_watcher *w) {
+    clear_pending(lp, w);
+    zv_pool_put(&(lp -> pools)[type], w);
+}
+
+zv_io *zv_io_new(zv_loop *lp, w_cb cb, int fd, int events) {
+    zv_io *w = (zv_io *)watcher_new(lp, ZV_POOL_IO, sizeof(zv_io));
+    zv_io_init(w, cb, fd, events);
+    return w;
+}
+
+void zv_io_free(zv_loop *lp, zv_io *w) {
+    zv_io_stop(lp, w);
+    watcher_free(lp, ZV_POOL_IO, (zv_watcher *)w);
+}
+
+zv_timer *zv_timer_new(zv_loop *lp, w_cb cb, zv_tstamp after, zv_tstamp repeat) {
+    zv_timer *w = (zv_timer *)watcher_new(lp, ZV_POOL_TIMER, sizeof(zv_timer));
+    zv_timer_init(w, cb, after, repeat);
+    return w;
+}
+
+void zv_timer_free(zv_loop *lp, zv_timer *w) {
+    zv_timer_stop(lp, w);
+    watcher_free(lp, ZV_POOL_TIMER, (zv_watcher *)w);
+}
+
+#if ZV_ENABLE_SIGNAL
+zv_signal *zv_signal_new(zv_loop *lp, w_cb cb, int signo) {
+    zv_signal *w = (zv_signal *)watcher_new(lp, ZV_POOL_SIGNAL, sizeof(zv_signal));
+    zv_signal_init(w, cb, signo);
+    return w;
+}
+
+void zv_signal_free(zv_loop *lp, zv_signal *w) {
+    zv_signal_stop(lp, w);
+    watcher_free(lp, ZV_POOL_SIGNAL, (zv_watcher *)w);
+}
+#endif // ZV_ENABLE_SIGNAL
+
+#if ZV_ENABLE_IDLE
+zv_idle *zv_idle_new(zv_loop *lp, w_cb cb) {
+    zv_idle *w = (zv_idle *)watcher_new(lp, ZV_POOL_IDLE, sizeof(zv_idle));
+    zv_idle_init(w, cb);
+    return w;
+}
+
+void zv_idle_free(zv_loop *lp, zv_idle *w) {
+    zv_idle_stop(lp, w);
+    watcher_free(lp, ZV_POOL_IDLE, (zv_watcher *)w);
+}
+#endif // ZV_ENABLE_IDLE
+
+#if ZV_ENABLE_PREPARE
+zv_prepare *zv_prepare_new(zv_loop *lp, w_cb cb) {
+    zv_prepare *w = (zv_prepare *)watcher_new(lp, ZV_POOL_PREPARE, sizeof(zv_prepare));
+    zv_prepare_init(w, cb);
+    return w;
+}
+
+void zv_prepare_free(zv_loop *lp, zv_prepare *w) {
+    zv_prepare_stop(lp, w);
+    watcher_free(lp, ZV_POOL_PREPARE, (zv_watcher *)w);
+}
+#endif // ZV_ENABLE_PREPARE
+
+#if ZV_ENABLE_CHECK
+zv_check *zv_check_new(zv_loop *lp, w_cb cb) {
+    zv_check *w = (zv_check *)watcher_new(lp, ZV_POOL_CHECK, sizeof(zv_check));
+    zv_check_init(w, cb);
+    return w;
+}
+
+void zv_check_free(zv_loop *lp, zv_check *w) {
+    zv_check_stop(lp, w);
+    watcher_free(lp, ZV_POOL_CHECK, (zv_watcher *)w);
+}
+#endif // ZV_ENABLE_CHECK
+
+// =================================
+// loop owned memory
+
+/* the size class serving `size` bytes, -1 if it is too large for any */
+static int mem_class(long size) {
+    int cls = 0;
+    while (cls < ZV_POOL_MEMCLS && (ZV_POOL_MEMMIN << cls) < size)
+	cls++;
+    return cls < ZV_POOL_MEMCLS ? cls : -1;
+}
+
+/*
+ * Memory for objects living and dying on the loop thread, e.g. coroutine
+ * frames. The caller gives the size back on free, so no header is kept
+ * beyond the pool's own.
+ */
+void *zv_loop_alloc(zv_loop *lp, long size) {
+    assert(lp && size > 0);
+
+    int cls = mem_class(size);
+    if (cls < 0)
+	return zv_realloc(NULL, size);
+    return zv_pool_get(&(lp -> pools)[ZV_POOL_MEM + cls]);
+}
+
+void zv_loop_dealloc(zv_loop *lp, void *ptr, long size) {
+    assert(lp);
+
+    int cls = mem_class(size);
+    if (cls < 0)
+	zv_free(ptr);
+    else
+	zv_pool_put(&(lp -> pools)[ZV_POOL_MEM + cls], ptr);
 }
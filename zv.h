@@ -4,6 +4,17 @@
 #include "config.h"
 #include "timer_heap.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* event mask */
 #define ZV_NONE        0x00L
 #define ZV_READ        0x01L
@@ -14,6 +25,15 @@
 #define ZV_PREPARE     0x20L
 #define ZV_CHECK       0x40L
 #define ZV_ERROR       0x80L
+#define ZV_EMBED       0x100L
+#define ZV_CHILD       0x200L
+#define ZV_STAT        0x400L
+#define ZV_PERIODIC    0x800L
+
+/* zv_loop_run flags */
+#define ZV_RUN_DEFAULT 0
+#define ZV_RUN_ONCE    1
+#define ZV_RUN_NOWAIT  2
 
 typedef double zv_tstamp;
 
@@ -39,12 +59,17 @@ typedef struct zv_io {
     WATCHER(zv_io)
     int fd;
     int events;
+    struct zv_io *next;		/* next watcher on the same fd */
 } zv_io;
 
 typedef struct zv_timer {
     WATCHER(zv_timer)
     zv_tstamp at;
     zv_tstamp repeat;    
+    zv_tstamp slack;		/* how late the timer may fire */
+    zv_tstamp latest;		/* `at` plus slack, before `at` was rounded */
+    int idx;			/* position in the timer heap, 0 when not in it */
+    int sysclock;		/* `at` is still on the system clock of zv_timer_init */
 } zv_timer;
 
 typedef struct zv_prepare {
@@ -68,12 +93,196 @@ typedef struct zv_idle {
     int idx;
 } zv_idle;
 
+/* runs another loop when its backend fd becomes readable */
+typedef struct zv_embed {
+    WATCHER(zv_embed)
+    struct zv_loop *other;
+    zv_io io;			/* on the backend fd of `other` */
+    zv_prepare prepare;		/* pushes fd changes of `other` to its backend */
+} zv_embed;
+
+/* reaps one child process, stops itself once it has exited */
+typedef struct zv_child {
+    WATCHER(zv_child)
+    int pid;
+    int rpid;			/* pid that exited, -1 if it could not be watched */
+    int rstatus;		/* wait status, see the W* macros in <sys/wait.h> */
+    zv_io io;			/* on the pidfd */
+    zv_signal sig;		/* SIGCHLD, when pidfds are not available */
+} zv_child;
+
+/* fires when the attributes of `path` change, compare `attr` with `prev` */
+typedef struct zv_stat {
+    WATCHER(zv_stat)
+    const char *path;
+    zv_tstamp interval;		/* polling interval when inotify cannot watch `path` */
+    struct stat attr;		/* st_nlink is 0 while `path` does not exist */
+    struct stat prev;
+    int wd;			/* inotify watch, -1 while polling */
+    int changed;		/* set while queued in the loop's change list */
+    struct zv_stat *hnext;	/* next in the same wd hash bucket */
+    struct zv_stat *cnext;	/* next in the change list */
+    zv_timer timer;		/* polling fallback */
+} zv_stat;
+
+typedef struct zv_periodic {
+    WATCHER(zv_periodic)
+    zv_tstamp offset;
+    zv_tstamp interval;		/* 0 fires once, at `offset` */
+    /* if set, returns the next wall clock time to fire at, after `now` */
+    zv_tstamp (*reschedule_cb)(struct zv_periodic *w, zv_tstamp now);
+    int idx;
+    zv_timer timer;		/* armed at the next absolute time */
+} zv_periodic;
+
+// ================================
+// fixed size object pool
+struct zv_slab;
+
+struct zv_pool {
+    int objsize;		/* per object, including its header */
+    int perslab;
+    struct zv_slab *slabs, *tail;
+    int nslabs;
+    int used;			/* objects handed out */
+};
+
+#define ZV_POOL_MEMMIN 128	/* smallest zv_loop_alloc size class */
+#define ZV_POOL_MEMCLS 6	/* size classes, doubling up to 4k */
+
+/* watcher pools owned by each loop, then the zv_loop_alloc size classes */
+enum {
+    ZV_POOL_IO,
+    ZV_POOL_TIMER,
+    ZV_POOL_SIGNAL,
+    ZV_POOL_IDLE,
+    ZV_POOL_PREPARE,
+    ZV_POOL_CHECK,
+    ZV_POOL_MEM,
+    ZV_POOL_NUM = ZV_POOL_MEM + ZV_POOL_MEMCLS
+};
+
+#define ZV_POOL_SLAB 64		/* watchers per slab */
+#define ZV_POOL_MEMSLAB 16	/* zv_loop_alloc blocks per slab */
+
+// ================================
+// file requests
+enum {
+    ZV_FS_OPEN,
+    ZV_FS_READ,
+    ZV_FS_WRITE,
+    ZV_FS_FSYNC,
+    ZV_FS_READAHEAD
+};
+
+#define ZV_FS_THREADS 4		/* thread pool workers, shared by all loops */
+#define ZV_FS_LIMIT 256		/* requests in flight per loop, and the io_uring size */
+
+typedef struct zv_fs_req zv_fs_req;
+typedef void (*zv_fs_cb)(struct zv_loop *lp, zv_fs_req *req);
+
+/* owned by the caller, and left alone by it until the callback runs */
+struct zv_fs_req {
+    int op;			/* ZV_FS_* */
+    int fd;
+    const char *path;
+    int flags;
+    mode_t mode;
+    void *buf;
+    size_t len;
+    off_t offset;
+    ssize_t result;		/* what the syscall returned, or -errno */
+    void *data;			/* user defined data */
+    zv_fs_cb cb;
+    struct zv_loop *lp;
+    struct zv_fs_req *next;	/* in the loop's queue, or the thread pool's */
+};
+
+// ================================
+// shared memory channels
+#define ZV_CHANNEL_BATCH 64	/* messages per consumer callback, at most */
+#define ZV_CACHELINE 64
+
+typedef struct zv_channel zv_channel;
+/* the messages point into the ring, and are released when the callback returns */
+typedef void (*zv_channel_cb)(struct zv_loop *lp, zv_channel *ch,
+			      const struct iovec *msgs, int cnt);
+
+/*
+ * One process's view of a ring, the producer and the consumer each use
+ * their own fields. The two ends may be threads sharing one view, so what
+ * each writes is at least a cache line away from the other's, and from
+ * the fields both read, wherever the struct lands.
+ */
+struct zv_channel {
+    struct zv_chan_ring *ring;	/* shared */
+    long map_size;
+    int memfd;
+    int efd[2];			/* read and write end, the same eventfd twice unless a pipe */
+    void *data;			/* user defined data */
+    char pad0[ZV_CACHELINE];
+    uint32_t tail;		/* producer: next slot to fill */
+    uint32_t cached;		/* producer: the consumer's index when last read */
+    char pad1[ZV_CACHELINE];
+    uint32_t head;		/* consumer: next slot to read */
+    zv_channel_cb cb;
+    struct zv_io io;		/* consumer: on efd[0] */
+};
+
+// ================================
+// token buckets, io watchers lose their interest while theirs is empty
+#define ZV_BUCKET_TICK 0.01	/* refill period while watchers wait, shared by a loop's buckets */
+
+struct zv_bucket_wait {
+    struct zv_io *w;
+    int events;			/* given back on resume */
+};
+
+typedef struct zv_bucket {
+    double rate;		/* tokens added per second */
+    double burst;		/* most tokens held */
+    double tokens;		/* below 0 after a charge larger than what was left */
+    zv_tstamp stamp;		/* loop time `tokens` was refilled to */
+    struct zv_bucket_wait *waits;
+    int wait_max;
+    int wait_cnt;
+    struct zv_bucket *next;	/* in the loop's buckets with waiters */
+
+    double consumed;
+    uint64_t suspends;
+    uint64_t resumes;
+} zv_bucket;
+
+struct zv_bucket_stats {
+    double tokens;		/* as of the loop's time */
+    double consumed;		/* charged since init */
+    uint64_t suspends;		/* watchers that found the bucket empty */
+    uint64_t resumes;		/* watchers given their interest back by a refill */
+    int waiting;		/* watchers suspended right now */
+};
+
+// ================================
+// write corking, see zv_loop_cork
+struct zv_cork_stats {
+    uint64_t writes;		/* zv_write calls that were queued */
+    uint64_t syscalls;		/* writes made to flush them */
+    uint64_t bytes;		/* flushed */
+};
+
+// ================================
+// fibers
+typedef struct zv_fiber zv_fiber;
+typedef void (*zv_fiber_fn)(void *arg);
+
+#define ZV_FIBER_STACK (64 * 1024)	/* per fiber, committed as it is touched */
+
 // ================================
 // loop related data structures
 struct ANFD {
-    struct zv_watcher *watcher;
-    int events;
-    int active;
+    struct zv_io *head;		/* watchers on this fd, linked through `next` */
+    int events;			/* events the backend is watching for */
+    int reify;			/* queued in `fdchanges` */
+    int slot;			/* index in `fds` while `head` is set */
 };
 
 struct ANPENDING {
@@ -86,10 +295,16 @@ typedef struct zv_loop {
     int is_default;		/* indicate wether this is default loop */
     int backend;
     zv_tstamp zv_now;
+    zv_tstamp mn_now;		/* monotonic time of `zv_now`, to spot wall clock jumps */
+    zv_tstamp (*clock_now)(struct zv_loop *lp); /* NULL for the system clocks */
+    zv_tstamp (*clock_mono)(struct zv_loop *lp);
+    struct zv_mock *mock;	/* in-memory backend, see zv_mock_init */
     int activecnt;		/* how many watchers hold the loop right now */
     int loop_cnt;		/* how many loops have been so far */
+    int loop_done;		/* set by `zv_loop_break` */
     void (*backend_modify) (struct zv_loop *loop, int fd, int evs);
     void (*backend_poll) (struct zv_loop *loop, zv_tstamp timedout);
+    void (*backend_fork) (struct zv_loop *loop); /* NULL if nothing is shared after fork */
     int backend_fd;		/* for example, epoll use it */
     
 #ifdef EPOLL_BACKEND
@@ -98,24 +313,35 @@ typedef struct zv_loop {
 #endif // EPOLL_BACKEND
 
     /* current watching fds */
-    struct ANFD *anfds[ZV_OPENFD_MAX];
-    int anfds_max[ZV_OPENFD_MAX];
-    int anfds_cnt[ZV_OPENFD_MAX];
+    struct ANFD anfds[ZV_OPENFD_MAX];
     
     /* current pending events */
     struct ANPENDING *anpendings[NUM_PRI];
     int pendingmax[NUM_PRI];
+    int pendingcnt;		/* pending events over all priorities */
+    int pendingtail;		/* single priority builds: where the next event is queued */
+
+    /* fds with watchers, what a forked child moves to its own backend */
+    int fds[ZV_OPENFD_MAX];
+    int fd_cnt;
 
     /* fds whose events is about to change */
     int fdchanges[ZV_OPENFD_MAX];
+    int fdchange_cnt;
     
     struct zv_timer **timers;
+    struct zv_timer **timer_due; /* timers expired on this tick, as large as `timers` */
     int timer_max;
     int timer_cnt;
     
     struct zv_idle **idles[NUM_PRI];
     int idle_max[NUM_PRI];
     int idle_cnt[NUM_PRI];
+    int idleall;		/* active idle watchers over all priorities */
+
+    struct zv_periodic **periodics;
+    int periodic_max;
+    int periodic_cnt;
 
     struct zv_prepare **prepares;
     int prepare_max;
@@ -124,8 +350,58 @@ typedef struct zv_loop {
     struct zv_check **checks;
     int check_max;
     int check_cnt;
+
+    /* watcher whose callback is running right now, NULL between callbacks */
+    struct zv_watcher *cb_watcher;
+    w_cb cb_fn;			/* its callback, `cb_watcher` may be freed by it */
+    pthread_t tid;		/* thread running `zv_loop_run` */
+    int cpu;			/* first CPU of `zv_loop_new_on`, -1 if not placed */
+    int node;			/* NUMA node the loop's memory prefers, -1 if none */
+    struct zv_watchdog *watchdog;
+
+    struct zv_trace *trace;	/* NULL unless tracing */
+    struct zv_record *record;	/* NULL unless recording */
+    struct zv_aio *aio;		/* zv_fs_* requests, NULL until the first one */
+    struct zv_rate *rate;	/* refill tick of zv_bucket, NULL until a watcher waits */
+    struct zv_cork *cork;	/* zv_write queues, NULL until zv_loop_cork */
+
+    struct zv_pool pools[ZV_POOL_NUM];
+    struct fiber_stack *fiber_stacks; /* unused fiber stacks, kept mapped */
+    int fiber_stack_cnt;
+    int shrink_arrays;		/* trim arrays before the next iteration */
+
+    /* lets other threads interrupt the backend poll */
+    int wakeup_fd[2];
+    int wakeup_pending;
+    struct zv_io wakeup_io;
+
+    int sig_started;		/* default loop only */
+
+    /* one inotify fd shared by all zv_stat watchers, -1 until needed */
+    int fs_fd;
+    struct zv_io fs_io;
+    struct zv_stat **fs_hash;	/* by inotify watch descriptor */
+    int fs_hashmax;
+    int fs_hashcnt;
+    struct zv_stat *fs_changes;	/* hit by inotify since the last read */
 } zv_loop;
 
+// ================================
+// slow callback watchdog
+#define ZV_STALL_FRAMES 32
+#define ZV_WATCHDOG_SIGNO (SIGRTMIN + 1) /* interrupts the loop thread for a backtrace */
+
+/* a callback caught running longer than the watchdog threshold */
+struct zv_stall {
+    struct zv_watcher *watcher;
+    w_cb cb;
+    zv_tstamp started;		/* when the watchdog first saw the callback */
+    zv_tstamp detected;
+    int loop_cnt;
+    int nframes;		/* 0 if no backtrace could be taken */
+    void *frames[ZV_STALL_FRAMES];
+};
+
 // ================================
 // common functions
 zv_tstamp zv_time(void);
@@ -138,6 +414,81 @@ void zv_info(const char *cmt, ...);
 
 void zv_debug(const char *cmt, ...);
 
+int zv_set_allocator(void *(*cb)(void *ptr, long size));
+void *zv_realloc(void *ptr, long size);
+void *zv_calloc(long cnt, long size);
+void zv_free(void *ptr);
+
+void zv_pool_init(struct zv_pool *pool, int size, int perslab);
+void *zv_pool_get(struct zv_pool *pool);
+void zv_pool_put(struct zv_pool *pool, void *ptr);
+void zv_pool_shrink(struct zv_pool *pool, int keep);
+void zv_pool_destroy(struct zv_pool *pool);
+
+// ================================
+// event trace, dumped as a zv_trace_hdr followed by `count` records
+#define ZV_TRACE_MAGIC "ZVTRACE1"
+
+struct zv_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t reclen;		/* sizeof(struct zv_trace_rec) */
+    uint64_t count;
+};
+
+struct zv_trace_rec {
+    uint64_t watcher;		/* watcher address, only used as an id */
+    uint64_t start;		/* CLOCK_MONOTONIC, in ns */
+    uint64_t end;
+    int32_t revents;
+    int16_t priority;
+    int16_t type;		/* ZV_* bit naming the watcher type, ZV_READ for io */
+};
+
+int  zv_trace_start(zv_loop *lp, int capacity);
+void zv_trace_stop(zv_loop *lp);
+int  zv_trace_dump(zv_loop *lp, const char *path);
+
+// ================================
+// loop input record, a zv_record_hdr followed by records up to the end of file
+#define ZV_RECORD_MAGIC "ZVRECRD1"
+
+enum {
+    ZV_REC_TIME,		/* the loop's time after a poll */
+    ZV_REC_FD,			/* fd readiness reported by the poll before the next time */
+    ZV_REC_TIMER,		/* a timer or periodic expired */
+    ZV_REC_SIGNAL		/* a signal came through the signal thread */
+};
+
+struct zv_record_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t reclen;		/* sizeof(struct zv_record_rec) */
+};
+
+struct zv_record_rec {
+    int32_t type;		/* ZV_REC_* */
+    int32_t arg;		/* the fd, or the signal number */
+    union {
+	zv_tstamp now;		/* ZV_REC_TIME */
+	uint64_t value;		/* revents, timer address, or the fd a signal came through */
+    };
+};
+
+/* a replay, compared between builds on the same record */
+struct zv_replay_stats {
+    uint64_t events;		/* stub callbacks run */
+    uint64_t iterations;
+    zv_tstamp span;		/* virtual time replayed */
+    zv_tstamp elapsed;		/* real time the replay took */
+    uint64_t order;		/* hash of which stub ran in what order */
+};
+
+int  zv_record_start(zv_loop *lp, const char *path);
+void zv_record_stop(zv_loop *lp);
+int  zv_replay(const char *path, zv_tstamp cost, const char *order_path,
+	       struct zv_replay_stats *st);
+
 // user interfaces
 void zv_io_init(zv_io *w, w_cb cb, int fd, int events);
 void zv_io_start(zv_loop *lp, zv_io *w);
@@ -146,32 +497,166 @@ void zv_io_stop(zv_loop *lp, zv_io *w);
 void zv_timer_init(zv_timer *w, w_cb cb, zv_tstamp after, zv_tstamp repeat);
 void zv_timer_start(zv_loop *lp, zv_timer *w);
 void zv_timer_stop(zv_loop *lp, zv_timer *w);
+void zv_timer_set_slack(zv_timer *w, zv_tstamp slack);
 
+#if ZV_ENABLE_SIGNAL
 void zv_signal_init(zv_signal *w, w_cb cb, int signo);
 void zv_signal_start(zv_loop *lp, zv_signal *w);
 void zv_feed_signal(zv_loop *lp, int signo);
 void zv_signal_stop(zv_loop *lp, zv_signal *w);
+#endif // ZV_ENABLE_SIGNAL
 
+#if ZV_ENABLE_IDLE
 void zv_idle_init(zv_idle *w, w_cb cb);
 void zv_idle_start(zv_loop *lp, zv_idle *w);
 void zv_idle_stop(zv_loop *lp, zv_idle *w);
+#endif // ZV_ENABLE_IDLE
 
+#if ZV_ENABLE_PREPARE
 void zv_prepare_init(zv_prepare *w, w_cb cb);
 void zv_prepare_start(zv_loop *lp, zv_prepare *w);
 void zv_prepare_stop(zv_loop *lp, zv_prepare *w);
+#endif // ZV_ENABLE_PREPARE
 
+#if ZV_ENABLE_CHECK
 void zv_check_init(zv_check *w, w_cb cb);
 void zv_check_start(zv_loop *lp, zv_check *w);
 void zv_check_stop(zv_loop *lp, zv_check *w);
+#endif // ZV_ENABLE_CHECK
 
 void zv_feed_event(zv_loop *lp, zv_watcher *w, int revents);
+void queue_events(zv_loop *lp, zv_watcher **w, int eventcnt, int type);
 void fd_event(zv_loop *lp, int fd, int revents);
 
 void zv_invoke(zv_loop *lp, zv_watcher *w, int revents);
+void call_pending(zv_loop *lp);
 int  clear_pending(zv_loop *lp, zv_watcher *w);
 
+#if ZV_ENABLE_EMBED
+/* with a NULL callback the embedded loop is swept automatically */
+void zv_embed_init(zv_embed *w, w_cb cb, zv_loop *other);
+void zv_embed_start(zv_loop *lp, zv_embed *w);
+void zv_embed_stop(zv_loop *lp, zv_embed *w);
+void zv_embed_sweep(zv_loop *lp, zv_embed *w);
+#endif // ZV_ENABLE_EMBED
+
+#if ZV_ENABLE_CHILD
+void zv_child_init(zv_child *w, w_cb cb, int pid);
+void zv_child_start(zv_loop *lp, zv_child *w);
+void zv_child_stop(zv_loop *lp, zv_child *w);
+#endif // ZV_ENABLE_CHILD
+
+#if ZV_ENABLE_STAT
+/* `path` must stay valid while the watcher is active */
+void zv_stat_init(zv_stat *w, w_cb cb, const char *path, zv_tstamp interval);
+void zv_stat_start(zv_loop *lp, zv_stat *w);
+void zv_stat_stop(zv_loop *lp, zv_stat *w);
+#endif // ZV_ENABLE_STAT
+
+#if ZV_ENABLE_PERIODIC
+void zv_periodic_init(zv_periodic *w, w_cb cb, zv_tstamp offset, zv_tstamp interval,
+		      zv_tstamp (*reschedule_cb)(zv_periodic *w, zv_tstamp now));
+void zv_periodic_start(zv_loop *lp, zv_periodic *w);
+void zv_periodic_stop(zv_loop *lp, zv_periodic *w);
+#endif // ZV_ENABLE_PERIODIC
+
+/* pooled watchers, `*_free` stops the watcher first */
+zv_io *zv_io_new(zv_loop *lp, w_cb cb, int fd, int events);
+void zv_io_free(zv_loop *lp, zv_io *w);
+zv_timer *zv_timer_new(zv_loop *lp, w_cb cb, zv_tstamp after, zv_tstamp repeat);
+void zv_timer_free(zv_loop *lp, zv_timer *w);
+#if ZV_ENABLE_SIGNAL
+zv_signal *zv_signal_new(zv_loop *lp, w_cb cb, int signo);
+void zv_signal_free(zv_loop *lp, zv_signal *w);
+#endif // ZV_ENABLE_SIGNAL
+#if ZV_ENABLE_IDLE
+zv_idle *zv_idle_new(zv_loop *lp, w_cb cb);
+void zv_idle_free(zv_loop *lp, zv_idle *w);
+#endif // ZV_ENABLE_IDLE
+#if ZV_ENABLE_PREPARE
+zv_prepare *zv_prepare_new(zv_loop *lp, w_cb cb);
+void zv_prepare_free(zv_loop *lp, zv_prepare *w);
+#endif // ZV_ENABLE_PREPARE
+#if ZV_ENABLE_CHECK
+zv_check *zv_check_new(zv_loop *lp, w_cb cb);
+void zv_check_free(zv_loop *lp, zv_check *w);
+#endif // ZV_ENABLE_CHECK
+
+void *zv_loop_alloc(zv_loop *lp, long size);
+void zv_loop_dealloc(zv_loop *lp, void *ptr, long size);
+
+void zv_bucket_init(zv_bucket *b, double rate, double burst);
+int  zv_bucket_consume(zv_loop *lp, zv_bucket *b, zv_io *w, double amount);
+void zv_bucket_release(zv_loop *lp, zv_bucket *b, zv_io *w);
+void zv_bucket_stats(zv_loop *lp, zv_bucket *b, struct zv_bucket_stats *st);
+
+void zv_loop_cork(zv_loop *lp, int on);
+ssize_t zv_write(zv_loop *lp, int fd, const void *buf, size_t len);
+int  zv_cork_flush(zv_loop *lp, int fd);
+void zv_cork_discard(zv_loop *lp, int fd);
+void zv_cork_stats(zv_loop *lp, struct zv_cork_stats *st);
+
+zv_fiber *zv_fiber_new(zv_loop *lp, zv_fiber_fn fn, void *arg);
+void zv_fiber_resume(zv_fiber *f);
+void zv_fiber_suspend(void);
+zv_fiber *zv_fiber_self(void);
+ssize_t zv_fiber_read(int fd, void *buf, size_t len);
+ssize_t zv_fiber_write(int fd, const void *buf, size_t len);
+void zv_fiber_sleep(zv_tstamp after);
+
+void zv_fs_open(zv_loop *lp, zv_fs_req *req, const char *path, int flags, mode_t mode,
+		zv_fs_cb cb);
+void zv_fs_read(zv_loop *lp, zv_fs_req *req, int fd, void *buf, size_t len, off_t offset,
+		zv_fs_cb cb);
+void zv_fs_write(zv_loop *lp, zv_fs_req *req, int fd, const void *buf, size_t len,
+		 off_t offset, zv_fs_cb cb);
+void zv_fs_fsync(zv_loop *lp, zv_fs_req *req, int fd, zv_fs_cb cb);
+void zv_fs_readahead(zv_loop *lp, zv_fs_req *req, int fd, off_t offset, size_t len,
+		     zv_fs_cb cb);
+void zv_fs_set_limit(zv_loop *lp, int limit);
+int  zv_fs_set_uring(zv_loop *lp, int on);
+int  zv_fs_uring(zv_loop *lp);
+
+zv_channel *zv_channel_new(int slots, int slot_size);
+zv_channel *zv_channel_open(int memfd, int rfd, int wfd);
+void zv_channel_fds(zv_channel *ch, int *memfd, int *rfd, int *wfd);
+void zv_channel_free(zv_channel *ch);
+void *zv_channel_reserve(zv_channel *ch, size_t len);
+void zv_channel_commit(zv_channel *ch, size_t len);
+int  zv_channel_send(zv_channel *ch, const void *buf, size_t len);
+void zv_channel_start(zv_loop *lp, zv_channel *ch, zv_channel_cb cb);
+void zv_channel_stop(zv_loop *lp, zv_channel *ch);
+
 void zv_loop_init(zv_loop *lp);
+void zv_loop_destroy(zv_loop *lp);
 zv_loop *zv_default_loop();
-void zv_loop_run(zv_loop *lp);
+int  zv_loop_run(zv_loop *lp, int flags);
+void zv_loop_break(zv_loop *lp);
+void zv_loop_wakeup(zv_loop *lp);
+void zv_loop_set_clock(zv_loop *lp, zv_tstamp (*now)(zv_loop *lp),
+		       zv_tstamp (*mono)(zv_loop *lp));
+zv_tstamp zv_loop_time(zv_loop *lp);
+int  zv_backend_fd(zv_loop *lp);
+void zv_loop_shrink(zv_loop *lp);
+void zv_loop_fork(zv_loop *lp);
+
+/* placed loops, see zv_numa.c */
+zv_loop *zv_loop_new_on(const int *cpus, int ncpus);
+int  zv_loop_steer(zv_loop *lp, int fd);
+int  zv_incoming_cpu(int fd);
+
+int  zv_watchdog_start(zv_loop *lp, zv_tstamp threshold);
+void zv_watchdog_stop(zv_loop *lp);
+int  zv_watchdog_fetch(zv_loop *lp, struct zv_stall *stalls, int max);
+
+/* virtual time and scripted readiness, call right after zv_loop_init */
+void zv_mock_init(zv_loop *lp, zv_tstamp start);
+void zv_mock_ready(zv_loop *lp, zv_tstamp at, int fd, int revents);
+void zv_mock_advance(zv_loop *lp, zv_tstamp dt);
+void zv_mock_jump(zv_loop *lp, zv_tstamp dt);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // _ZV_H
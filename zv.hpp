@@ -0,0 +1,246 @@
+// C++ wrappers over zv watchers, header only
+
+#ifndef _ZV_HPP_
+#define _ZV_HPP_
+
+#include "zv.h"
+
+#include <assert.h>
+#include <type_traits>
+
+namespace zv {
+
+/* a handle on a zv_loop, it does not own the loop */
+class loop {
+public:
+    explicit loop(zv_loop *lp) noexcept : lp(lp) {}
+
+    static loop default_loop() { return loop(zv_default_loop()); }
+
+    int run(int flags = ZV_RUN_DEFAULT) { return zv_loop_run(lp, flags); }
+    void break_loop() { zv_loop_break(lp); }
+    void wakeup() { zv_loop_wakeup(lp); }
+    void shrink() { zv_loop_shrink(lp); }
+    zv_tstamp now() const noexcept { return lp -> zv_now; }
+
+    zv_loop *raw() const noexcept { return lp; }
+
+private:
+    zv_loop *lp;
+};
+
+namespace detail {
+
+/*
+ * The callback stored in the C watcher is a thunk instantiated for the
+ * bound function, so dispatch is the same single indirect call the C API
+ * makes, and the bound function is called directly inside it. The thunk
+ * gets the wrapper back from the C watcher it holds at offset 0, and the
+ * bound object from `data`.
+ */
+template <class Self, class W,
+	  void (*Start)(zv_loop *, W *), void (*Stop)(zv_loop *, W *)>
+class watcher {
+public:
+    watcher(const watcher &) = delete;
+    watcher &operator=(const watcher &) = delete;
+
+    bool active() const noexcept { return w.active; }
+    bool pending() const noexcept { return w.pending; }
+    int priority() const noexcept { return w.priority; }
+    void set_priority(int pri) noexcept {
+	assert(!w.active);
+	w.priority = pri;
+    }
+
+    /* obj -> *M(watcher, revents) */
+    template <class T, void (T::*M)(Self &, int)>
+    void set(T *obj) noexcept {
+	w.data = obj;
+	w.cb = method_thunk<T, M>;
+    }
+
+    /* F(watcher, revents) */
+    template <void (*F)(Self &, int)>
+    void set() noexcept {
+	w.data = nullptr;
+	w.cb = function_thunk<F>;
+    }
+
+    /* (*f)(watcher, revents), `f` must outlive the watcher, e.g. a lambda */
+    template <class F>
+    void set(F *f) noexcept {
+	w.data = f;
+	w.cb = functor_thunk<F>;
+    }
+
+    void start() noexcept {
+	assert(w.cb);
+	Start(lp, &w);
+    }
+    void stop() noexcept { Stop(lp, &w); }
+
+    W *raw() noexcept { return &w; }
+    zv_loop *raw_loop() const noexcept { return lp; }
+
+protected:
+    explicit watcher(loop l) noexcept : lp(l.raw()) {}
+
+    /* an active watcher is restarted in its new place, a pending event is dropped */
+    watcher(watcher &&o) noexcept : lp(o.lp) {
+	take(o);
+    }
+    watcher &operator=(watcher &&o) noexcept {
+	if (this != &o) {
+	    stop();
+	    lp = o.lp;
+	    take(o);
+	}
+	return *this;
+    }
+    ~watcher() { stop(); }
+
+    W w;
+    zv_loop *lp;
+
+private:
+    void take(watcher &o) noexcept {
+	bool was_active = o.w.active;
+	o.stop();
+	w = o.w;
+	if (was_active)
+	    Start(lp, &w);
+    }
+
+    static Self &self(W *w) noexcept {
+	static_assert(std::is_standard_layout<Self>::value,
+		      "zv watcher wrappers must not add data members");
+	return *reinterpret_cast<Self *>(w);
+    }
+
+    template <class T, void (T::*M)(Self &, int)>
+    static void method_thunk(zv_loop *, W *w, int revents) {
+	(static_cast<T *>(w -> data) ->* M)(self(w), revents);
+    }
+
+    template <void (*F)(Self &, int)>
+    static void function_thunk(zv_loop *, W *w, int revents) {
+	F(self(w), revents);
+    }
+
+    template <class F>
+    static void functor_thunk(zv_loop *, W *w, int revents) {
+	(*static_cast<F *>(w -> data))(self(w), revents);
+    }
+};
+
+} // namespace detail
+
+class io : public detail::watcher<io, zv_io, zv_io_start, zv_io_stop> {
+public:
+    explicit io(loop l) noexcept : watcher(l) { zv_io_init(&w, nullptr, -1, ZV_NONE); }
+    io(io &&) = default;
+    io &operator=(io &&) = default;
+
+    using watcher::set;
+    using watcher::start;
+
+    void set(int fd, int events) noexcept {
+	assert(!w.active);
+	w.fd = fd;
+	w.events = events;
+    }
+    void start(int fd, int events) noexcept {
+	stop();
+	set(fd, events);
+	start();
+    }
+
+    int fd() const noexcept { return w.fd; }
+    int events() const noexcept { return w.events; }
+};
+
+class timer : public detail::watcher<timer, zv_timer, zv_timer_start, zv_timer_stop> {
+public:
+    explicit timer(loop l) noexcept : watcher(l) { zv_timer_init(&w, nullptr, 0.0, 0.0); }
+    timer(timer &&) = default;
+    timer &operator=(timer &&) = default;
+
+    using watcher::set;
+    using watcher::start;
+
+    /* re-initialize the deadline, keeping the callback, priority and slack */
+    void set(zv_tstamp after, zv_tstamp repeat = 0.0) noexcept {
+	assert(!w.active);
+	zv_timer t = w;
+	zv_timer_init(&w, nullptr, after, repeat);
+	w.cb = t.cb;
+	w.data = t.data;
+	w.priority = t.priority;
+	w.slack = t.slack;
+    }
+    void start(zv_tstamp after, zv_tstamp repeat = 0.0) noexcept {
+	stop();
+	set(after, repeat);
+	start();
+    }
+    void set_slack(zv_tstamp slack) noexcept { zv_timer_set_slack(&w, slack); }
+
+    zv_tstamp at() const noexcept { return w.at; }
+    zv_tstamp repeat() const noexcept { return w.repeat; }
+};
+
+#if ZV_ENABLE_SIGNAL
+class signal : public detail::watcher<signal, zv_signal, zv_signal_start, zv_signal_stop> {
+public:
+    explicit signal(loop l) noexcept : watcher(l) { zv_signal_init(&w, nullptr, 0); }
+    signal(signal &&) = default;
+    signal &operator=(signal &&) = default;
+
+    using watcher::set;
+    using watcher::start;
+
+    void set(int signo) noexcept {
+	assert(!w.active);
+	w.signo = signo;
+    }
+    void start(int signo) noexcept {
+	stop();
+	set(signo);
+	start();
+    }
+
+    int signo() const noexcept { return w.signo; }
+};
+#endif // ZV_ENABLE_SIGNAL
+
+#if ZV_ENABLE_IDLE
+class idle : public detail::watcher<idle, zv_idle, zv_idle_start, zv_idle_stop> {
+public:
+    explicit idle(loop l) noexcept : watcher(l) { zv_idle_init(&w, nullptr); }
+    idle(idle &&) = default;
+    idle &operator=(idle &&) = default;
+};
+#endif // ZV_ENABLE_IDLE
+
+#if ZV_ENABLE_PREPARE
+class prepare : public detail::watcher<prepare, zv_prepare, zv_prepare_start, zv_prepare_stop> {
+public:
+    explicit prepare(loop l) noexcept : watcher(l) { zv_prepare_init(&w, nullptr); }
+    prepare(prepare &&) = default;
+    prepare &operator=(prepare &&) = default;
+};
+#endif // ZV_ENABLE_PREPARE
+
+#if ZV_ENABLE_CHECK
+class check : public detail::watcher<check, zv_check, zv_check_start, zv_check_stop> {
+public:
+    explicit check(loop l) noexcept : watcher(l) { zv_check_init(&w, nullptr); }
+    check(check &&) = default;
+    check &operator=(check &&) = default;
+};
+#endif // ZV_ENABLE_CHECK
+
+} // namespace zv
+
+#endif // _ZV_HPP_
@@ -0,0 +1,183 @@
+// token buckets throttling io watchers, refilled by one tick per loop
+
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define BUCKET_WAITBLK 16
+
+void ref_loop(zv_loop *lp);
+void unref_loop(zv_loop *lp);
+void fd_change(zv_loop *lp, int fd);
+void timer_start_at(zv_loop *lp, zv_timer *w);
+
+/*
+ * A suspended watcher stays active with no interest, so the backend
+ * keeps its fd and resuming it is a single modify. The tick only runs
+ * while some bucket has waiters, and gives every waiter of a bucket its
+ * interest back at once, instead of a timer per throttled watcher.
+ */
+struct zv_rate {
+    zv_timer tick;
+    zv_bucket *waiting;		/* buckets with suspended watchers */
+};
+
+static void bucket_refill(zv_bucket *b, zv_tstamp now) {
+    if (now <= b -> stamp)
+	return;
+    b -> tokens += (now - b -> stamp) * b -> rate;
+    if (b -> tokens > b -> burst)
+	b -> tokens = b -> burst;
+    b -> stamp = now;
+}
+
+static void bucket_resume(zv_loop *lp, zv_bucket *b) {
+    for (int i=0; i<(b -> wait_cnt); i++) {
+	zv_io *w = (b -> waits)[i].w;
+	w -> events = (b -> waits)[i].events;
+	if (w -> active)
+	    fd_change(lp, w -> fd);
+    }
+    b -> resumes += b -> wait_cnt;
+    b -> wait_cnt = 0;
+}
+
+static void bucket_unlist(zv_loop *lp, zv_bucket *b) {
+    zv_bucket **bp;
+    for (bp = &lp -> rate -> waiting; *bp; bp = &(*bp) -> next) {
+	if (*bp == b) {
+	    *bp = b -> next;
+	    break;
+	}
+    }
+    b -> next = NULL;
+}
+
+static void rate_tick_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)w; (void)revents;	/* unused */
+    struct zv_rate *rate = lp -> rate;
+    zv_bucket **bp = &rate -> waiting, *b;
+
+    while ((b = *bp)) {
+	bucket_refill(b, lp -> zv_now);
+	if (b -> tokens > 0.0) {
+	    bucket_resume(lp, b);
+	    *bp = b -> next;
+	    b -> next = NULL;
+	} else {
+	    bp = &b -> next;
+	}
+    }
+
+    if (rate -> waiting == NULL) {
+	ref_loop(lp);
+	zv_timer_stop(lp, &rate -> tick);
+    }
+}
+
+static void bucket_suspend(zv_loop *lp, zv_bucket *b, zv_io *w) {
+    if (b -> wait_cnt == b -> wait_max) {
+	b -> wait_max += BUCKET_WAITBLK;
+	b -> waits = (struct zv_bucket_wait *)zv_realloc(b -> waits,
+							 sizeof(struct zv_bucket_wait) * b -> wait_max);
+    }
+    (b -> waits)[b -> wait_cnt].w = w;
+    (b -> waits)[b -> wait_cnt].events = w -> events;
+    b -> suspends += 1;
+
+    /* an event queued before the charge is not delivered either */
+    w -> events = ZV_NONE;
+    clear_pending(lp, (zv_watcher *)w);
+    fd_change(lp, w -> fd);
+
+    if ((b -> wait_cnt)++)
+	return;
+    if (lp -> rate == NULL) {
+	lp -> rate = (struct zv_rate *)zv_calloc(1, sizeof(struct zv_rate));
+	zv_timer_init(&lp -> rate -> tick, rate_tick_cb, ZV_BUCKET_TICK, ZV_BUCKET_TICK);
+	/* buckets refill continuously, a late tick only shifts the resume */
+	zv_timer_set_slack(&lp -> rate -> tick, ZV_BUCKET_TICK / 2);
+    }
+    b -> next = lp -> rate -> waiting;
+    lp -> rate -> waiting = b;
+
+    /* internal, the suspended watchers hold the loop */
+    if (!lp -> rate -> tick.active) {
+	/* a tick from now, not from when it last stopped */
+	lp -> rate -> tick.at = lp -> zv_now + ZV_BUCKET_TICK;
+	timer_start_at(lp, &lp -> rate -> tick);
+	unref_loop(lp);
+    }
+}
+
+/* by zv_loop_destroy, the buckets are the caller's */
+void rate_destroy(zv_loop *lp) {
+    if (lp -> rate -> tick.active) {
+	ref_loop(lp);
+	zv_timer_stop(lp, &lp -> rate -> tick);
+    }
+    zv_free(lp -> rate);
+    lp -> rate = NULL;
+}
+
+/* `rate` tokens per second, up to `burst` banked, it starts full */
+void zv_bucket_init(zv_bucket *b, double rate, double burst) {
+    assert(b && rate > 0.0 && burst > 0.0);
+
+    memset(b, 0, sizeof(*b));
+    b -> rate = rate;
+    b -> burst = burst;
+    b -> tokens = burst;
+}
+
+/*
+ * Charge `amount`, bytes or requests, for what `w` just did. Returns 1
+ * if the bucket still has tokens. Otherwise `w` loses its interest and
+ * 0 is returned; the tick that refills the bucket gives it back. A
+ * charge beyond what is left is paid off by later refills, so large
+ * writes are paced to `rate`. A watcher waits on one bucket at a time,
+ * `zv_bucket_release` it before it is stopped for good.
+ */
+int zv_bucket_consume(zv_loop *lp, zv_bucket *b, zv_io *w, double amount) {
+    assert(lp && b && w);
+
+    bucket_refill(b, lp -> zv_now);
+    b -> tokens -= amount;
+    b -> consumed += amount;
+    if (b -> tokens > 0.0)
+	return 1;
+
+    if (w -> events != ZV_NONE)
+	bucket_suspend(lp, b, w);
+    return 0;
+}
+
+/* give `w` its interest back now, if it waits on `b` */
+void zv_bucket_release(zv_loop *lp, zv_bucket *b, zv_io *w) {
+    assert(lp && b && w);
+
+    for (int i=0; i<(b -> wait_cnt); i++) {
+	if ((b -> waits)[i].w != w)
+	    continue;
+	w -> events = (b -> waits)[i].events;
+	if (w -> active)
+	    fd_change(lp, w -> fd);
+	(b -> waits)[i] = (b -> waits)[--(b -> wait_cnt)];
+	if (b -> wait_cnt == 0)
+	    bucket_unlist(lp, b);
+	return;
+    }
+}
+
+void zv_bucket_stats(zv_loop *lp, zv_bucket *b, struct zv_bucket_stats *st) {
+    assert(lp && b && st);
+
+    bucket_refill(b, lp -> zv_now);
+    st -> tokens = b -> tokens;
+    st -> consumed = b -> consumed;
+    st -> suspends = b -> suspends;
+    st -> resumes = b -> resumes;
+    st -> waiting = b -> wait_cnt;
+}
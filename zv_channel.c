@@ -0,0 +1,299 @@
+// single producer, single consumer ring in shared memory
+
+#define _GNU_SOURCE
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif // HAVE_SYS_EVENTFD_H
+
+#define CHANNEL_MAGIC 0x7a766368	/* "zvch" */
+
+/*
+ * The shared part, at the start of the mapping. Each index has a cache
+ * line to itself, the producer only writes `tail` and the consumer only
+ * writes `head`. A slot is the message length followed by the message.
+ */
+struct zv_chan_ring {
+    uint32_t magic;
+    uint32_t slots;		/* a power of 2 */
+    uint32_t slot_size;
+    char pad0[ZV_CACHELINE - 3 * sizeof(uint32_t)];
+    uint32_t tail;
+    char pad1[ZV_CACHELINE - sizeof(uint32_t)];
+    uint32_t head;
+    char pad2[ZV_CACHELINE - sizeof(uint32_t)];
+    char data[];
+} __attribute__((aligned(ZV_CACHELINE)));
+
+static char *chan_slot(struct zv_chan_ring *ring, uint32_t idx) {
+    return ring -> data + (size_t)(idx & (ring -> slots - 1)) * ring -> slot_size;
+}
+
+static int chan_memfd(size_t size) {
+#ifdef HAVE_MEMFD_CREATE
+    int fd = memfd_create("zv_channel", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/zv_channel.%ld.%p", (long)getpid(), (void *)&name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0)
+	shm_unlink(name);
+#endif // HAVE_MEMFD_CREATE
+    if (fd < 0)
+	return -1;
+    if (ftruncate(fd, size) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static zv_channel *chan_map(int memfd, size_t size, int rfd, int wfd) {
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ring == MAP_FAILED)
+	return NULL;
+
+    zv_channel *ch = (zv_channel *)zv_calloc(1, sizeof(zv_channel));
+    ch -> ring = (struct zv_chan_ring *)ring;
+    ch -> map_size = size;
+    ch -> memfd = memfd;
+    (ch -> efd)[0] = rfd;
+    (ch -> efd)[1] = wfd;
+    ch -> head = __atomic_load_n(&ch -> ring -> head, __ATOMIC_ACQUIRE);
+    ch -> tail = __atomic_load_n(&ch -> ring -> tail, __ATOMIC_ACQUIRE);
+    ch -> cached = ch -> head;
+    return ch;
+}
+
+/*
+ * A ring of `slots` messages of up to `slot_size` bytes less the length
+ * word, in a memfd. Both ends can use the returned channel, threads of
+ * one process directly, a forked child through its copy of it. Other
+ * processes get the fds from `zv_channel_fds` and `zv_channel_open` them.
+ */
+zv_channel *zv_channel_new(int slots, int slot_size) {
+    assert(slots > 0 && (slots & (slots - 1)) == 0);
+    assert(slot_size > (int)sizeof(uint32_t));
+
+    /* keep every slot's length word aligned */
+    slot_size = (slot_size + sizeof(uint32_t) - 1) & ~(int)(sizeof(uint32_t) - 1);
+    size_t size = sizeof(struct zv_chan_ring) + (size_t)slots * slot_size;
+
+    int memfd = chan_memfd(size);
+    if (memfd < 0) {
+	zv_err(0, "cannot create the channel's shared memory");
+	return NULL;
+    }
+
+    int efd[2];
+#ifdef HAVE_SYS_EVENTFD_H
+    efd[0] = efd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd[0] < 0) {
+	zv_err(0, "eventfd error");
+	close(memfd);
+	return NULL;
+    }
+#else
+    if (pipe(efd) < 0) {
+	zv_err(0, "pipe error");
+	close(memfd);
+	return NULL;
+    }
+    for (int i=0; i<2; i++) {
+	fcntl(efd[i], F_SETFL, O_NONBLOCK);
+	fcntl(efd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif // HAVE_SYS_EVENTFD_H
+
+    /* a fresh memfd is zero filled, so both indices start at 0 */
+    zv_channel *ch = chan_map(memfd, size, efd[0], efd[1]);
+    if (ch == NULL) {
+	zv_err(0, "mmap error");
+	close(memfd);
+	close(efd[0]);
+	if (efd[1] != efd[0])
+	    close(efd[1]);
+	return NULL;
+    }
+    ch -> ring -> slots = slots;
+    ch -> ring -> slot_size = slot_size;
+    __atomic_store_n(&ch -> ring -> magic, CHANNEL_MAGIC, __ATOMIC_RELEASE);
+    return ch;
+}
+
+/* the other end of a channel, from fds passed by its creator, the fds are owned afterwards */
+zv_channel *zv_channel_open(int memfd, int rfd, int wfd) {
+    struct zv_chan_ring hdr;
+    if (pread(memfd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+	hdr.magic != CHANNEL_MAGIC) {
+	zv_warn("not a zv_channel");
+	return NULL;
+    }
+
+    size_t size = sizeof(struct zv_chan_ring) + (size_t)hdr.slots * hdr.slot_size;
+    zv_channel *ch = chan_map(memfd, size, rfd, wfd);
+    if (ch == NULL)
+	zv_err(0, "mmap error");
+    return ch;
+}
+
+/* what another process needs to `zv_channel_open` this channel */
+void zv_channel_fds(zv_channel *ch, int *memfd, int *rfd, int *wfd) {
+    assert(ch);
+
+    *memfd = ch -> memfd;
+    *rfd = (ch -> efd)[0];
+    *wfd = (ch -> efd)[1];
+}
+
+/* stop it first if it is consumed by a loop */
+void zv_channel_free(zv_channel *ch) {
+    assert(ch && !ch -> io.active);
+
+    munmap(ch -> ring, ch -> map_size);
+    close(ch -> memfd);
+    close((ch -> efd)[0]);
+    if ((ch -> efd)[1] != (ch -> efd)[0])
+	close((ch -> efd)[1]);
+    zv_free(ch);
+}
+
+// ===============================
+// producer
+
+/*
+ * Room for a message of up to `len` bytes in the next slot, NULL with
+ * errno EAGAIN while the ring is full, or EMSGSIZE if it cannot fit.
+ * Write the message there and `zv_channel_commit` it, no copy is made.
+ */
+void *zv_channel_reserve(zv_channel *ch, size_t len) {
+    struct zv_chan_ring *ring = ch -> ring;
+
+    if (len > ring -> slot_size - sizeof(uint32_t)) {
+	errno = EMSGSIZE;
+	return NULL;
+    }
+    /* the consumer's index is only read again when the last one seen says full */
+    if (ch -> tail - ch -> cached == ring -> slots) {
+	ch -> cached = __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE);
+	if (ch -> tail - ch -> cached == ring -> slots) {
+	    errno = EAGAIN;
+	    return NULL;
+	}
+    }
+    return chan_slot(ring, ch -> tail) + sizeof(uint32_t);
+}
+
+/* publish the reserved slot, the consumer is only woken when the ring was empty */
+void zv_channel_commit(zv_channel *ch, size_t len) {
+    struct zv_chan_ring *ring = ch -> ring;
+    uint32_t was = ch -> tail;
+
+    memcpy(chan_slot(ring, was), &(uint32_t){ (uint32_t)len }, sizeof(uint32_t));
+    ch -> tail = was + 1;
+    __atomic_store_n(&ring -> tail, ch -> tail, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in `channel_drain`, one of the two sides sees the other */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring -> head, __ATOMIC_RELAXED) == was) {
+	uint64_t one = 1;
+	if (write((ch -> efd)[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+	    zv_err(0, "write to the channel's eventfd error");
+    }
+}
+
+/* 0, or -1 with errno as `zv_channel_reserve` */
+int zv_channel_send(zv_channel *ch, const void *buf, size_t len) {
+    assert(ch && (buf || len == 0));
+
+    void *slot = zv_channel_reserve(ch, len);
+    if (slot == NULL)
+	return -1;
+    memcpy(slot, buf, len);
+    zv_channel_commit(ch, len);
+    return 0;
+}
+
+// ===============================
+// consumer
+
+/*
+ * Hand the messages to the callback in batches of up to ZV_CHANNEL_BATCH.
+ * The slots are released after each batch returns. At most one ring's
+ * worth goes per wakeup, the rest is fed for the next iteration, since
+ * the producer does not wake a consumer that is behind.
+ */
+static void channel_drain(zv_loop *lp, zv_channel *ch) {
+    struct zv_chan_ring *ring = ch -> ring;
+    struct iovec msgs[ZV_CHANNEL_BATCH];
+    uint32_t budget = ring -> slots;
+
+    while (ch -> io.active) {
+	uint32_t tail = __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE);
+	uint32_t avail = tail - ch -> head;
+	if (avail == 0)
+	    return;
+	if (budget == 0) {
+	    zv_feed_event(lp, (zv_watcher *)&ch -> io, ZV_READ);
+	    return;
+	}
+
+	int cnt = avail < ZV_CHANNEL_BATCH ? (int)avail : ZV_CHANNEL_BATCH;
+	if ((uint32_t)cnt > budget)
+	    cnt = budget;
+	for (int i=0; i<cnt; i++) {
+	    char *slot = chan_slot(ring, ch -> head + i);
+	    uint32_t len;
+	    memcpy(&len, slot, sizeof(len));
+	    msgs[i].iov_base = slot + sizeof(uint32_t);
+	    msgs[i].iov_len = len;
+	}
+	ch -> cb(lp, ch, msgs, cnt);
+
+	ch -> head += cnt;
+	budget -= cnt;
+	__atomic_store_n(&ring -> head, ch -> head, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+static void channel_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+    zv_channel *ch = (zv_channel *)(w -> data);
+    char buf[64];
+
+    while (read((ch -> efd)[0], buf, sizeof(buf)) > 0)
+	;
+    channel_drain(lp, ch);
+}
+
+/* consume the channel on `lp`, only one loop may */
+void zv_channel_start(zv_loop *lp, zv_channel *ch, zv_channel_cb cb) {
+    assert(lp && ch && cb);
+
+    if (ch -> io.active)
+	return;
+    ch -> cb = cb;
+    zv_io_init(&ch -> io, channel_cb, (ch -> efd)[0], ZV_READ);
+    ch -> io.data = ch;
+    zv_io_start(lp, &ch -> io);
+
+    /* anything sent before the start woke nobody in this loop */
+    zv_feed_event(lp, (zv_watcher *)&ch -> io, ZV_READ);
+}
+
+void zv_channel_stop(zv_loop *lp, zv_channel *ch) {
+    assert(lp && ch);
+
+    zv_io_stop(lp, &ch -> io);
+}
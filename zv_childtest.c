@@ -0,0 +1,110 @@
+// zv_child on a loop other than the default one, through pidfds
+
+#include "zv.h"
+#include "zv_test.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define CHILDREN 500
+
+struct reaped {
+    int cnt;
+    int errors;
+};
+
+static void child_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp;			/* unused */
+    struct reaped *r = (struct reaped *)(w -> data);
+
+    check(revents & ZV_CHILD);
+    if (revents & ZV_ERROR)
+	r -> errors++;
+    else
+	r -> cnt++;
+}
+
+/* every third child is killed, the others exit with a status of their own */
+static int spawn(int i) {
+    int pid = fork();
+    if (pid < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0) {
+	if (i % 3 == 0)
+	    pause();
+	_exit(i & 0xff);
+    }
+    return pid;
+}
+
+static void test_reap(zv_loop *lp) {
+    static zv_child ws[CHILDREN];
+    struct reaped r = { 0, 0 };
+
+    for (int i=0; i<CHILDREN; i++) {
+	zv_child_init(ws + i, child_cb, spawn(i));
+	ws[i].data = &r;
+	zv_child_start(lp, ws + i);
+	check(ws[i].active && ws[i].io.fd >= 0);	/* a pidfd, no SIGCHLD here */
+	if (i % 3 == 0)
+	    kill(ws[i].pid, i % 2 ? SIGKILL : SIGTERM);
+    }
+
+    /* the children hold the loop until the last one is reaped */
+    while (zv_loop_run(lp, ZV_RUN_ONCE))
+	;
+    check(r.cnt == CHILDREN && r.errors == 0);
+
+    for (int i=0; i<CHILDREN; i++) {
+	zv_child *w = ws + i;
+	check(!w -> active && w -> rpid == w -> pid);
+	if (i % 3 == 0)
+	    check(WIFSIGNALED(w -> rstatus) && WTERMSIG(w -> rstatus) == (i % 2 ? SIGKILL : SIGTERM));
+	else
+	    check(WIFEXITED(w -> rstatus) && WEXITSTATUS(w -> rstatus) == (i & 0xff));
+    }
+    check(waitpid(-1, NULL, WNOHANG) < 0 && errno == ECHILD);
+}
+
+/* reaped behind the watcher's back, and gone before it started */
+static void test_unreapable(zv_loop *lp) {
+    struct reaped r = { 0, 0 };
+    zv_child w;
+
+    int pid = spawn(1);
+    zv_child_init(&w, child_cb, pid);
+    w.data = &r;
+    zv_child_start(lp, &w);
+    check(w.active);
+    check(waitpid(pid, NULL, 0) == pid);
+    while (zv_loop_run(lp, ZV_RUN_ONCE))
+	;
+    check(r.errors == 1 && r.cnt == 0);
+    check(!w.active && w.rpid == -1);
+
+    zv_child_init(&w, child_cb, pid);
+    w.data = &r;
+    zv_child_start(lp, &w);
+    check(!w.active);
+    zv_loop_run(lp, ZV_RUN_NOWAIT);
+    check(r.errors == 2 && r.cnt == 0);
+    check(w.rpid == -1);
+}
+
+int main(void) {
+    zv_loop *lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(lp);
+
+    test_reap(lp);
+    test_unreapable(lp);
+
+    zv_loop_destroy(lp);
+    zv_free(lp);
+    return test_result();
+}
@@ -0,0 +1,218 @@
+// write corking, what the callbacks write in one iteration leaves once per fd
+
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define CORK_BLK 4096
+#define CORK_KEEP (64 * 1024)	/* buffer kept by an fd between iterations */
+
+/*
+ * Each fd queues into one contiguous buffer, so its flush is a single
+ * write however many pieces went in. The pieces are copied, the
+ * callers' buffers need not outlive the call. Output that does not fit
+ * in the socket waits on a write watcher of the fd's own, which holds
+ * the loop until it is out.
+ */
+struct cork_fd {
+    char *buf;
+    size_t off;			/* written so far */
+    size_t len;
+    size_t max;
+    int err;			/* errno of a failed flush, for the next zv_write */
+    int dirty;			/* in `dirty` */
+    zv_io wio;			/* waits for room after a short write */
+};
+
+struct zv_cork {
+    int on;
+    struct cork_fd **fds;	/* by fd, NULL until written to */
+    int *dirty;			/* fds queued into since the last flush */
+    int dirty_cnt;
+    struct zv_cork_stats stats;
+};
+
+static void cork_wio_cb(zv_loop *lp, zv_watcher *w, int revents);
+
+/* 0 when all of it is out or waiting for room, -1 with errno when the data had to be dropped */
+static int cork_flush_fd(zv_loop *lp, int fd) {
+    struct zv_cork *ck = lp -> cork;
+    struct cork_fd *cf = (ck -> fds)[fd];
+
+    while (cf -> off < cf -> len) {
+	ssize_t n = write(fd, cf -> buf + cf -> off, cf -> len - cf -> off);
+	ck -> stats.syscalls += 1;
+	if (n >= 0) {
+	    cf -> off += n;
+	    continue;
+	}
+	if (errno == EINTR)
+	    continue;
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    if (!cf -> wio.active) {
+		zv_io_init(&cf -> wio, cork_wio_cb, fd, ZV_WRITE);
+		zv_io_start(lp, &cf -> wio);
+	    }
+	    return 0;
+	}
+	cf -> err = errno;
+	break;
+    }
+
+    ck -> stats.bytes += cf -> off;
+    cf -> off = cf -> len = 0;
+    if (cf -> wio.active)
+	zv_io_stop(lp, &cf -> wio);
+    if (cf -> max > CORK_KEEP) {
+	zv_free(cf -> buf);
+	cf -> buf = NULL;
+	cf -> max = 0;
+    }
+    if (cf -> err) {
+	errno = cf -> err;
+	return -1;
+    }
+    return 0;
+}
+
+static void cork_wio_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)revents;		/* unused */
+
+    cork_flush_fd(lp, ((zv_io *)w) -> fd);
+}
+
+/* called by the loop after the callbacks of each phase that may write */
+void cork_flush(zv_loop *lp) {
+    struct zv_cork *ck = lp -> cork;
+
+    for (int i=0; i<(ck -> dirty_cnt); i++) {
+	int fd = (ck -> dirty)[i];
+	(ck -> fds)[fd] -> dirty = 0;
+	cork_flush_fd(lp, fd);
+    }
+    ck -> dirty_cnt = 0;
+}
+
+/* by zv_loop_destroy, what is still queued is dropped */
+void cork_destroy(zv_loop *lp) {
+    struct zv_cork *ck = lp -> cork;
+
+    for (int fd=0; fd<ZV_OPENFD_MAX; fd++) {
+	struct cork_fd *cf = (ck -> fds)[fd];
+	if (cf == NULL)
+	    continue;
+	if (cf -> wio.active)
+	    zv_io_stop(lp, &cf -> wio);
+	zv_free(cf -> buf);
+	zv_free(cf);
+    }
+    zv_free(ck -> fds);
+    zv_free(ck -> dirty);
+    zv_free(ck);
+    lp -> cork = NULL;
+}
+
+/*
+ * While on, what `zv_write` is given from inside a callback is queued,
+ * and written out once per fd when the callbacks of the iteration are
+ * done. Turning it off writes out what is queued.
+ */
+void zv_loop_cork(zv_loop *lp, int on) {
+    assert(lp);
+
+    if (lp -> cork == NULL) {
+	if (!on)
+	    return;
+	struct zv_cork *ck = (struct zv_cork *)zv_calloc(1, sizeof(struct zv_cork));
+	ck -> fds = (struct cork_fd **)zv_calloc(ZV_OPENFD_MAX, sizeof(void *));
+	ck -> dirty = (int *)zv_calloc(ZV_OPENFD_MAX, sizeof(int));
+	lp -> cork = ck;
+    }
+    lp -> cork -> on = on;
+    if (!on)
+	cork_flush(lp);
+}
+
+/*
+ * write(2) for loops that may cork. Queued data is reported as written,
+ * an error in its flush is returned by the next call on the fd instead.
+ * Once something is queued for an fd, later writes queue behind it even
+ * from outside a callback, so the order is kept.
+ */
+ssize_t zv_write(zv_loop *lp, int fd, const void *buf, size_t len) {
+    assert(lp && fd >= 0 && fd < ZV_OPENFD_MAX);
+
+    struct zv_cork *ck = lp -> cork;
+    struct cork_fd *cf = ck ? (ck -> fds)[fd] : NULL;
+    if (cf && cf -> err) {
+	errno = cf -> err;
+	cf -> err = 0;
+	return -1;
+    }
+    if (!(cf && cf -> len) && !(ck && ck -> on && lp -> cb_watcher))
+	return write(fd, buf, len);
+
+    if (cf == NULL) {
+	cf = (struct cork_fd *)zv_calloc(1, sizeof(struct cork_fd));
+	(ck -> fds)[fd] = cf;
+    }
+    if (cf -> len + len > cf -> max) {
+	cf -> max = (cf -> len + len + CORK_BLK - 1) / CORK_BLK * CORK_BLK;
+	cf -> buf = (char *)zv_realloc(cf -> buf, cf -> max);
+    }
+    memcpy(cf -> buf + cf -> len, buf, len);
+    cf -> len += len;
+    ck -> stats.writes += 1;
+
+    /* an fd waiting for room is flushed by its write watcher */
+    if (!cf -> dirty && !cf -> wio.active) {
+	cf -> dirty = 1;
+	(ck -> dirty)[(ck -> dirty_cnt)++] = fd;
+    }
+    return len;
+}
+
+/* write out what is queued for `fd` now, e.g. before closing it, 0 or -1 with errno */
+int zv_cork_flush(zv_loop *lp, int fd) {
+    assert(lp && fd >= 0 && fd < ZV_OPENFD_MAX);
+
+    if (lp -> cork == NULL || (lp -> cork -> fds)[fd] == NULL)
+	return 0;
+    struct cork_fd *cf = (lp -> cork -> fds)[fd];
+    if (cork_flush_fd(lp, fd) < 0) {
+	cf -> err = 0;		/* reported here */
+	return -1;
+    }
+    if (cf -> len) {
+	errno = EAGAIN;
+	return -1;
+    }
+    return 0;
+}
+
+/* drop what is queued for `fd`, before closing it for good */
+void zv_cork_discard(zv_loop *lp, int fd) {
+    assert(lp && fd >= 0 && fd < ZV_OPENFD_MAX);
+
+    struct cork_fd *cf = lp -> cork ? (lp -> cork -> fds)[fd] : NULL;
+    if (cf == NULL)
+	return;
+    if (cf -> wio.active)
+	zv_io_stop(lp, &cf -> wio);
+    cf -> off = cf -> len = 0;
+    cf -> err = 0;
+    /* a dirty fd stays listed, the next flush finds nothing to write */
+}
+
+void zv_cork_stats(zv_loop *lp, struct zv_cork_stats *st) {
+    assert(lp && st);
+
+    if (lp -> cork)
+	*st = lp -> cork -> stats;
+    else
+	memset(st, 0, sizeof(*st));
+}
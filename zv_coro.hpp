@@ -0,0 +1,395 @@
+// C++20 coroutines on a zv_loop, header only
+
+#ifndef _ZV_CORO_HPP_
+#define _ZV_CORO_HPP_
+
+#include "zv.hpp"
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <utility>
+
+namespace zv {
+
+namespace detail {
+
+/* what a suspended task is parked on */
+struct waiter {
+    std::coroutine_handle<> h;
+    zv_loop *lp = nullptr;
+    void (*cancel)(waiter *) = nullptr; /* stop the watcher, record a cancelled result */
+};
+
+/* operator delete is not told the loop, so each frame starts with it */
+struct alignas(16) frame_hdr {
+    zv_loop *lp;
+};
+
+inline void *frame_alloc(zv_loop *lp, size_t size) {
+    frame_hdr *hdr = (frame_hdr *)zv_loop_alloc(lp, sizeof(frame_hdr) + size);
+    hdr -> lp = lp;
+    return hdr + 1;
+}
+
+inline void frame_free(void *frame, size_t size) {
+    frame_hdr *hdr = (frame_hdr *)frame - 1;
+    zv_loop_dealloc(hdr -> lp, hdr, sizeof(frame_hdr) + size);
+}
+
+} // namespace detail
+
+/*
+ * A coroutine returning zv::task runs on the loop passed as its first
+ * parameter, or second for member functions and lambdas. It starts right
+ * away and is resumed from `call_pending` by the watcher it awaits. The
+ * frame comes from the loop's zv_loop_alloc pools.
+ *
+ * The task owns the frame: destroying it destroys a suspended coroutine,
+ * and with it the awaiter it is parked on, whose destructor stops the
+ * watcher. `detach` lets the coroutine free itself when it returns.
+ */
+class task {
+public:
+    /* the part of the promise awaiters see, promise_of below allocates the frame */
+    struct promise_type {
+	zv_loop *lp;
+	detail::waiter *parked = nullptr;
+	bool cancelled = false;
+	bool detached = false;
+
+	template <class... A>
+	promise_type(loop l, A &&...) noexcept : lp(l.raw()) {}
+	template <class T, class... A>
+	promise_type(T &&, loop l, A &&...) noexcept : lp(l.raw()) {}
+
+	template <class... A>
+	static zv_loop *loop_of(loop l, A &...) noexcept { return l.raw(); }
+	template <class T, class... A>
+	static zv_loop *loop_of(T &, loop l, A &...) noexcept { return l.raw(); }
+
+	std::suspend_never initial_suspend() noexcept { return {}; }
+
+	/* a detached coroutine runs off its end and its frame is destroyed */
+	auto final_suspend() noexcept {
+	    struct final_awaiter {
+		bool detached;
+		bool await_ready() const noexcept { return detached; }
+		void await_suspend(std::coroutine_handle<>) const noexcept {}
+		void await_resume() const noexcept {}
+	    };
+	    return final_awaiter{detached};
+	}
+	void return_void() noexcept {}
+	void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    /*
+     * The promise a coroutine taking `A...` really gets, see coroutine_traits
+     * below. Its operator new takes exactly those parameters rather than
+     * being a template, which GCC would not pair with operator delete.
+     */
+    template <class... A>
+    struct promise_of : promise_type {
+	using promise_type::promise_type;
+
+	static void *operator new(size_t size, A &...a) {
+	    return detail::frame_alloc(loop_of(a...), size);
+	}
+	static void operator delete(void *frame, size_t size) noexcept {
+	    detail::frame_free(frame, size);
+	}
+
+	task get_return_object() noexcept {
+	    return task(std::coroutine_handle<promise_of>::from_promise(*this), this);
+	}
+    };
+
+    task(task &&o) noexcept : h(std::exchange(o.h, {})), prom(std::exchange(o.prom, nullptr)) {}
+    task &operator=(task &&o) noexcept {
+	if (this != &o) {
+	    reset();
+	    h = std::exchange(o.h, {});
+	    prom = std::exchange(o.prom, nullptr);
+	}
+	return *this;
+    }
+    ~task() { reset(); }
+
+    bool done() const noexcept { return !h || h.done(); }
+
+    /*
+     * Stop the watcher the task waits on and resume it with a cancelled
+     * result. Its later awaits complete at once, cancelled too.
+     */
+    void cancel() {
+	if (done())
+	    return;
+	prom -> cancelled = true;
+	if (detail::waiter *w = std::exchange(prom -> parked, nullptr)) {
+	    w -> cancel(w);
+	    w -> h.resume();
+	}
+    }
+
+    void detach() noexcept {
+	if (!h)
+	    return;
+	if (h.done())
+	    h.destroy();
+	else
+	    prom -> detached = true;
+	h = {};
+	prom = nullptr;
+    }
+
+private:
+    task(std::coroutine_handle<> h, promise_type *prom) noexcept : h(h), prom(prom) {}
+
+    void reset() noexcept {
+	if (h)
+	    h.destroy();
+	h = {};
+	prom = nullptr;
+    }
+
+    std::coroutine_handle<> h;
+    promise_type *prom = nullptr;
+};
+
+namespace detail {
+
+/* parks the task on one zv_io until Derived::ready() says the wait is over */
+template <class Derived>
+class io_wait : public waiter {
+public:
+    io_wait(int fd, int events) noexcept { zv_io_init(&w, nullptr, fd, events); }
+    io_wait(const io_wait &) = delete;
+    io_wait &operator=(const io_wait &) = delete;
+    ~io_wait() {
+	if (lp)
+	    zv_io_stop(lp, &w);
+    }
+
+    template <class P>
+    bool await_suspend(std::coroutine_handle<P> ch) noexcept {
+	task::promise_type &pr = ch.promise();
+	if (pr.cancelled) {
+	    static_cast<Derived *>(this) -> cancelled();
+	    return false;
+	}
+	h = ch;
+	lp = pr.lp;
+	cancel = cancel_cb;
+	promise = &pr;
+	w.data = this;
+	w.cb = io_cb;
+	zv_io_start(lp, &w);
+	pr.parked = this;
+	return true;
+    }
+
+protected:
+    zv_io w;
+
+private:
+    task::promise_type *promise = nullptr;
+
+    static void io_cb(zv_loop *, zv_io *iow, int revents) {
+	io_wait *self = static_cast<io_wait *>(iow -> data);
+	if (!static_cast<Derived *>(self) -> ready(revents))
+	    return;
+	zv_io_stop(self -> lp, &self -> w);
+	self -> promise -> parked = nullptr;
+	self -> h.resume();	/* may destroy `self` */
+    }
+
+    static void cancel_cb(waiter *wt) {
+	io_wait *self = static_cast<io_wait *>(wt);
+	zv_io_stop(self -> lp, &self -> w);
+	static_cast<Derived *>(self) -> cancelled();
+    }
+};
+
+} // namespace detail
+
+/* resumes with the events that woke the task, 0 if it was cancelled */
+class fd_awaiter : public detail::io_wait<fd_awaiter> {
+public:
+    fd_awaiter(int fd, int events) noexcept : io_wait(fd, events) {}
+
+    bool await_ready() const noexcept { return false; }
+    int await_resume() const noexcept { return revents; }
+
+    bool ready(int ev) noexcept {
+	revents = ev;
+	return true;
+    }
+    void cancelled() noexcept { revents = 0; }
+
+private:
+    int revents = 0;
+};
+
+inline fd_awaiter readable(int fd) noexcept { return fd_awaiter(fd, ZV_READ); }
+inline fd_awaiter writable(int fd) noexcept { return fd_awaiter(fd, ZV_WRITE); }
+
+/* resumes with true once the time is up, false if the task was cancelled */
+class sleep_awaiter : public detail::waiter {
+public:
+    sleep_awaiter(loop l, zv_tstamp after) noexcept : after(after) {
+	lp = l.raw();
+	zv_timer_init(&w, nullptr, after > 0.0 ? after : 0.0, 0.0);
+    }
+    sleep_awaiter(const sleep_awaiter &) = delete;
+    sleep_awaiter &operator=(const sleep_awaiter &) = delete;
+    ~sleep_awaiter() { zv_timer_stop(lp, &w); }
+
+    bool await_ready() const noexcept { return after <= 0.0; }
+    template <class P>
+    bool await_suspend(std::coroutine_handle<P> ch) noexcept {
+	task::promise_type &pr = ch.promise();
+	if (pr.cancelled)
+	    return false;
+	h = ch;
+	cancel = cancel_cb;
+	promise = &pr;
+	zv_timer_init(&w, nullptr, after, 0.0);	/* count from the suspension */
+	w.data = this;
+	w.cb = timer_cb;
+	zv_timer_start(lp, &w);
+	pr.parked = this;
+	return true;
+    }
+    bool await_resume() const noexcept { return fired || after <= 0.0; }
+
+private:
+    zv_timer w;
+    zv_tstamp after;
+    bool fired = false;
+    task::promise_type *promise = nullptr;
+
+    static void timer_cb(zv_loop *, zv_timer *tw, int) {
+	sleep_awaiter *self = static_cast<sleep_awaiter *>(tw -> data);
+	self -> fired = true;
+	self -> promise -> parked = nullptr;
+	self -> h.resume();	/* may destroy `self` */
+    }
+
+    static void cancel_cb(detail::waiter *wt) {
+	sleep_awaiter *self = static_cast<sleep_awaiter *>(wt);
+	zv_timer_stop(self -> lp, &self -> w);
+    }
+};
+
+template <class Rep, class Period>
+sleep_awaiter sleep(loop l, std::chrono::duration<Rep, Period> d) noexcept {
+    return sleep_awaiter(l, std::chrono::duration<zv_tstamp>(d).count());
+}
+
+/*
+ * A non-blocking fd. Reads return like read(2) once something could be
+ * read, writes return once the whole buffer is written, or -1 with errno
+ * set. A cancelled task gets -1 and ECANCELED.
+ */
+class stream {
+public:
+    explicit stream(int fd) noexcept : sfd(fd) {}
+
+    class read_awaiter : public detail::io_wait<read_awaiter> {
+    public:
+	read_awaiter(int fd, void *buf, size_t len) noexcept
+	    : io_wait(fd, ZV_READ), buf(buf), len(len) {}
+
+	bool await_ready() noexcept { return attempt(); }
+	ssize_t await_resume() const noexcept {
+	    if (result < 0)
+		errno = err;
+	    return result;
+	}
+
+	bool ready(int) noexcept { return attempt(); }
+	void cancelled() noexcept {
+	    result = -1;
+	    err = ECANCELED;
+	}
+
+    private:
+	void *buf;
+	size_t len;
+	ssize_t result = -1;
+	int err = 0;
+
+	bool attempt() noexcept {
+	    result = ::read(w.fd, buf, len);
+	    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return false;
+	    err = errno;
+	    return true;
+	}
+    };
+
+    class write_awaiter : public detail::io_wait<write_awaiter> {
+    public:
+	write_awaiter(int fd, const void *buf, size_t len) noexcept
+	    : io_wait(fd, ZV_WRITE), buf((const char *)buf), len(len) {}
+
+	bool await_ready() noexcept { return attempt(); }
+	ssize_t await_resume() const noexcept {
+	    if (err) {
+		errno = err;
+		return -1;
+	    }
+	    return done;
+	}
+
+	bool ready(int) noexcept { return attempt(); }
+	void cancelled() noexcept { err = ECANCELED; }
+
+    private:
+	const char *buf;
+	size_t len;
+	size_t done = 0;
+	int err = 0;
+
+	bool attempt() noexcept {
+	    while (done < len) {
+		ssize_t n = ::write(w.fd, buf + done, len - done);
+		if (n >= 0) {
+		    done += n;
+		} else if (errno == EINTR) {
+		    continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		    return false;
+		} else {
+		    err = errno;
+		    return true;
+		}
+	    }
+	    return true;
+	}
+    };
+
+    read_awaiter read(void *buf, size_t len) noexcept { return read_awaiter(sfd, buf, len); }
+    read_awaiter read(std::span<char> buf) noexcept { return read(buf.data(), buf.size()); }
+    write_awaiter write(const void *buf, size_t len) noexcept { return write_awaiter(sfd, buf, len); }
+    write_awaiter write(std::span<const char> buf) noexcept { return write(buf.data(), buf.size()); }
+
+    int fd() const noexcept { return sfd; }
+
+private:
+    int sfd;
+};
+
+} // namespace zv
+
+template <class... A>
+struct std::coroutine_traits<zv::task, A...> {
+    using promise_type = zv::task::promise_of<A...>;
+};
+
+#endif // _ZV_CORO_HPP_
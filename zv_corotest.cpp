@@ -0,0 +1,146 @@
+// tests for zv_coro.hpp: sleep, stream reads and cancel
+
+#include "zv_coro.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+using namespace std::chrono_literals;
+
+static int failed;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+	    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+	    failed++;							\
+	}								\
+    } while (0)
+
+/* one poll at a time, a stuck task fails the test instead of hanging it */
+static void run_until(zv::loop l, const zv::task &t) {
+    for (int i=0; i<1000 && !t.done(); i++)
+	l.run(ZV_RUN_ONCE);
+    check(t.done());
+}
+
+static void nonblocking_pair(int sv[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	perror("socketpair");
+	exit(1);
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+}
+
+static zv::task sleeper(zv::loop l, int *fired) {
+    *fired = co_await zv::sleep(l, 1ms);
+}
+
+static void test_sleep(zv::loop l) {
+    int fired = -1;
+
+    zv::task t = sleeper(l, &fired);
+    check(!t.done());
+    run_until(l, t);
+    check(fired == 1);
+}
+
+static zv::task reader(zv::loop, zv::stream s, char *buf, size_t len, ssize_t *got) {
+    *got = co_await s.read(buf, len);
+}
+
+static zv::task writer(zv::loop l, zv::stream s, const char *msg) {
+    co_await zv::sleep(l, 1ms);
+    co_await s.write(msg, strlen(msg));
+}
+
+static void test_read(zv::loop l) {
+    int sv[2];
+    char buf[16] = "";
+    ssize_t got = 0;
+
+    nonblocking_pair(sv);
+    zv::task r = reader(l, zv::stream(sv[0]), buf, sizeof(buf), &got);
+    check(!r.done());		/* nothing written yet */
+    zv::task w = writer(l, zv::stream(sv[1]), "ping");
+    run_until(l, r);
+    check(w.done());
+    check(got == 4 && memcmp(buf, "ping", 4) == 0);
+
+    /* data already there completes without suspending */
+    check(write(sv[1], "pong", 4) == 4);
+    r = reader(l, zv::stream(sv[0]), buf, sizeof(buf), &got);
+    check(r.done());
+    check(got == 4 && memcmp(buf, "pong", 4) == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/* a lambda has the loop second, after the closure */
+static void test_cancel(zv::loop l) {
+    int fired = -1, err = 0;
+    ssize_t got = 0;
+    char buf[16];
+    int sv[2];
+
+    auto sleep_then_read = [&](zv::loop l, zv::stream s) -> zv::task {
+	fired = co_await zv::sleep(l, 10s);
+	got = co_await s.read(buf, sizeof(buf));
+	err = errno;
+    };
+
+    nonblocking_pair(sv);
+    zv::task t = sleep_then_read(l, zv::stream(sv[0]));
+    l.run(ZV_RUN_NOWAIT);
+    check(!t.done());
+    t.cancel();
+    check(t.done());
+    check(fired == 0);
+    /* the read after the cancel completes at once, cancelled too */
+    check(got == -1 && err == ECANCELED);
+
+    /* cancelling a parked read stops its watcher */
+    auto read_only = [&](zv::loop, zv::stream s) -> zv::task {
+	got = co_await s.read(buf, sizeof(buf));
+	err = errno;
+    };
+    got = 0;
+    err = 0;
+    t = read_only(l, zv::stream(sv[0]));
+    check(!t.done());
+    t.cancel();
+    check(t.done());
+    check(got == -1 && err == ECANCELED);
+    check(write(sv[1], "late", 4) == 4);
+    l.run(ZV_RUN_NOWAIT);
+    check(got == -1);
+
+    /* replacing a suspended task destroys it, its timer stops with it */
+    t = sleep_then_read(l, zv::stream(sv[0]));
+    check(!t.done());
+    t = read_only(l, zv::stream(sv[0]));	/* "late" is still there */
+    check(t.done() && got == 4);
+    l.run(ZV_RUN_NOWAIT);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(void) {
+    zv_loop *lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(lp);
+    zv::loop l(lp);
+
+    test_sleep(l);
+    test_read(l);
+    test_cancel(l);
+
+    zv_loop_destroy(lp);
+    zv_free(lp);
+    if (failed)
+	fprintf(stderr, "%d checks failed\n", failed);
+    return failed != 0;
+}
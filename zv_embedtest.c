@@ -0,0 +1,101 @@
+// a loop nested in another through zv_embed, swept automatically and from a callback
+
+#include "zv.h"
+#include "zv_test.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+struct inner_io {
+    zv_loop *lp;		/* the loop the callback ran on */
+    int hits;
+};
+
+static void inner_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    struct inner_io *in = (struct inner_io *)(w -> data);
+    char buf[16];
+
+    check(revents & ZV_READ);
+    check(read(((zv_io *)w) -> fd, buf, sizeof(buf)) > 0);
+    in -> lp = lp;
+    in -> hits++;
+}
+
+static int embed_hits;
+
+static void tick_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)w; (void)revents;	/* unused, it only bounds the polls */
+}
+
+static void embed_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    check(revents & ZV_EMBED);
+    embed_hits++;
+    zv_embed_sweep(lp, (zv_embed *)w);
+}
+
+static zv_loop *loop_new(void) {
+    zv_loop *lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(lp);
+    return lp;
+}
+
+static void loop_free(zv_loop *lp) {
+    zv_loop_destroy(lp);
+    zv_free(lp);
+}
+
+/*
+ * An fd ready on `inner` wakes `outer`, and the inner callback runs on
+ * `inner`. The inner watcher is started after the embed, so the outer
+ * loop's prepare has to bring it to the inner backend.
+ */
+static void nest(zv_loop *outer, zv_loop *inner, w_cb cb) {
+    struct inner_io in = { NULL, 0 };
+    zv_embed e;
+    zv_io io;
+    zv_timer tick;
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+	perror("pipe");
+	return;
+    }
+    zv_timer_init(&tick, tick_cb, 0.1, 0.1);
+    zv_timer_start(outer, &tick);
+    zv_embed_init(&e, cb, inner);
+    zv_embed_start(outer, &e);
+    zv_io_init(&io, inner_cb, fds[0], ZV_READ);
+    io.data = &in;
+    zv_io_start(inner, &io);
+
+    for (int round=1; round<=3; round++) {
+	check(write(fds[1], "x", 1) == 1);
+	for (int i=0; i<10 && in.hits < round; i++)
+	    zv_loop_run(outer, ZV_RUN_ONCE);
+	check(in.hits == round && in.lp == inner);
+    }
+
+    /* nothing ready, nothing swept */
+    zv_loop_run(outer, ZV_RUN_NOWAIT);
+    check(in.hits == 3);
+
+    zv_timer_stop(outer, &tick);
+    zv_embed_stop(outer, &e);
+    check(zv_loop_run(outer, ZV_RUN_NOWAIT) == 0);
+    zv_io_stop(inner, &io);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void) {
+    zv_loop *outer = loop_new(), *inner = loop_new();
+
+    nest(outer, inner, NULL);
+    check(embed_hits == 0);
+    nest(outer, inner, embed_cb);
+    check(embed_hits == 3);
+
+    loop_free(inner);
+    loop_free(outer);
+    return test_result();
+}
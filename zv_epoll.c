@@ -7,18 +7,19 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 
 void fd_kill(zv_loop *lp, int fd);
 void fd_event(zv_loop *lp, int fd, int revents);
 
 static void epoll_modify(zv_loop *lp, int fd, int nevs) {
     assert(lp);
-    assert(fd >= 0 && fd <= ZV_OPENFD_MAX);
-    if (!nevs)
-	return;
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
     if (nevs == -1) {
 	/* we delete fd */
-	if (epoll_ctl(lp -> backend_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+	/* closing an fd already took it out of the epoll set */
+	if (epoll_ctl(lp -> backend_fd, EPOLL_CTL_DEL, fd, NULL) < 0 &&
+	    errno != EBADF && errno != ENOENT) {
 	    zv_err(0, "err happened on epoll_modified while delete a fd: %d", fd);
 	}
 	return;
@@ -27,6 +28,9 @@ static void epoll_modify(zv_loop *lp, int fd, int nevs) {
     struct epoll_event ev;
     ev.events = ((nevs & ZV_READ) ? EPOLLIN : 0) | ((nevs & ZV_WRITE ) ? EPOLLOUT : 0);
     ev.data.fd = fd;
+    /* a hangup is reported without interest, once is enough for a suspended fd */
+    if (nevs == ZV_NONE)
+	ev.events = EPOLLET;
 
     if (epoll_ctl(lp -> backend_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
 	if (errno == ENOENT) {
@@ -44,21 +48,21 @@ static void epoll_modify(zv_loop *lp, int fd, int nevs) {
 static void epoll_poll(zv_loop *lp, zv_tstamp timedout) {
     assert(lp);
 
-    int block = (timedout > 0.0) ? (int)(timedout * 1000) : -1;
+    /* round up, so we never wake just before a timer is due */
+    int block = (timedout >= 0.0) ? (int)(timedout * 1000 + 0.999) : -1;
     int ready;
- again:
     ready = epoll_wait(lp -> backend_fd,
 			   lp -> epoll_events,
 			   lp -> epoll_eventmax,
 			   block);
 
-    if (ready == -1 && errno == EINTR) {
-	/* interrupted, so we restart it */
-	goto again;
-    } else {
+    if (ready < 0) {
+	/* interrupted, the loop recomputes the timeout and comes back */
+	if (errno == EINTR)
+	    return;
 	zv_err(1, "epoll_wait error");
     }
-    
+
     struct epoll_event *ev;
     int got, fd;
     for (int i=0; i<ready; i++) {
@@ -72,10 +76,39 @@ static void epoll_poll(zv_loop *lp, zv_tstamp timedout) {
     }
     if (ready == (lp -> epoll_eventmax)) {
 	/* need more space */
-	(lp -> epoll_events) = (struct epoll_event *)malloc(sizeof(struct epoll_event) *
-							    (lp -> epoll_eventmax + EPOLL_EVENTBLK));
+	(lp -> epoll_events) = (struct epoll_event *)zv_realloc(lp -> epoll_events,
+								sizeof(struct epoll_event) *
+								(lp -> epoll_eventmax + EPOLL_EVENTBLK));
 	lp -> epoll_eventmax += EPOLL_EVENTBLK;
-    }    
+    }
+}
+
+/*
+ * A forked child still shares the parent's epoll set, changes to it would
+ * reach the parent. Only the fds with watchers are added to a new one,
+ * backwards, since `fd_kill` moves the last of them into the hole.
+ */
+static void epoll_fork(zv_loop *lp) {
+    assert(lp);
+    close(lp -> backend_fd);
+    lp -> backend_fd = epoll_create(256);
+    if (lp -> backend_fd < 0)
+	zv_err(1, "epoll create error");
+
+    for (int i=(lp -> fd_cnt)-1; i>=0; i--) {
+	int fd = (lp -> fds)[i];
+	int nevs = (lp -> anfds)[fd].events;
+	if (nevs == ZV_NONE)
+	    continue;		/* not reified yet, `fdchanges` has it */
+
+	struct epoll_event ev;
+	ev.events = ((nevs & ZV_READ) ? EPOLLIN : 0) | ((nevs & ZV_WRITE ) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(lp -> backend_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	    fd_kill(lp, fd);
+	    zv_err(0, "epoll_fork error while adding a fd: %d", fd);
+	}
+    }
 }
 
 void epoll_init(zv_loop *lp) {
@@ -89,18 +122,25 @@ void epoll_init(zv_loop *lp) {
     lp -> backend_fd = epollfd;
 
     lp -> epoll_eventmax = EPOLL_EVENTBLK;
-    lp -> epoll_events = (struct epoll_event *)malloc(sizeof(struct epoll_event) * EPOLL_EVENTBLK);
-    if (lp -> epoll_events == NULL)
-	zv_err(1, "malloc error");
+    lp -> epoll_events = (struct epoll_event *)zv_realloc(NULL, sizeof(struct epoll_event) * EPOLL_EVENTBLK);
     lp -> backend_modify = epoll_modify;
     lp -> backend_poll = epoll_poll;
+    lp -> backend_fork = epoll_fork;
 }
 
 void epoll_destroy(zv_loop *lp) {
+    close(lp -> backend_fd);
     lp -> backend_fd = -1;
     
-    free(lp -> epoll_events);
-    if(errno)
-	zv_err(1, "free epoll_events error");
+    zv_free(lp -> epoll_events);
     lp -> epoll_events = NULL;	/* prevent from dangling pointer */
 }
+
+/* drop the event buffer back to its initial size after a burst */
+void epoll_shrink(zv_loop *lp) {
+    if (lp -> epoll_eventmax == EPOLL_EVENTBLK)
+	return;
+    lp -> epoll_events = (struct epoll_event *)zv_realloc(lp -> epoll_events,
+							  sizeof(struct epoll_event) * EPOLL_EVENTBLK);
+    lp -> epoll_eventmax = EPOLL_EVENTBLK;
+}
@@ -0,0 +1,288 @@
+// stackful fibers scheduled by a zv_loop
+
+#define _GNU_SOURCE
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifndef __x86_64__
+#include <ucontext.h>
+#endif // __x86_64__
+
+/*
+ * A fiber is switched to from whatever runs `zv_fiber_resume`, usually a
+ * watcher callback inside `call_pending`, and switches back there when
+ * it suspends or returns. A finished fiber is released by the side that
+ * resumed it, a stack cannot be unmapped while it is running.
+ */
+struct zv_fiber {
+    zv_loop *lp;
+    zv_fiber_fn fn;
+    void *arg;
+    char *stack;		/* top of the stack */
+    int done;
+#ifdef __x86_64__
+    void *sp;			/* saved stack pointer while switched out */
+    void *caller_sp;
+#else
+    ucontext_t ctx;
+    ucontext_t caller;
+#endif // __x86_64__
+    zv_io io;			/* what `zv_fiber_read` / `zv_fiber_write` park on */
+    zv_timer timer;		/* what `zv_fiber_sleep` parks on */
+};
+
+/* pooled stacks are linked through their top bytes, which are always committed */
+struct fiber_stack {
+    struct fiber_stack *next;
+};
+
+static __thread zv_fiber *fiber_cur;
+
+#ifdef __x86_64__
+/*
+ * Save the callee-saved registers on the current stack, store its
+ * pointer in `*from`, and pop the registers saved on `to`. No syscall,
+ * the signal mask stays the thread's.
+ */
+void fiber_swap(void **from, void *to);
+void fiber_boot(void);
+
+__asm__(
+    ".text\n"
+    ".globl fiber_swap\n"
+    ".type fiber_swap, @function\n"
+    "fiber_swap:\n"
+    "	pushq %rbp\n"
+    "	pushq %rbx\n"
+    "	pushq %r12\n"
+    "	pushq %r13\n"
+    "	pushq %r14\n"
+    "	pushq %r15\n"
+    "	movq %rsp, (%rdi)\n"
+    "	movq %rsi, %rsp\n"
+    "	popq %r15\n"
+    "	popq %r14\n"
+    "	popq %r13\n"
+    "	popq %r12\n"
+    "	popq %rbx\n"
+    "	popq %rbp\n"
+    "	ret\n"
+    ".size fiber_swap, .-fiber_swap\n"
+
+    /* first switch into a fiber returns here, fiber in %r12, entry in %r13 */
+    ".globl fiber_boot\n"
+    ".type fiber_boot, @function\n"
+    "fiber_boot:\n"
+    "	movq %r12, %rdi\n"
+    "	callq *%r13\n"
+    "	ud2\n"
+    ".size fiber_boot, .-fiber_boot\n"
+    );
+#endif // __x86_64__
+
+static void fiber_main(zv_fiber *f) {
+    f -> fn(f -> arg);
+    f -> done = 1;
+#ifdef __x86_64__
+    fiber_swap(&f -> sp, f -> caller_sp);
+#endif // __x86_64__
+    /* with ucontext, returning resumes `uc_link` */
+}
+
+#ifndef __x86_64__
+static void fiber_entry(unsigned int hi, unsigned int lo) {
+    fiber_main((zv_fiber *)(((uintptr_t)hi << 32) | lo));
+}
+#endif // __x86_64__
+
+// ===============================
+// stacks
+
+static long page_size(void) {
+    static long page;
+    if (page == 0)
+	page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+/* pages are only committed when touched, the lowest one is a guard */
+static char *stack_get(zv_loop *lp) {
+    struct fiber_stack *st = lp -> fiber_stacks;
+    if (st) {
+	lp -> fiber_stacks = st -> next;
+	lp -> fiber_stack_cnt -= 1;
+	return (char *)(st + 1);
+    }
+
+    long page = page_size();
+    char *base = mmap(NULL, ZV_FIBER_STACK + page, PROT_NONE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+	return NULL;
+    if (mprotect(base + page, ZV_FIBER_STACK, PROT_READ | PROT_WRITE) < 0) {
+	munmap(base, ZV_FIBER_STACK + page);
+	return NULL;
+    }
+    return base + page + ZV_FIBER_STACK;
+}
+
+static void stack_put(zv_loop *lp, char *top) {
+    struct fiber_stack *st = (struct fiber_stack *)top - 1;
+    st -> next = lp -> fiber_stacks;
+    lp -> fiber_stacks = st;
+    lp -> fiber_stack_cnt += 1;
+}
+
+/* unmap pooled stacks beyond `keep` */
+void fiber_stacks_shrink(zv_loop *lp, int keep) {
+    long page = page_size();
+
+    while (lp -> fiber_stack_cnt > keep) {
+	struct fiber_stack *st = lp -> fiber_stacks;
+	lp -> fiber_stacks = st -> next;
+	lp -> fiber_stack_cnt -= 1;
+	munmap((char *)(st + 1) - ZV_FIBER_STACK - page, ZV_FIBER_STACK + page);
+    }
+}
+
+// ===============================
+// switching
+
+static void fiber_release(zv_fiber *f) {
+    stack_put(f -> lp, f -> stack);
+    zv_loop_dealloc(f -> lp, f, sizeof(zv_fiber));
+}
+
+/* the fiber starts on its first `zv_fiber_resume`, NULL if no stack could be mapped */
+zv_fiber *zv_fiber_new(zv_loop *lp, zv_fiber_fn fn, void *arg) {
+    assert(lp && fn);
+
+    char *top = stack_get(lp);
+    if (top == NULL) {
+	zv_warn("cannot map a fiber stack");
+	return NULL;
+    }
+
+    zv_fiber *f = (zv_fiber *)zv_loop_alloc(lp, sizeof(zv_fiber));
+    memset(f, 0, sizeof(zv_fiber));
+    f -> lp = lp;
+    f -> fn = fn;
+    f -> arg = arg;
+    f -> stack = top;
+
+#ifdef __x86_64__
+    /* what `fiber_swap` pops: r15, r14, r13, r12, rbx, rbp, then returns to fiber_boot */
+    void **sp = (void **)(top - 72);
+    memset(sp, 0, 72);
+    sp[2] = (void *)fiber_main;	/* r13 */
+    sp[3] = f;			/* r12 */
+    sp[6] = (void *)fiber_boot;
+    f -> sp = sp;
+#else
+    getcontext(&f -> ctx);
+    f -> ctx.uc_stack.ss_sp = top - ZV_FIBER_STACK;
+    f -> ctx.uc_stack.ss_size = ZV_FIBER_STACK;
+    f -> ctx.uc_link = &f -> caller;
+    makecontext(&f -> ctx, (void (*)(void))fiber_entry, 2,
+		(unsigned int)((uintptr_t)f >> 32), (unsigned int)(uintptr_t)f);
+#endif // __x86_64__
+    return f;
+}
+
+/* run `f` until it suspends or returns, a returned fiber is freed */
+void zv_fiber_resume(zv_fiber *f) {
+    assert(f && !f -> done && f != fiber_cur);
+
+    zv_fiber *prev = fiber_cur;
+    fiber_cur = f;
+#ifdef __x86_64__
+    fiber_swap(&f -> caller_sp, f -> sp);
+#else
+    swapcontext(&f -> caller, &f -> ctx);
+#endif // __x86_64__
+    fiber_cur = prev;
+
+    if (f -> done)
+	fiber_release(f);
+}
+
+/* switch back to whoever resumed the running fiber */
+void zv_fiber_suspend(void) {
+    zv_fiber *f = fiber_cur;
+    assert(f);
+
+#ifdef __x86_64__
+    fiber_swap(&f -> sp, f -> caller_sp);
+#else
+    swapcontext(&f -> ctx, &f -> caller);
+#endif // __x86_64__
+}
+
+/* the running fiber, NULL outside of fibers */
+zv_fiber *zv_fiber_self(void) {
+    return fiber_cur;
+}
+
+// ===============================
+// blocking style calls, only from inside a fiber
+
+static void fiber_wake_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)revents;	/* unused */
+    zv_fiber_resume((zv_fiber *)(w -> data));
+}
+
+static void fiber_wait_fd(zv_fiber *f, int fd, int events) {
+    zv_io_init(&f -> io, fiber_wake_cb, fd, events);
+    f -> io.data = f;
+    zv_io_start(f -> lp, &f -> io);
+    zv_fiber_suspend();
+    zv_io_stop(f -> lp, &f -> io);
+}
+
+/* read(2) on a non-blocking fd, parking the fiber until it is readable */
+ssize_t zv_fiber_read(int fd, void *buf, size_t len) {
+    zv_fiber *f = fiber_cur;
+    assert(f);
+
+    for (;;) {
+	ssize_t n = read(fd, buf, len);
+	if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	    return n;
+	fiber_wait_fd(f, fd, ZV_READ);
+    }
+}
+
+/* write all of `buf` to a non-blocking fd, -1 on the first error */
+ssize_t zv_fiber_write(int fd, const void *buf, size_t len) {
+    zv_fiber *f = fiber_cur;
+    assert(f);
+
+    size_t done = 0;
+    while (done < len) {
+	ssize_t n = write(fd, (const char *)buf + done, len - done);
+	if (n >= 0)
+	    done += n;
+	else if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    fiber_wait_fd(f, fd, ZV_WRITE);
+	else if (errno != EINTR)
+	    return -1;
+    }
+    return done;
+}
+
+void zv_fiber_sleep(zv_tstamp after) {
+    zv_fiber *f = fiber_cur;
+    assert(f);
+
+    zv_timer_init(&f -> timer, fiber_wake_cb, after > 0.0 ? after : 0.0, 0.0);
+    f -> timer.data = f;
+    zv_timer_start(f -> lp, &f -> timer);
+    zv_fiber_suspend();
+    zv_timer_stop(f -> lp, &f -> timer);
+}
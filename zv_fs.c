@@ -0,0 +1,613 @@
+// file requests on io_uring or a thread pool, completed on the loop
+
+#define _GNU_SOURCE
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif // HAVE_SYS_EVENTFD_H
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define FS_URING
+#endif
+
+void ref_loop(zv_loop *lp);
+void unref_loop(zv_loop *lp);
+
+#ifdef FS_URING
+/* the rings shared with the kernel, mapped by `uring_init` */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+#endif // FS_URING
+
+/*
+ * Requests made by the callbacks wait in `queue` and are submitted in
+ * one batch before the loop polls, as many as `limit` allows in flight.
+ * Completions, from the kernel or the pool, come back through `efd`.
+ * Requests in flight together complete in any order, a write and an
+ * fsync of it must be made one after the other.
+ */
+struct zv_aio {
+    zv_fs_req *queue;		/* not submitted yet, oldest first */
+    zv_fs_req *queue_tail;
+    int inflight;
+    int limit;
+
+    int efd[2];			/* the same eventfd twice, or a pipe */
+    zv_io efd_io;
+
+    /* pool completions, pushed by the workers */
+    pthread_mutex_t done_lock;
+    zv_fs_req *done;
+
+#ifdef FS_URING
+    int use_uring;
+    struct uring ring;
+#endif // FS_URING
+};
+
+// ===============================
+// thread pool, shared by all loops
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static zv_fs_req *pool_head, *pool_tail;
+static int pool_atfork;		/* inherited, so registered once per process tree */
+
+static void fs_run(zv_fs_req *req) {
+    ssize_t ret;
+
+    switch (req -> op) {
+    case ZV_FS_OPEN:
+	ret = open(req -> path, req -> flags, req -> mode);
+	break;
+    case ZV_FS_READ:
+	if (req -> offset < 0)
+	    ret = read(req -> fd, req -> buf, req -> len);
+	else
+	    ret = pread(req -> fd, req -> buf, req -> len, req -> offset);
+	break;
+    case ZV_FS_WRITE:
+	if (req -> offset < 0)
+	    ret = write(req -> fd, req -> buf, req -> len);
+	else
+	    ret = pwrite(req -> fd, req -> buf, req -> len, req -> offset);
+	break;
+    case ZV_FS_FSYNC:
+	ret = fsync(req -> fd);
+	break;
+    case ZV_FS_READAHEAD:
+	/* posix_fadvise returns the error instead of setting errno */
+	ret = posix_fadvise(req -> fd, req -> offset, req -> len, POSIX_FADV_WILLNEED);
+	req -> result = -ret;
+	return;
+    default:
+	ret = -1;
+	errno = EINVAL;
+    }
+    req -> result = ret < 0 ? -errno : ret;
+}
+
+static void aio_notify(struct zv_aio *aio) {
+    uint64_t one = 1;
+    if (write((aio -> efd)[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+	zv_err(0, "write to the completion fd error");
+}
+
+static void *pool_worker(void *arg) {
+    (void)arg;			/* unused */
+
+    for (;;) {
+	pthread_mutex_lock(&pool_lock);
+	while (pool_head == NULL)
+	    pthread_cond_wait(&pool_cond, &pool_lock);
+	zv_fs_req *req = pool_head;
+	pool_head = req -> next;
+	if (pool_head == NULL)
+	    pool_tail = NULL;
+	pthread_mutex_unlock(&pool_lock);
+
+	fs_run(req);
+
+	struct zv_aio *aio = req -> lp -> aio;
+	pthread_mutex_lock(&aio -> done_lock);
+	int first = aio -> done == NULL;
+	req -> next = aio -> done;
+	aio -> done = req;
+	pthread_mutex_unlock(&aio -> done_lock);
+	if (first)
+	    aio_notify(aio);
+    }
+    return NULL;
+}
+
+/* the workers stay in the parent, a child starts its own on its first request */
+static void pool_fork(void) {
+    static const pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pool_once = once;
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&pool_cond, NULL);
+    pool_head = pool_tail = NULL;
+}
+
+/* the workers take no signals, those belong to the loops' threads */
+static void pool_start(void) {
+    sigset_t mask, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if (!pool_atfork) {
+	pthread_atfork(NULL, NULL, pool_fork);
+	pool_atfork = 1;
+    }
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i=0; i<ZV_FS_THREADS; i++) {
+	int err = pthread_create(&tid, &attr, pool_worker, NULL);
+	if (err)
+	    zv_err(1, "pthread_create error: %s", strerror(err));
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* one lock and one wakeup per batch */
+static void pool_submit(zv_fs_req *first, zv_fs_req *last, int cnt) {
+    pthread_once(&pool_once, pool_start);
+
+    last -> next = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_tail)
+	pool_tail -> next = first;
+    else
+	pool_head = first;
+    pool_tail = last;
+    if (cnt == 1)
+	pthread_cond_signal(&pool_cond);
+    else
+	pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// ===============================
+// io_uring, through the raw syscalls
+
+#ifdef FS_URING
+static int uring_probe(int fd) {
+    static const int needed[] = {
+	IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_FADVISE
+    };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)zv_calloc(1, size);
+
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (unsigned i=0; ok && i<sizeof(needed)/sizeof(needed[0]); i++) {
+	if (needed[i] > probe -> last_op ||
+	    !(probe -> ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+	    ok = 0;
+    }
+    zv_free(probe);
+    return ok;
+}
+
+static void uring_unmap(struct uring *r) {
+    if (r -> sqes)
+	munmap(r -> sqes, r -> sqes_size);
+    if (r -> cq_ring && r -> cq_ring != r -> sq_ring)
+	munmap(r -> cq_ring, r -> cq_ring_size);
+    if (r -> sq_ring)
+	munmap(r -> sq_ring, r -> sq_ring_size);
+    close(r -> fd);
+}
+
+/* 0 when the kernel lacks io_uring, or any of the operations we need */
+static int uring_init(struct uring *r, int entries, int efd) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r -> fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r -> fd < 0)
+	return 0;
+    if (!(p.features & IORING_FEAT_NODROP) || !uring_probe(r -> fd)) {
+	close(r -> fd);
+	return 0;
+    }
+
+    r -> sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r -> cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (r -> cq_ring_size > r -> sq_ring_size)
+	    r -> sq_ring_size = r -> cq_ring_size;
+	r -> cq_ring_size = r -> sq_ring_size;
+    }
+    r -> sq_ring = mmap(NULL, r -> sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQ_RING);
+    if (r -> sq_ring == MAP_FAILED) {
+	r -> sq_ring = NULL;
+	goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	r -> cq_ring = r -> sq_ring;
+    } else {
+	r -> cq_ring = mmap(NULL, r -> cq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_CQ_RING);
+	if (r -> cq_ring == MAP_FAILED) {
+	    r -> cq_ring = NULL;
+	    goto fail;
+	}
+    }
+    r -> sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r -> sqes = mmap(NULL, r -> sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQES);
+    if (r -> sqes == MAP_FAILED) {
+	r -> sqes = NULL;
+	goto fail;
+    }
+
+    char *sq = (char *)r -> sq_ring, *cq = (char *)r -> cq_ring;
+    r -> sq_head = (unsigned *)(sq + p.sq_off.head);
+    r -> sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r -> sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r -> sq_array = (unsigned *)(sq + p.sq_off.array);
+    r -> cq_head = (unsigned *)(cq + p.cq_off.head);
+    r -> cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r -> cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r -> cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (syscall(__NR_io_uring_register, r -> fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+	goto fail;
+    return 1;
+
+fail:
+    uring_unmap(r);
+    return 0;
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, zv_fs_req *req) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe -> user_data = (uint64_t)(uintptr_t)req;
+    sqe -> fd = req -> fd;
+
+    switch (req -> op) {
+    case ZV_FS_OPEN:
+	sqe -> opcode = IORING_OP_OPENAT;
+	sqe -> fd = AT_FDCWD;
+	sqe -> addr = (uint64_t)(uintptr_t)req -> path;
+	sqe -> len = req -> mode;
+	sqe -> open_flags = req -> flags;
+	break;
+    case ZV_FS_READ:
+    case ZV_FS_WRITE:
+	sqe -> opcode = req -> op == ZV_FS_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe -> addr = (uint64_t)(uintptr_t)req -> buf;
+	sqe -> len = req -> len;
+	sqe -> off = req -> offset;	/* -1 is the file position */
+	break;
+    case ZV_FS_FSYNC:
+	sqe -> opcode = IORING_OP_FSYNC;
+	break;
+    case ZV_FS_READAHEAD:
+	sqe -> opcode = IORING_OP_FADVISE;
+	sqe -> off = req -> offset;
+	sqe -> len = req -> len;
+	sqe -> fadvise_advice = POSIX_FADV_WILLNEED;
+	break;
+    }
+}
+
+/* the cap keeps in flight requests below the ring size, so there is always room */
+static void uring_submit(struct uring *r, zv_fs_req *first, int cnt) {
+    unsigned tail = *r -> sq_tail, mask = *r -> sq_mask;
+
+    for (zv_fs_req *req = first; cnt; req = req -> next, cnt--) {
+	unsigned idx = tail & mask;
+	uring_prep(r -> sqes + idx, req);
+	r -> sq_array[idx] = idx;
+	tail++;
+    }
+    __atomic_store_n(r -> sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned todo = tail - __atomic_load_n(r -> sq_head, __ATOMIC_ACQUIRE);
+    while (todo) {
+	int n = syscall(__NR_io_uring_enter, r -> fd, todo, 0, 0, NULL, 0);
+	if (n < 0) {
+	    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+		continue;
+	    zv_err(1, "io_uring_enter error");
+	}
+	todo -= n;
+    }
+}
+#endif // FS_URING
+
+// ===============================
+// per loop state
+
+static void aio_complete(zv_loop *lp, zv_fs_req *req) {
+    lp -> aio -> inflight -= 1;
+    unref_loop(lp);
+    req -> cb(lp, req);
+}
+
+static void aio_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)w; (void)revents;	/* unused */
+    struct zv_aio *aio = lp -> aio;
+    char buf[64];
+
+    while (read((aio -> efd)[0], buf, sizeof(buf)) > 0)
+	;
+
+#ifdef FS_URING
+    if (aio -> use_uring) {
+	struct uring *r = &aio -> ring;
+	unsigned head = *r -> cq_head;
+	while (head != __atomic_load_n(r -> cq_tail, __ATOMIC_ACQUIRE)) {
+	    struct io_uring_cqe *cqe = r -> cqes + (head & *r -> cq_mask);
+	    zv_fs_req *req = (zv_fs_req *)(uintptr_t)cqe -> user_data;
+	    req -> result = cqe -> res;
+	    head++;
+	    /* hand the slot back before the callback, it may submit more */
+	    __atomic_store_n(r -> cq_head, head, __ATOMIC_RELEASE);
+	    aio_complete(lp, req);
+	}
+	return;
+    }
+#endif // FS_URING
+
+    pthread_mutex_lock(&aio -> done_lock);
+    zv_fs_req *done = aio -> done;
+    aio -> done = NULL;
+    pthread_mutex_unlock(&aio -> done_lock);
+
+    /* pushed newest first */
+    zv_fs_req *order = NULL;
+    while (done) {
+	zv_fs_req *next = done -> next;
+	done -> next = order;
+	order = done;
+	done = next;
+    }
+    while (order) {
+	zv_fs_req *next = order -> next;
+	aio_complete(lp, order);
+	order = next;
+    }
+}
+
+static struct zv_aio *aio_init(zv_loop *lp) {
+    struct zv_aio *aio = (struct zv_aio *)zv_calloc(1, sizeof(struct zv_aio));
+
+#ifdef HAVE_SYS_EVENTFD_H
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+	zv_err(1, "eventfd error");
+    (aio -> efd)[0] = (aio -> efd)[1] = fd;
+#else
+    if (pipe(aio -> efd) < 0)
+	zv_err(1, "pipe error");
+    for (int i=0; i<2; i++) {
+	fcntl((aio -> efd)[i], F_SETFL, O_NONBLOCK);
+	fcntl((aio -> efd)[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif // HAVE_SYS_EVENTFD_H
+    pthread_mutex_init(&aio -> done_lock, NULL);
+    aio -> limit = ZV_FS_LIMIT;
+
+#ifdef FS_URING
+    /* the eventfd is written by the kernel, a pipe would not be */
+    if ((aio -> efd)[0] == (aio -> efd)[1])
+	aio -> use_uring = uring_init(&aio -> ring, ZV_FS_LIMIT, (aio -> efd)[0]);
+#endif // FS_URING
+
+    /* internal, in flight requests hold the loop instead */
+    zv_io_init(&aio -> efd_io, aio_cb, (aio -> efd)[0], ZV_READ);
+    zv_io_start(lp, &aio -> efd_io);
+    unref_loop(lp);
+
+    lp -> aio = aio;
+    return aio;
+}
+
+/* called by the loop before it polls, with whatever the callbacks queued */
+void aio_submit(zv_loop *lp) {
+    struct zv_aio *aio = lp -> aio;
+    if (aio -> queue == NULL || aio -> inflight >= aio -> limit)
+	return;
+
+    zv_fs_req *first = aio -> queue, *last = first;
+    int cnt = 1;
+    while (last -> next && aio -> inflight + cnt < aio -> limit) {
+	last = last -> next;
+	cnt++;
+    }
+    aio -> queue = last -> next;
+    if (aio -> queue == NULL)
+	aio -> queue_tail = NULL;
+    aio -> inflight += cnt;
+
+#ifdef FS_URING
+    if (aio -> use_uring) {
+	uring_submit(&aio -> ring, first, cnt);
+	return;
+    }
+#endif // FS_URING
+    pool_submit(first, last, cnt);
+}
+
+static void aio_close(zv_loop *lp, struct zv_aio *aio) {
+    ref_loop(lp);
+    zv_io_stop(lp, &aio -> efd_io);
+#ifdef FS_URING
+    if (aio -> use_uring)
+	uring_unmap(&aio -> ring);
+#endif // FS_URING
+    close((aio -> efd)[0]);
+    if ((aio -> efd)[1] != (aio -> efd)[0])
+	close((aio -> efd)[1]);
+}
+
+/*
+ * In a forked child, with nothing in flight. The completion fd and the
+ * ring are still the parent's, the queued requests move to new ones.
+ */
+void aio_fork(zv_loop *lp) {
+    struct zv_aio *old = lp -> aio;
+    assert(old -> inflight == 0);
+
+    aio_close(lp, old);
+    struct zv_aio *aio = aio_init(lp);
+    aio -> queue = old -> queue;
+    aio -> queue_tail = old -> queue_tail;
+    aio -> limit = old -> limit;
+    zv_free(old);
+}
+
+/* by zv_loop_destroy, the workers must be done with the loop's requests */
+void aio_destroy(zv_loop *lp) {
+    struct zv_aio *aio = lp -> aio;
+    assert(aio -> inflight == 0);
+
+    aio_close(lp, aio);
+    pthread_mutex_destroy(&aio -> done_lock);
+    zv_free(aio);
+    lp -> aio = NULL;
+}
+
+static void aio_queue(zv_loop *lp, zv_fs_req *req, int op, zv_fs_cb cb) {
+    assert(lp && req && cb);
+
+    struct zv_aio *aio = lp -> aio ? lp -> aio : aio_init(lp);
+    req -> op = op;
+    req -> cb = cb;
+    req -> lp = lp;
+    req -> result = 0;
+    req -> next = NULL;
+    if (aio -> queue_tail)
+	aio -> queue_tail -> next = req;
+    else
+	aio -> queue = req;
+    aio -> queue_tail = req;
+    ref_loop(lp);
+}
+
+// ===============================
+// requests, each completes with `req -> result` set to what the
+// syscall returned, or -errno
+
+void zv_fs_open(zv_loop *lp, zv_fs_req *req, const char *path, int flags, mode_t mode,
+		zv_fs_cb cb) {
+    assert(path);
+
+    req -> path = path;
+    req -> flags = flags;
+    req -> mode = mode;
+    aio_queue(lp, req, ZV_FS_OPEN, cb);
+}
+
+/* a negative `offset` reads from the file position */
+void zv_fs_read(zv_loop *lp, zv_fs_req *req, int fd, void *buf, size_t len, off_t offset,
+		zv_fs_cb cb) {
+    req -> fd = fd;
+    req -> buf = buf;
+    req -> len = len;
+    req -> offset = offset;
+    aio_queue(lp, req, ZV_FS_READ, cb);
+}
+
+/* a negative `offset` writes at the file position */
+void zv_fs_write(zv_loop *lp, zv_fs_req *req, int fd, const void *buf, size_t len,
+		 off_t offset, zv_fs_cb cb) {
+    req -> fd = fd;
+    req -> buf = (void *)buf;
+    req -> len = len;
+    req -> offset = offset;
+    aio_queue(lp, req, ZV_FS_WRITE, cb);
+}
+
+void zv_fs_fsync(zv_loop *lp, zv_fs_req *req, int fd, zv_fs_cb cb) {
+    req -> fd = fd;
+    aio_queue(lp, req, ZV_FS_FSYNC, cb);
+}
+
+/* a hint that `len` bytes at `offset` are read next, so the kernel starts reading them */
+void zv_fs_readahead(zv_loop *lp, zv_fs_req *req, int fd, off_t offset, size_t len,
+		     zv_fs_cb cb) {
+    req -> fd = fd;
+    req -> offset = offset;
+    req -> len = len;
+    aio_queue(lp, req, ZV_FS_READAHEAD, cb);
+}
+
+/* at most `limit` requests of this loop in flight, the rest wait in order */
+void zv_fs_set_limit(zv_loop *lp, int limit) {
+    assert(lp && limit > 0);
+
+    struct zv_aio *aio = lp -> aio ? lp -> aio : aio_init(lp);
+#ifdef FS_URING
+    if (aio -> use_uring && limit > ZV_FS_LIMIT)
+	limit = ZV_FS_LIMIT;	/* the size of the ring */
+#endif // FS_URING
+    aio -> limit = limit;
+}
+
+/*
+ * 0 sends the loop's requests to the thread pool even where io_uring
+ * works, 1 goes back to io_uring if the kernel has it. Only with no
+ * request in flight. Returns what zv_fs_uring would from then on.
+ */
+int zv_fs_set_uring(zv_loop *lp, int on) {
+    assert(lp);
+
+    struct zv_aio *aio = lp -> aio ? lp -> aio : aio_init(lp);
+    assert(aio -> inflight == 0);
+#ifdef FS_URING
+    if (aio -> use_uring && !on) {
+	uring_unmap(&aio -> ring);
+	aio -> use_uring = 0;
+    } else if (!aio -> use_uring && on && (aio -> efd)[0] == (aio -> efd)[1]) {
+	aio -> use_uring = uring_init(&aio -> ring, ZV_FS_LIMIT, (aio -> efd)[0]);
+	if (aio -> use_uring && aio -> limit > ZV_FS_LIMIT)
+	    aio -> limit = ZV_FS_LIMIT;
+    }
+    return aio -> use_uring;
+#else
+    (void)on;			/* unused */
+    return 0;
+#endif // FS_URING
+}
+
+/* 1 if the loop's requests go through io_uring, 0 for the thread pool */
+int zv_fs_uring(zv_loop *lp) {
+    assert(lp);
+
+    struct zv_aio *aio = lp -> aio ? lp -> aio : aio_init(lp);
+#ifdef FS_URING
+    return aio -> use_uring;
+#else
+    (void)aio;			/* unused */
+    return 0;
+#endif // FS_URING
+}
@@ -0,0 +1,154 @@
+// in-memory backend on a virtual clock, for deterministic tests and benchmarks
+
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOCK_BLK 64
+
+void fd_event(zv_loop *lp, int fd, int revents);
+
+/* `revents` on `fd`, once the virtual clock reaches `at` */
+struct mock_ready {
+    zv_tstamp at;
+    unsigned long seq;		/* equal times are delivered in script order */
+    int fd;
+    int revents;
+};
+
+/*
+ * Nothing waits in a poll: it moves the clock straight to the earlier of
+ * its timeout and the next scripted readiness. The script is a binary
+ * min-heap, 1-based like the timer heap.
+ */
+struct zv_mock {
+    zv_tstamp now;		/* the monotonic clock */
+    zv_tstamp wall;		/* wall clock minus monotonic, moved by zv_mock_jump */
+    int events[ZV_OPENFD_MAX];	/* what the loop asked to watch */
+    struct mock_ready *script;
+    int script_max;
+    int script_cnt;
+    unsigned long seq;
+};
+
+static zv_tstamp mock_now(zv_loop *lp) {
+    return lp -> mock -> now + lp -> mock -> wall;
+}
+
+static zv_tstamp mock_mono(zv_loop *lp) {
+    return lp -> mock -> now;
+}
+
+static int ready_before(const struct mock_ready *a, const struct mock_ready *b) {
+    return a -> at < b -> at || (a -> at == b -> at && a -> seq < b -> seq);
+}
+
+static void script_pop(struct zv_mock *m) {
+    struct mock_ready last = m -> script[m -> script_cnt--];
+    int i = 1, child;
+
+    for (; (child = 2 * i) <= m -> script_cnt; i = child) {
+	if (child < m -> script_cnt && ready_before(m -> script + child + 1, m -> script + child))
+	    child++;
+	if (!ready_before(m -> script + child, &last))
+	    break;
+	m -> script[i] = m -> script[child];
+    }
+    m -> script[i] = last;
+}
+
+static void mock_modify(zv_loop *lp, int fd, int nevs) {
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
+    lp -> mock -> events[fd] = nevs == -1 ? ZV_NONE : nevs;
+}
+
+/* with nothing left to happen, where a real poll would block forever, it breaks the loop */
+static void mock_poll(zv_loop *lp, zv_tstamp timedout) {
+    struct zv_mock *m = lp -> mock;
+    int forever = timedout < 0.0;
+    zv_tstamp until = m -> now + (forever ? 0.0 : timedout);
+
+    if (m -> script_cnt) {
+	zv_tstamp next = m -> script[1].at - m -> wall;
+	if (forever || next < until)
+	    until = next;
+	forever = 0;
+    }
+    if (forever) {
+	zv_loop_break(lp);
+	return;
+    }
+    if (until > m -> now)
+	m -> now = until;
+
+    /* scripted times are on the wall clock, as the script was written */
+    while (m -> script_cnt && m -> script[1].at <= m -> now + m -> wall) {
+	struct mock_ready r = m -> script[1];
+	script_pop(m);
+	if (m -> events[r.fd] & r.revents)
+	    fd_event(lp, r.fd, r.revents & m -> events[r.fd]);
+    }
+}
+
+/*
+ * Replace the loop's clocks with a virtual clock starting at `start`, and
+ * its backend with one that only reports what `zv_mock_ready` scripts.
+ * Each poll advances the clock instantly, so hours of timers run in as
+ * long as their callbacks take. Other threads cannot wake the loop.
+ */
+void zv_mock_init(zv_loop *lp, zv_tstamp start) {
+    assert(lp && lp -> mock == NULL);
+
+    struct zv_mock *m = (struct zv_mock *)zv_calloc(1, sizeof(struct zv_mock));
+    m -> now = start;
+    lp -> mock = m;
+    lp -> backend_modify = mock_modify;
+    lp -> backend_poll = mock_poll;
+    lp -> backend_fork = NULL;
+    zv_loop_set_clock(lp, mock_now, mock_mono);
+}
+
+/* `fd` becomes ready for `revents` at virtual time `at`, once */
+void zv_mock_ready(zv_loop *lp, zv_tstamp at, int fd, int revents) {
+    assert(lp && lp -> mock);
+    assert(fd >= 0 && fd < ZV_OPENFD_MAX);
+
+    struct zv_mock *m = lp -> mock;
+    if (m -> script_cnt + 1 >= m -> script_max) {
+	m -> script_max += MOCK_BLK;
+	m -> script = (struct mock_ready *)zv_realloc(m -> script,
+						      m -> script_max * sizeof(struct mock_ready));
+    }
+
+    struct mock_ready r = { at, m -> seq++, fd, revents };
+    int i = ++m -> script_cnt;
+    for (; i > 1 && ready_before(&r, m -> script + i / 2); i /= 2)
+	m -> script[i] = m -> script[i / 2];
+    m -> script[i] = r;
+}
+
+/* let `dt` pass between iterations, as a slow callback would */
+void zv_mock_advance(zv_loop *lp, zv_tstamp dt) {
+    assert(lp && lp -> mock && dt >= 0.0);
+    lp -> mock -> now += dt;
+}
+
+/* move the wall clock alone, like a clock step by NTP or an operator */
+void zv_mock_jump(zv_loop *lp, zv_tstamp dt) {
+    assert(lp && lp -> mock);
+    lp -> mock -> wall += dt;
+}
+
+/* the loop is left without a backend */
+void mock_destroy(zv_loop *lp) {
+    struct zv_mock *m = lp -> mock;
+    if (m == NULL)
+	return;
+
+    zv_free(m -> script);
+    zv_free(m);
+    lp -> mock = NULL;
+}
@@ -0,0 +1,135 @@
+// loops pinned to CPUs with their memory on the CPUs' node
+
+#define _GNU_SOURCE
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#endif // HAVE_LINUX_MEMPOLICY_H
+
+#define NODE_MAX 1024
+#define NODE_WORDS (NODE_MAX / (8 * sizeof(unsigned long)))
+
+#if defined(HAVE_LINUX_MEMPOLICY_H) && defined(SYS_mbind) && defined(SYS_set_mempolicy)
+#define NUMA_POLICY
+#endif
+
+/* the node the calling thread runs on, -1 if unknown */
+static int numa_node_self(void) {
+#ifdef SYS_getcpu
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < NODE_MAX)
+	return node;
+#endif // SYS_getcpu
+    return -1;
+}
+
+#ifdef NUMA_POLICY
+/* `maxnode` counts one bit past the mask, the kernel drops the last one */
+static unsigned long numa_mask(unsigned long *mask, int node) {
+    memset(mask, 0, NODE_WORDS * sizeof(unsigned long));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    return NODE_MAX + 1;
+}
+#endif // NUMA_POLICY
+
+/*
+ * A loop for the calling thread, which is pinned to `cpus` first. The
+ * CPUs should share a node. The zv_loop is mapped on that node, and the
+ * thread prefers it for everything it allocates afterwards, so the fd
+ * table, epoll buffer, timer heap, pending arrays and watcher pools,
+ * all allocated or grown by the loop's thread, land there too. Without
+ * memory policy support the placement falls back to first touch by the
+ * pinned thread. Call it from the thread that will run the loop. The
+ * loop is never unmapped, like the default one.
+ */
+zv_loop *zv_loop_new_on(const int *cpus, int ncpus) {
+    assert(cpus && ncpus > 0);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i=0; i<ncpus; i++) {
+	assert(cpus[i] >= 0 && cpus[i] < CPU_SETSIZE);
+	CPU_SET(cpus[i], &set);
+    }
+    /* the thread moves to the set before this returns */
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+	zv_warn("sched_setaffinity error");
+	return NULL;
+    }
+    int node = numa_node_self();
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (sizeof(zv_loop) + page - 1) & ~(page - 1);
+    zv_loop *lp = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lp == MAP_FAILED) {
+	zv_err(0, "mmap error");
+	return NULL;
+    }
+
+#ifdef NUMA_POLICY
+    /* preferred rather than bound, a full node spills over instead of failing */
+    if (node >= 0) {
+	unsigned long mask[NODE_WORDS];
+	unsigned long maxnode = numa_mask(mask, node);
+	if (syscall(SYS_mbind, lp, size, MPOL_PREFERRED, mask, maxnode, 0) < 0)
+	    zv_warn("mbind error");
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, maxnode) < 0)
+	    zv_warn("set_mempolicy error");
+    }
+#endif // NUMA_POLICY
+
+    /* fresh pages are zeroed, like the default loop's calloc */
+    zv_loop_init(lp);
+    lp -> cpu = cpus[0];
+    lp -> node = node;
+    return lp;
+}
+
+// ===============================
+// receive steering
+
+/*
+ * Have the kernel pick `fd`, one of a SO_REUSEPORT group of listeners,
+ * for connections or datagrams received on the loop's CPU. With one
+ * placed loop per RX queue CPU, each flow is handled where its packets
+ * arrive. 0, or -1 with errno.
+ */
+int zv_loop_steer(zv_loop *lp, int fd) {
+    assert(lp);
+
+#ifdef SO_INCOMING_CPU
+    if (lp -> cpu < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    return setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &lp -> cpu, sizeof(lp -> cpu));
+#else
+    (void)fd;			/* unused */
+    errno = ENOPROTOOPT;
+    return -1;
+#endif // SO_INCOMING_CPU
+}
+
+/* the CPU that last received for `fd`, to hand an accepted socket to its loop, -1 if unknown */
+int zv_incoming_cpu(int fd) {
+#ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+	return cpu;
+#else
+    (void)fd;			/* unused */
+#endif // SO_INCOMING_CPU
+    return -1;
+}
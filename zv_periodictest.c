@@ -0,0 +1,167 @@
+// zv_periodic on the mock clock: its schedule, drift, wall clock jumps and reschedule_cb
+
+#include "zv.h"
+#include "zv_test.h"
+
+#include <math.h>
+
+#define START 1000000.0		/* wall clock when the test starts */
+#define OFFSET 0.25
+#define INTERVAL 10.0
+#define PERIODS 10000
+#define EPS 1e-6
+
+struct fires {
+    zv_tstamp at[8];		/* the last few */
+    int cnt;
+    zv_tstamp slow;		/* what each callback takes, on the virtual clock */
+};
+
+static void periodic_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    struct fires *f = (struct fires *)(w -> data);
+
+    check(revents & ZV_PERIODIC);
+    f -> at[f -> cnt++ % 8] = lp -> zv_now;
+    if (f -> slow > 0.0)
+	zv_mock_advance(lp, f -> slow);
+}
+
+static zv_tstamp last(const struct fires *f) {
+    return f -> at[(f -> cnt - 1) % 8];
+}
+
+static int on_grid(zv_tstamp t, zv_tstamp offset, zv_tstamp interval) {
+    zv_tstamp k = (t - offset) / interval;
+    return fabs(k - round(k)) * interval < EPS;
+}
+
+static void run_to(zv_loop *lp, struct fires *f, int cnt) {
+    for (int i=0; f -> cnt < cnt && i < 1000 + 10 * cnt; i++)
+	zv_loop_run(lp, ZV_RUN_ONCE);
+    check(f -> cnt == cnt);
+}
+
+static zv_loop *mock_loop(void) {
+    zv_loop *lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(lp);
+    zv_mock_init(lp, START);
+    return lp;
+}
+
+static void mock_loop_free(zv_loop *lp) {
+    zv_loop_destroy(lp);
+    zv_free(lp);
+}
+
+/* fires at offset + k * interval, slow callbacks or not, and never drifts */
+static void test_schedule(void) {
+    zv_loop *lp = mock_loop();
+    struct fires f = { {0}, 0, 0.0 };
+    zv_periodic w;
+
+    zv_periodic_init(&w, periodic_cb, OFFSET, INTERVAL, NULL);
+    w.data = &f;
+    zv_periodic_start(lp, &w);
+
+    run_to(lp, &f, 1);
+    check(fabs(last(&f) - (START + OFFSET)) < EPS);
+
+    f.slow = 0.7 * INTERVAL;
+    run_to(lp, &f, PERIODS);
+    check(fabs(last(&f) - (START + OFFSET + (PERIODS - 1) * INTERVAL)) < EPS);
+    for (int i=0; i<8; i++)
+	check(on_grid(f.at[i], OFFSET, INTERVAL));
+
+    zv_periodic_stop(lp, &w);
+    check(zv_loop_run(lp, ZV_RUN_NOWAIT) == 0);
+    mock_loop_free(lp);
+}
+
+/*
+ * After a jump either way it fires on the grid of the new time: once, not
+ * once for every period skipped forward, and not after the hour it went
+ * back.
+ */
+static void test_jumps(void) {
+    zv_loop *lp = mock_loop();
+    struct fires f = { {0}, 0, 0.0 };
+    zv_periodic w;
+
+    zv_periodic_init(&w, periodic_cb, OFFSET, INTERVAL, NULL);
+    w.data = &f;
+    zv_periodic_start(lp, &w);
+    run_to(lp, &f, 3);
+
+    zv_tstamp before = last(&f);
+    zv_mock_jump(lp, 3600.0 + 3.3);
+    run_to(lp, &f, 4);
+    check(on_grid(last(&f), OFFSET, INTERVAL));
+    check(last(&f) - (before + 3603.3) > 0.0 && last(&f) - (before + 3603.3) <= INTERVAL);
+    run_to(lp, &f, 5);
+    check(fabs(last(&f) - f.at[3] - INTERVAL) < EPS);
+
+    before = last(&f);
+    zv_mock_jump(lp, -7200.0 - 4.4);
+    run_to(lp, &f, 6);
+    check(on_grid(last(&f), OFFSET, INTERVAL));
+    check(last(&f) - (before - 7204.4) > 0.0 && last(&f) - (before - 7204.4) <= INTERVAL);
+    run_to(lp, &f, 7);
+    check(fabs(last(&f) - f.at[5] - INTERVAL) < EPS);
+
+    /* a one-shot at an absolute time stays there, wherever the clock goes */
+    struct fires g = { {0}, 0, 0.0 };
+    zv_periodic once;
+    zv_tstamp at = lp -> zv_now + 100.0;
+    zv_periodic_init(&once, periodic_cb, at, 0.0, NULL);
+    once.data = &g;
+    zv_periodic_start(lp, &once);
+    zv_mock_jump(lp, -50.0);
+    run_to(lp, &g, 1);
+    check(fabs(last(&g) - at) < EPS);
+    check(!once.active);
+
+    zv_periodic_stop(lp, &w);
+    mock_loop_free(lp);
+}
+
+static int reschedules;
+
+/* every 7 seconds, on a grid starting at 1 */
+static zv_tstamp seven_after(zv_periodic *w, zv_tstamp now) {
+    (void)w;			/* unused */
+    reschedules++;
+    return 1.0 + (floor((now - 1.0) / 7.0) + 1.0) * 7.0;
+}
+
+static void test_reschedule_cb(void) {
+    zv_loop *lp = mock_loop();
+    struct fires f = { {0}, 0, 0.0 };
+    zv_periodic w;
+
+    zv_periodic_init(&w, periodic_cb, 0.0, 0.0, seven_after);
+    w.data = &f;
+    zv_periodic_start(lp, &w);
+    check(reschedules == 1);
+
+    run_to(lp, &f, 100);
+    check(on_grid(last(&f), 1.0, 7.0));
+    check(reschedules == 101);
+
+    /* asked again after a jump, rather than waiting out the old schedule */
+    zv_tstamp before = last(&f);
+    zv_mock_jump(lp, -1000.0);
+    run_to(lp, &f, 101);
+    check(reschedules == 103);
+    check(on_grid(last(&f), 1.0, 7.0));
+    check(last(&f) < before - 900.0);
+
+    zv_periodic_stop(lp, &w);
+    mock_loop_free(lp);
+}
+
+int main(void) {
+    test_schedule();
+    test_jumps();
+    test_reschedule_cb();
+    return test_result();
+}
@@ -0,0 +1,155 @@
+// fixed size object pools, carved from slabs
+
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Every object is preceded by a header naming its slab, so a put is O(1)
+ * and a slab whose objects are all free can be handed back.
+ * Slabs with free objects are kept in front of the full ones.
+ */
+struct zv_slab {
+    struct zv_slab *prev, *next;
+    int nfree;
+    struct pool_obj *free;
+};
+
+struct pool_obj {
+    struct zv_slab *slab;
+    struct pool_obj *next;	/* only while the object is free */
+};
+
+#define OBJ_HDR (sizeof(struct pool_obj))
+#define SLAB_HDR ((sizeof(struct zv_slab) + 15) & ~(size_t)15)
+
+static void slab_unlink(struct zv_pool *pool, struct zv_slab *slab) {
+    if (slab -> prev)
+	slab -> prev -> next = slab -> next;
+    else
+	pool -> slabs = slab -> next;
+    if (slab -> next)
+	slab -> next -> prev = slab -> prev;
+    else
+	pool -> tail = slab -> prev;
+}
+
+static void slab_push_front(struct zv_pool *pool, struct zv_slab *slab) {
+    slab -> prev = NULL;
+    slab -> next = pool -> slabs;
+    if (pool -> slabs)
+	pool -> slabs -> prev = slab;
+    else
+	pool -> tail = slab;
+    pool -> slabs = slab;
+}
+
+static void slab_push_back(struct zv_pool *pool, struct zv_slab *slab) {
+    slab -> next = NULL;
+    slab -> prev = pool -> tail;
+    if (pool -> tail)
+	pool -> tail -> next = slab;
+    else
+	pool -> slabs = slab;
+    pool -> tail = slab;
+}
+
+static struct zv_slab *slab_new(struct zv_pool *pool) {
+    struct zv_slab *slab = (struct zv_slab *)zv_realloc(NULL, SLAB_HDR +
+							 (long)pool -> objsize * pool -> perslab);
+    char *objs = (char *)slab + SLAB_HDR;
+
+    slab -> nfree = pool -> perslab;
+    slab -> free = NULL;
+    for (int i = pool -> perslab - 1; i >= 0; i--) {
+	struct pool_obj *obj = (struct pool_obj *)(objs + (long)i * pool -> objsize);
+	obj -> slab = slab;
+	obj -> next = slab -> free;
+	slab -> free = obj;
+    }
+    pool -> nslabs += 1;
+    return slab;
+}
+
+void zv_pool_init(struct zv_pool *pool, int size, int perslab) {
+    assert(pool && size > 0 && perslab > 0);
+
+    pool -> objsize = (OBJ_HDR + size + 15) & ~15;
+    pool -> perslab = perslab;
+    pool -> slabs = pool -> tail = NULL;
+    pool -> nslabs = 0;
+    pool -> used = 0;
+}
+
+void *zv_pool_get(struct zv_pool *pool) {
+    assert(pool && pool -> objsize);
+
+    struct zv_slab *slab = pool -> slabs;
+    if (slab == NULL || slab -> nfree == 0) {
+	slab = slab_new(pool);
+	slab_push_front(pool, slab);
+    }
+
+    struct pool_obj *obj = slab -> free;
+    slab -> free = obj -> next;
+    if (--(slab -> nfree) == 0) {
+	/* full slabs go behind the ones that can still serve */
+	slab_unlink(pool, slab);
+	slab_push_back(pool, slab);
+    }
+    pool -> used += 1;
+    return (char *)obj + OBJ_HDR;
+}
+
+void zv_pool_put(struct zv_pool *pool, void *ptr) {
+    assert(pool);
+    if (ptr == NULL)
+	return;
+
+    struct pool_obj *obj = (struct pool_obj *)((char *)ptr - OBJ_HDR);
+    struct zv_slab *slab = obj -> slab;
+
+    obj -> next = slab -> free;
+    slab -> free = obj;
+    if ((slab -> nfree)++ == 0) {
+	slab_unlink(pool, slab);
+	slab_push_front(pool, slab);
+    }
+    pool -> used -= 1;
+}
+
+/* release slabs with no object in use, keeping `keep` of them for reuse */
+void zv_pool_shrink(struct zv_pool *pool, int keep) {
+    assert(pool);
+
+    struct zv_slab *slab = pool -> slabs, *next;
+    for (; slab && slab -> nfree; slab = next) {
+	next = slab -> next;
+	if (slab -> nfree != pool -> perslab)
+	    continue;
+	if (keep > 0) {
+	    keep--;
+	    continue;
+	}
+	slab_unlink(pool, slab);
+	zv_free(slab);
+	pool -> nslabs -= 1;
+    }
+}
+
+/* every object must have been put back */
+void zv_pool_destroy(struct zv_pool *pool) {
+    assert(pool);
+
+    struct zv_slab *slab, *next;
+    for (slab = pool -> slabs; slab; slab = next) {
+	next = slab -> next;
+	zv_free(slab);
+    }
+    pool -> slabs = pool -> tail = NULL;
+    pool -> nslabs = 0;
+    pool -> used = 0;
+}
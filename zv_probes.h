@@ -0,0 +1,22 @@
+#ifndef _ZV_PROBES_H_
+#define _ZV_PROBES_H_
+
+#include "config.h"
+
+/*
+ * USDT probes in the `libzv` provider, e.g.
+ *   bpftrace -e 'usdt:./libzv.so:libzv:invoke_start { @[arg1] = count(); }'
+ * They compile to a nop when <sys/sdt.h> is missing.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define ZV_PROBE1(name, a)		DTRACE_PROBE1(libzv, name, a)
+#define ZV_PROBE2(name, a, b)		DTRACE_PROBE2(libzv, name, a, b)
+#define ZV_PROBE3(name, a, b, c)	DTRACE_PROBE3(libzv, name, a, b, c)
+#else
+#define ZV_PROBE1(name, a)		do {} while (0)
+#define ZV_PROBE2(name, a, b)		do {} while (0)
+#define ZV_PROBE3(name, a, b, c)	do {} while (0)
+#endif // HAVE_SYS_SDT_H
+
+#endif // _ZV_PROBES_H_
@@ -0,0 +1,447 @@
+// loop input record, and its replay on stub watchers
+
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define RECORD_VERSION 1
+#define RECORD_BLK 4096		/* records buffered before a write */
+
+void timer_start_at(zv_loop *lp, zv_timer *w);
+
+/*
+ * Only what comes into the loop is recorded, never what the callbacks
+ * do with it, so a record replays on any build and any callbacks.
+ */
+struct zv_record {
+    FILE *fp;
+    int cnt;
+    int failed;			/* a write failed, the file is short */
+    struct zv_record_rec recs[RECORD_BLK];
+};
+
+static void record_flush(struct zv_record *rec) {
+    if (!rec -> failed && fwrite(rec -> recs, sizeof(struct zv_record_rec), rec -> cnt,
+				 rec -> fp) != (size_t)rec -> cnt) {
+	zv_err(0, "fwrite error");
+	rec -> failed = 1;
+    }
+    rec -> cnt = 0;
+}
+
+static struct zv_record_rec *record_next(zv_loop *lp) {
+    struct zv_record *rec = lp -> record;
+    if (rec -> cnt == RECORD_BLK)
+	record_flush(rec);
+    return rec -> recs + rec -> cnt++;
+}
+
+void record_event(zv_loop *lp, int type, int arg, uint64_t value) {
+    struct zv_record_rec *r = record_next(lp);
+    r -> type = type;
+    r -> arg = arg;
+    r -> value = value;
+}
+
+void record_time(zv_loop *lp, zv_tstamp now) {
+    struct zv_record_rec *r = record_next(lp);
+    r -> type = ZV_REC_TIME;
+    r -> arg = 0;
+    r -> now = now;
+}
+
+/* must be called on the loop thread */
+int zv_record_start(zv_loop *lp, const char *path) {
+    assert(lp && path);
+
+    if (lp -> record)
+	return 0;
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+	zv_err(0, "fopen error: %s", path);
+	return -1;
+    }
+
+    struct zv_record_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ZV_RECORD_MAGIC, sizeof(hdr.magic));
+    hdr.version = RECORD_VERSION;
+    hdr.reclen = sizeof(struct zv_record_rec);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+	zv_err(0, "fwrite error: %s", path);
+	fclose(fp);
+	return -1;
+    }
+
+    struct zv_record *rec = (struct zv_record *)zv_calloc(1, sizeof(struct zv_record));
+    rec -> fp = fp;
+    lp -> record = rec;
+    return 0;
+}
+
+/* must be called on the loop thread */
+void zv_record_stop(zv_loop *lp) {
+    assert(lp);
+
+    struct zv_record *rec = lp -> record;
+    if (rec == NULL)
+	return;
+
+    record_flush(rec);
+    if (fclose(rec -> fp) != 0)
+	zv_err(0, "fclose error");
+    lp -> record = NULL;
+    zv_free(rec);
+}
+
+// ===============================
+// replay
+
+struct replay;
+
+/* a timer's expirations, it is restarted for the next one when it fires */
+struct replay_timer {
+    zv_timer w;
+    struct replay *rp;
+    uint64_t addr;		/* the recorded timer */
+    int id;			/* in order of first expiration */
+    zv_tstamp *at;
+    int at_cnt;
+    int at_max;
+    int next;
+};
+
+/* one stub per fd, the signals that came through it are fed one per readiness */
+struct replay_fd {
+    zv_io w;
+    struct replay *rp;
+    int *signos;
+    int signo_cnt;
+    int signo_max;
+    int next;
+};
+
+struct replay_signal {
+    zv_watcher w;
+    struct replay *rp;
+    int signo;
+};
+
+struct replay {
+    zv_loop *lp;
+    zv_tstamp cost;
+    FILE *order;
+    zv_tstamp start;
+    uint64_t events;
+    uint64_t hash;
+
+    struct replay_fd *fds[ZV_OPENFD_MAX];
+    struct replay_signal *signals[SIGNUM];
+    struct replay_timer **timers;	/* by id */
+    int timer_cnt;
+    int timer_max;
+    struct replay_timer **timer_hash;	/* by address, open addressing */
+    int timer_hashmax;
+};
+
+static void *grow(void *arr, int *max, int size) {
+    *max = *max ? *max * 2 : 16;
+    return zv_realloc(arr, (long)*max * size);
+}
+
+static zv_tstamp replay_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* FNV-1a over what ran, timers are numbered in record order so addresses do not matter */
+static void replay_dispatch(struct replay *rp, int type, int id, int revents) {
+    int fields[3] = { type, id, revents };
+    const unsigned char *p = (const unsigned char *)fields;
+    for (unsigned i=0; i<sizeof(fields); i++)
+	rp -> hash = (rp -> hash ^ p[i]) * 0x100000001b3ULL;
+    rp -> events++;
+
+    if (rp -> order)
+	fprintf(rp -> order, "%.6f %d %d %d\n", zv_loop_time(rp -> lp) - rp -> start,
+		type, id, revents);
+
+    /* the callback's work: real time spent, and the virtual clock moved as far */
+    if (rp -> cost > 0.0) {
+	zv_tstamp until = replay_clock() + rp -> cost;
+	while (replay_clock() < until)
+	    ;
+	zv_mock_advance(rp -> lp, rp -> cost);
+    }
+}
+
+static void replay_timer_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    struct replay_timer *t = (struct replay_timer *)w;
+
+    replay_dispatch(t -> rp, ZV_REC_TIMER, t -> id, revents);
+    if (t -> next < t -> at_cnt) {
+	t -> w.at = t -> at[t -> next++];
+	timer_start_at(lp, &t -> w);
+    }
+}
+
+static void replay_signal_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp;			/* unused */
+    struct replay_signal *s = (struct replay_signal *)w;
+    replay_dispatch(s -> rp, ZV_REC_SIGNAL, s -> signo, revents);
+}
+
+/* stands in for the signal pipe's callback too, like it, one signal per call */
+static void replay_fd_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    struct replay_fd *f = (struct replay_fd *)w;
+
+    replay_dispatch(f -> rp, ZV_REC_FD, f -> w.fd, revents);
+    if (f -> next < f -> signo_cnt) {
+	struct replay_signal *s = f -> rp -> signals[f -> signos[f -> next++]];
+	zv_feed_event(lp, &s -> w, ZV_SIGNAL);
+    }
+}
+
+static struct replay_fd *replay_fd(struct replay *rp, int fd) {
+    if (rp -> fds[fd] == NULL) {
+	struct replay_fd *f = (struct replay_fd *)zv_calloc(1, sizeof(struct replay_fd));
+	zv_io_init(&f -> w, replay_fd_cb, fd, ZV_NONE);
+	f -> rp = rp;
+	rp -> fds[fd] = f;
+    }
+    return rp -> fds[fd];
+}
+
+static struct replay_signal *replay_signal(struct replay *rp, int signo) {
+    if (rp -> signals[signo] == NULL) {
+	struct replay_signal *s = (struct replay_signal *)zv_calloc(1, sizeof(struct replay_signal));
+	s -> w.priority = ZV_MAX_PRI;	/* as zv_signal_init */
+	s -> w.cb = replay_signal_cb;
+	s -> rp = rp;
+	s -> signo = signo;
+	rp -> signals[signo] = s;
+    }
+    return rp -> signals[signo];
+}
+
+static int timer_slot(struct replay *rp, uint64_t addr) {
+    return (int)((addr * 0x9e3779b97f4a7c15ULL) >> 32) & (rp -> timer_hashmax - 1);
+}
+
+static struct replay_timer *replay_timer(struct replay *rp, uint64_t addr) {
+    /* at most half full */
+    if (2 * (rp -> timer_cnt + 1) > rp -> timer_hashmax) {
+	zv_free(rp -> timer_hash);
+	rp -> timer_hashmax = rp -> timer_hashmax ? rp -> timer_hashmax * 2 : 64;
+	rp -> timer_hash = (struct replay_timer **)zv_calloc(rp -> timer_hashmax, sizeof(void *));
+	for (int i=0; i<rp -> timer_cnt; i++) {
+	    int slot = timer_slot(rp, rp -> timers[i] -> addr);
+	    while (rp -> timer_hash[slot])
+		slot = (slot + 1) & (rp -> timer_hashmax - 1);
+	    rp -> timer_hash[slot] = rp -> timers[i];
+	}
+    }
+
+    int slot = timer_slot(rp, addr);
+    for (; rp -> timer_hash[slot]; slot = (slot + 1) & (rp -> timer_hashmax - 1)) {
+	if (rp -> timer_hash[slot] -> addr == addr)
+	    return rp -> timer_hash[slot];
+    }
+
+    struct replay_timer *t = (struct replay_timer *)zv_calloc(1, sizeof(struct replay_timer));
+    zv_timer_init(&t -> w, replay_timer_cb, 0.0, 0.0);
+    t -> rp = rp;
+    t -> addr = addr;
+    t -> id = rp -> timer_cnt;
+    if (rp -> timer_cnt == rp -> timer_max)
+	rp -> timers = (struct replay_timer **)grow(rp -> timers, &rp -> timer_max, sizeof(void *));
+    rp -> timers[rp -> timer_cnt++] = t;
+    rp -> timer_hash[slot] = t;
+    return t;
+}
+
+static struct zv_record_rec *replay_load(const char *path, long *cnt) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+	zv_err(0, "fopen error: %s", path);
+	return NULL;
+    }
+
+    struct zv_record_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	memcmp(hdr.magic, ZV_RECORD_MAGIC, sizeof(hdr.magic)) != 0 ||
+	hdr.version != RECORD_VERSION || hdr.reclen != sizeof(struct zv_record_rec)) {
+	zv_warn("%s: not a libzv record", path);
+	fclose(fp);
+	return NULL;
+    }
+
+    struct zv_record_rec *recs = NULL;
+    int max = 0;
+    size_t n;
+    *cnt = 0;
+    do {
+	if (*cnt == max)
+	    recs = (struct zv_record_rec *)grow(recs, &max, sizeof(struct zv_record_rec));
+	n = fread(recs + *cnt, sizeof(struct zv_record_rec), max - *cnt, fp);
+	*cnt += n;
+    } while (n > 0);
+    fclose(fp);
+    return recs;
+}
+
+/*
+ * Turn the record into a script for the mock backend and stubs on it:
+ * fd readiness is scripted at the time of the poll that reported it,
+ * each recorded timer becomes a stub timer restarted for its next
+ * expiration, and each signal is fed when the fd it came through is
+ * next dispatched. Returns -1 if no poll was recorded.
+ */
+static int replay_script(struct replay *rp, struct zv_record_rec *recs, long cnt) {
+    zv_tstamp now = 0.0;
+    long polled = 0;		/* fd records from here on wait for the time of their poll */
+    int times = 0;
+
+    for (long i=0; i<cnt; i++) {
+	struct zv_record_rec *r = recs + i;
+	switch (r -> type) {
+	case ZV_REC_TIME:
+	    now = r -> now;
+	    if (times++ == 0) {
+		zv_mock_init(rp -> lp, now);
+		rp -> start = now;
+	    }
+	    for (; polled < i; polled++) {
+		struct zv_record_rec *fr = recs + polled;
+		if (fr -> type == ZV_REC_FD)
+		    zv_mock_ready(rp -> lp, now, fr -> arg, (int)fr -> value);
+	    }
+	    polled = i + 1;
+	    break;
+	case ZV_REC_FD:
+	    if (r -> arg < 0 || r -> arg >= ZV_OPENFD_MAX) {
+		r -> type = -1;		/* skipped when scripted */
+		break;
+	    }
+	    replay_fd(rp, r -> arg) -> w.events |= (int)r -> value & (ZV_READ | ZV_WRITE);
+	    break;
+	case ZV_REC_TIMER:
+	    if (times) {
+		struct replay_timer *t = replay_timer(rp, r -> value);
+		if (t -> at_cnt == t -> at_max)
+		    t -> at = (zv_tstamp *)grow(t -> at, &t -> at_max, sizeof(zv_tstamp));
+		t -> at[t -> at_cnt++] = now;
+	    }
+	    break;
+	case ZV_REC_SIGNAL:
+	    if (r -> arg >= 0 && r -> arg < SIGNUM && r -> value < ZV_OPENFD_MAX) {
+		struct replay_fd *f = replay_fd(rp, (int)r -> value);
+		if (f -> signo_cnt == f -> signo_max)
+		    f -> signos = (int *)grow(f -> signos, &f -> signo_max, sizeof(int));
+		f -> signos[f -> signo_cnt++] = replay_signal(rp, r -> arg) -> signo;
+	    }
+	    break;
+	}
+    }
+    return times ? 0 : -1;
+}
+
+static void replay_free(struct replay *rp) {
+    zv_loop *lp = rp -> lp;
+
+    for (int fd=0; fd<ZV_OPENFD_MAX; fd++) {
+	if (rp -> fds[fd]) {
+	    zv_free(rp -> fds[fd] -> signos);
+	    zv_free(rp -> fds[fd]);
+	}
+    }
+    for (int signo=0; signo<SIGNUM; signo++)
+	zv_free(rp -> signals[signo]);
+    for (int i=0; i<rp -> timer_cnt; i++) {
+	zv_free(rp -> timers[i] -> at);
+	zv_free(rp -> timers[i]);
+    }
+    zv_free(rp -> timers);
+    zv_free(rp -> timer_hash);
+
+    zv_loop_destroy(lp);
+    zv_free(lp);
+    zv_free(rp);
+}
+
+/*
+ * Replay a record on a fresh loop with the mock backend, each stub
+ * callback spending `cost` seconds. The stubs run in the order this
+ * build schedules them, written to `order_path` one per line unless it
+ * is NULL: virtual time since the first poll, ZV_REC_* type, fd, timer
+ * number or signal, and revents.
+ */
+int zv_replay(const char *path, zv_tstamp cost, const char *order_path,
+	      struct zv_replay_stats *st) {
+    assert(path && st);
+    assert(cost >= 0.0);
+
+    long cnt;
+    struct zv_record_rec *recs = replay_load(path, &cnt);
+    if (recs == NULL)
+	return -1;
+
+    struct replay *rp = (struct replay *)zv_calloc(1, sizeof(struct replay));
+    rp -> lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(rp -> lp);
+    rp -> cost = cost;
+    rp -> hash = 0xcbf29ce484222325ULL;
+
+    int ret = replay_script(rp, recs, cnt);
+    zv_free(recs);
+    if (ret < 0) {
+	zv_warn("%s: no polls recorded", path);
+	replay_free(rp);
+	return -1;
+    }
+    if (order_path && (rp -> order = fopen(order_path, "w")) == NULL) {
+	zv_err(0, "fopen error: %s", order_path);
+	replay_free(rp);
+	return -1;
+    }
+
+    zv_loop *lp = rp -> lp;
+    for (int fd=0; fd<ZV_OPENFD_MAX; fd++) {
+	struct replay_fd *f = rp -> fds[fd];
+	if (f == NULL)
+	    continue;
+	if (f -> w.events == ZV_NONE)
+	    f -> w.events = ZV_READ;	/* only ever carried signals */
+	zv_io_start(lp, &f -> w);
+    }
+    for (int i=0; i<rp -> timer_cnt; i++) {
+	struct replay_timer *t = rp -> timers[i];
+	t -> w.at = t -> at[t -> next++];
+	timer_start_at(lp, &t -> w);
+    }
+
+    /* the mock backend breaks the loop once nothing is left to happen */
+    int loops = lp -> loop_cnt;
+    zv_tstamp started = replay_clock();
+    zv_loop_run(lp, ZV_RUN_DEFAULT);
+    st -> elapsed = replay_clock() - started;
+    st -> iterations = lp -> loop_cnt - loops;
+    st -> events = rp -> events;
+    st -> span = zv_loop_time(lp) - rp -> start;
+    st -> order = rp -> hash;
+
+    if (rp -> order && fclose(rp -> order) != 0) {
+	zv_err(0, "fclose error: %s", order_path);
+	ret = -1;
+    }
+    replay_free(rp);
+    return ret;
+}
@@ -0,0 +1,123 @@
+// zv_stat following a path through writes, a rename over it and a delete and recreate
+
+#include "zv.h"
+#include "zv_test.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INTERVAL 0.05		/* polling while `path` is missing */
+
+static char dir[] = "/tmp/zv_stattest.XXXXXX";
+static char path[64], tmp[64];
+static int hits;
+
+static void stat_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)w;		/* unused */
+    check(revents & ZV_STAT);
+    hits++;
+}
+
+static void tick_cb(zv_loop *lp, zv_watcher *w, int revents) {
+    (void)lp; (void)w; (void)revents;	/* unused, it only bounds the polls */
+}
+
+/* the callbacks a change brings, given time to arrive and settle */
+static int changes(zv_loop *lp) {
+    int before = hits;
+    zv_tstamp deadline = zv_time() + 2.0;
+
+    while (hits == before && zv_time() < deadline)
+	zv_loop_run(lp, ZV_RUN_ONCE);
+    deadline = zv_time() + 2 * INTERVAL;
+    while (zv_time() < deadline)
+	zv_loop_run(lp, ZV_RUN_ONCE);
+    return hits - before;
+}
+
+static void append(const char *p, const char *s) {
+    int fd = open(p, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    check(fd >= 0 && write(fd, s, strlen(s)) == (ssize_t)strlen(s));
+    close(fd);
+}
+
+static int same_file(const zv_stat *w) {
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_ino == w -> attr.st_ino && st.st_size == w -> attr.st_size;
+}
+
+/*
+ * With `hold` set the old inode stays open, as a reader that has not
+ * reloaded yet would keep it, and the kernel says nothing but IN_ATTRIB.
+ */
+static void follow(zv_loop *lp, int hold) {
+    zv_stat w;
+    int held = -1;
+
+    append(path, "a");
+    zv_stat_init(&w, stat_cb, path, INTERVAL);
+    zv_stat_start(lp, &w);
+
+    append(path, "b");
+    check(changes(lp) == 1);
+    check(same_file(&w));
+
+    /* a new version renamed over it */
+    if (hold)
+	held = open(path, O_RDONLY);
+    append(tmp, "new");
+    check(rename(tmp, path) == 0);
+    check(changes(lp) == 1);
+    check(same_file(&w));
+    close(held);
+
+    /* the new file is the one followed now */
+    append(path, "c");
+    check(changes(lp) == 1);
+    check(same_file(&w));
+
+    /* deleted, then created again */
+    if (hold)
+	held = open(path, O_RDONLY);
+    check(unlink(path) == 0);
+    check(changes(lp) == 1);
+    check(w.attr.st_nlink == 0 && w.prev.st_nlink == 1);
+    append(path, "again");
+    check(changes(lp) == 1);
+    check(same_file(&w));
+    close(held);
+
+    append(path, "d");
+    check(changes(lp) == 1);
+    check(same_file(&w));
+
+    zv_stat_stop(lp, &w);
+    unlink(path);
+}
+
+int main(void) {
+    if (mkdtemp(dir) == NULL) {
+	perror("mkdtemp");
+	return 1;
+    }
+    snprintf(path, sizeof(path), "%s/conf", dir);
+    snprintf(tmp, sizeof(tmp), "%s/conf.tmp", dir);
+
+    zv_loop *lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(lp);
+    zv_timer tick;
+    zv_timer_init(&tick, tick_cb, INTERVAL / 5, INTERVAL / 5);
+    zv_timer_start(lp, &tick);
+
+    follow(lp, 0);
+    follow(lp, 1);
+
+    zv_timer_stop(lp, &tick);
+    zv_loop_destroy(lp);
+    zv_free(lp);
+    rmdir(dir);
+    return test_result();
+}
@@ -0,0 +1,24 @@
+// checks for the tests that run without cmocka, a failure is counted and the test goes on
+
+#ifndef _ZV_TEST_H_
+#define _ZV_TEST_H_
+
+#include <stdio.h>
+
+static int test_failed;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+	    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+	    test_failed++;						\
+	}								\
+    } while (0)
+
+/* what main returns */
+static inline int test_result(void) {
+    if (test_failed)
+	fprintf(stderr, "%d checks failed\n", test_failed);
+    return test_failed != 0;
+}
+
+#endif // _ZV_TEST_H_
@@ -136,6 +136,106 @@ static void theap_test_makeempty(void **state) {
     test_free(timers);
 }
 
+static void theap_test_wakeup(void **state) {
+    zv_loop *lp = (zv_loop *)(*state);
+
+    /* due at 1, 2, 3, 10 and willing to wait until 4, 2.5, 6, 10 */
+    zv_tstamp at[] = {1.0, 2.0, 3.0, 10.0};
+    zv_tstamp latest[] = {4.0, 2.5, 6.0, 10.0};
+    zv_timer *timers = (zv_timer *)test_calloc(4, sizeof(zv_timer));
+    for (int i=0; i<4; i++) {
+	timers[i].at = at[i];
+	timers[i].latest = latest[i];
+	theap_insert(&timers[i], lp);
+    }
+    assert_true(theap_wakeup(lp) == 2.5);
+
+    /* without slack the earliest timer decides */
+    timers[0].latest = 1.0;
+    assert_true(theap_wakeup(lp) == 1.0);
+
+    test_free(timers);
+}
+
+/* every timer knows its slot and no parent is later than its children */
+static void theap_assert_valid(zv_loop *lp) {
+    for (int i=1; i<=lp -> timer_cnt; i++) {
+	assert_int_equal(lp -> timers[i] -> idx, i);
+	if (i > 1)
+	    assert_true((lp -> timers[i/2] -> at) <= (lp -> timers[i] -> at));
+    }
+}
+
+static void theap_test_delete(void **state) {
+    zv_loop *lp = (zv_loop *)(*state);
+
+    zv_timer *timers = (zv_timer *)test_calloc(TIMER_BLK*2, sizeof(zv_timer));
+    for (int i=0; i<TIMER_BLK*2; i++) {
+	timers[i].at = (i * 7) % (TIMER_BLK*2) + 1;
+	theap_insert(&timers[i], lp);
+    }
+    for (int i=0; i<TIMER_BLK*2; i+=3) {
+	theap_delete(&timers[i], lp);
+	assert_int_equal(timers[i].idx, 0);
+	theap_assert_valid(lp);
+    }
+    assert_int_equal(lp -> timer_cnt, TIMER_BLK*2 - (TIMER_BLK*2 + 2) / 3);
+
+    test_free(timers);
+}
+
+static void theap_test_expire(void **state) {
+    zv_loop *lp = (zv_loop *)(*state);
+
+    zv_timer *timers = (zv_timer *)test_calloc(TIMER_BLK*2, sizeof(zv_timer));
+    for (int i=0; i<TIMER_BLK*2; i++) {
+	timers[i].at = i+1;
+	theap_insert(&timers[i], lp);
+    }
+
+    /* a few due timers are popped in order */
+    assert_int_equal(theap_expire(lp, 3.0), 3);
+    for (int i=0; i<3; i++) {
+	assert_true(lp -> timer_due[i] -> at == (zv_tstamp)(i+1));
+	assert_int_equal(lp -> timer_due[i] -> idx, 0);
+    }
+    theap_assert_valid(lp);
+
+    /* most of the heap due at once goes through the rebuild */
+    assert_int_equal(theap_expire(lp, TIMER_BLK*2 - 10), TIMER_BLK*2 - 13);
+    assert_int_equal(lp -> timer_cnt, 10);
+    for (int i=0; i<TIMER_BLK*2 - 13; i++)
+	assert_true(lp -> timer_due[i] -> at <= TIMER_BLK*2 - 10);
+    theap_assert_valid(lp);
+    assert_true(theap_findmin(lp) -> at == TIMER_BLK*2 - 9);
+
+    assert_int_equal(theap_expire(lp, 0.5), 0);
+
+    test_free(timers);
+}
+
+static void theap_test_bulkinsert(void **state) {
+    zv_loop *lp = (zv_loop *)(*state);
+
+    zv_timer *timers = (zv_timer *)test_calloc(TIMER_BLK*3, sizeof(zv_timer));
+    zv_timer **batch = (zv_timer **)test_calloc(TIMER_BLK*3, sizeof(zv_timer *));
+    for (int i=0; i<TIMER_BLK*3; i++) {
+	timers[i].at = TIMER_BLK*3 - i;
+	batch[i] = &timers[i];
+    }
+
+    theap_bulkinsert(batch, 2, lp);
+    theap_assert_valid(lp);
+    theap_bulkinsert(batch + 2, TIMER_BLK*3 - 2, lp);
+    theap_assert_valid(lp);
+    assert_int_equal(lp -> timer_cnt, TIMER_BLK*3);
+    assert_int_equal(lp -> timer_max, TIMER_BLK*3);
+    assert_true(theap_findmin(lp) -> at == 1.0);
+
+    test_free(batch);
+    test_free(timers);
+}
+
 int main(void) {
 
     const struct CMUnitTest tests[] = {
@@ -155,6 +255,18 @@ int main(void) {
 	cmocka_unit_test_setup_teardown(theap_test_makeempty,
 					theap_test_setup,
 					theap_test_teardown),	
+	cmocka_unit_test_setup_teardown(theap_test_wakeup,
+					theap_test_setup,
+					theap_test_teardown),
+	cmocka_unit_test_setup_teardown(theap_test_delete,
+					theap_test_setup,
+					theap_test_teardown),
+	cmocka_unit_test_setup_teardown(theap_test_expire,
+					theap_test_setup,
+					theap_test_teardown),
+	cmocka_unit_test_setup_teardown(theap_test_bulkinsert,
+					theap_test_setup,
+					theap_test_teardown),
     };
     
     return cmocka_run_group_tests_name("Timer Heap Test", tests, NULL, NULL);
@@ -0,0 +1,139 @@
+// binary event trace ring
+
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define TRACE_VERSION 1
+
+/*
+ * Flight recorder: the loop thread is the only writer and overwrites the
+ * oldest records, readers copy a window and drop whatever got overwritten
+ * while they were copying.
+ */
+struct zv_trace {
+    uint64_t head;		/* records ever written */
+    uint64_t mask;		/* capacity - 1 */
+    struct zv_trace_rec recs[];
+};
+
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int trace_type(int revents) {
+    static const int types[] = {
+	ZV_TIMEDOUT, ZV_SIGNAL, ZV_IDLE, ZV_PREPARE, ZV_CHECK
+    };
+    for (unsigned i=0; i<sizeof(types)/sizeof(types[0]); i++) {
+	if (revents & types[i])
+	    return types[i];
+    }
+    return ZV_READ;
+}
+
+void trace_event(zv_loop *lp, zv_watcher *w, int revents, int pri, uint64_t start) {
+    struct zv_trace *tr = lp -> trace;
+    uint64_t head = tr -> head;
+    struct zv_trace_rec *rec = tr -> recs + (head & tr -> mask);
+
+    rec -> watcher = (uint64_t)(uintptr_t)w;
+    rec -> start = start;
+    rec -> end = trace_clock();
+    rec -> revents = revents;
+    rec -> priority = pri;
+    rec -> type = trace_type(revents);
+
+    __atomic_store_n(&tr -> head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* `capacity` is rounded up to a power of 2 */
+int zv_trace_start(zv_loop *lp, int capacity) {
+    assert(lp);
+    assert(capacity > 0);
+
+    if (lp -> trace)
+	return 0;
+
+    uint64_t cap = 1;
+    while (cap < (uint64_t)capacity)
+	cap <<= 1;
+
+    struct zv_trace *tr = (struct zv_trace *)zv_realloc(NULL, sizeof(struct zv_trace) +
+							cap * sizeof(struct zv_trace_rec));
+    tr -> head = 0;
+    tr -> mask = cap - 1;
+    lp -> trace = tr;
+    return 0;
+}
+
+/* must be called on the loop thread */
+void zv_trace_stop(zv_loop *lp) {
+    assert(lp);
+
+    zv_free(lp -> trace);
+    lp -> trace = NULL;
+}
+
+/*
+ * Write the records still in the ring to `path`. Another thread may dump
+ * while the loop runs, but not across zv_trace_stop, which frees the ring.
+ */
+int zv_trace_dump(zv_loop *lp, const char *path) {
+    assert(lp && path);
+
+    struct zv_trace *tr = lp -> trace;
+    if (tr == NULL)
+	return -1;
+
+    uint64_t cap = tr -> mask + 1;
+    struct zv_trace_rec *copy = (struct zv_trace_rec *)zv_realloc(NULL, cap * sizeof(struct zv_trace_rec));
+
+    uint64_t head = __atomic_load_n(&tr -> head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > cap ? head - cap : 0;
+    for (uint64_t i = first; i < head; i++)
+	copy[i - first] = tr -> recs[i & tr -> mask];
+
+    /*
+     * Anything the writer lapped during the copy is torn, and so is the
+     * slot of record `now`, which it may be writing over record now - cap.
+     */
+    uint64_t now = __atomic_load_n(&tr -> head, __ATOMIC_ACQUIRE);
+    uint64_t skip = 0;
+    if (now + 1 > cap + first)
+	skip = now + 1 - cap - first;
+    if (skip > head - first)
+	skip = head - first;
+
+    struct zv_trace_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ZV_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.reclen = sizeof(struct zv_trace_rec);
+    hdr.count = head - first - skip;
+
+    int ret = 0;
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+	zv_err(0, "fopen error: %s", path);
+	zv_free(copy);
+	return -1;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	fwrite(copy + skip, sizeof(struct zv_trace_rec), hdr.count, fp) != hdr.count) {
+	zv_err(0, "fwrite error: %s", path);
+	ret = -1;
+    }
+    if (fclose(fp) != 0)
+	ret = -1;
+    zv_free(copy);
+    return ret;
+}
@@ -0,0 +1,110 @@
+// zv_loop_wakeup and zv_loop_break from another thread, against a loop blocked in its poll
+
+#define _GNU_SOURCE
+#include "zv.h"
+#include "zv_test.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define ROUNDS 100000
+#define HAMMER 2.0		/* seconds */
+
+struct wake {
+    zv_loop *lp;
+    long iterations;		/* loop iterations done, read by the waker */
+    int stop;
+};
+
+static zv_tstamp mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* nothing but the wakeup fd can return from the poll, no timers and no other fds */
+static void *loop_thread(void *arg) {
+    struct wake *wk = (struct wake *)arg;
+
+    while (!__atomic_load_n(&wk -> stop, __ATOMIC_ACQUIRE)) {
+	zv_loop_run(wk -> lp, ZV_RUN_ONCE);
+	__atomic_add_fetch(&wk -> iterations, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* every wakeup must end a blocking iteration, a lost one leaves the loop asleep */
+static int wake_rounds(struct wake *wk) {
+    for (int i=0; i<ROUNDS; i++) {
+	long seen = __atomic_load_n(&wk -> iterations, __ATOMIC_ACQUIRE);
+	zv_tstamp deadline = mono_now() + 5.0;
+
+	zv_loop_wakeup(wk -> lp);
+	while (__atomic_load_n(&wk -> iterations, __ATOMIC_ACQUIRE) == seen) {
+	    if (mono_now() > deadline) {
+		fprintf(stderr, "wakeup %d was lost\n", i);
+		return -1;
+	    }
+	    sched_yield();
+	}
+    }
+    return 0;
+}
+
+/*
+ * Wakeups back to back for a while, racing the loop thread's drain. The
+ * loop has to keep going, and the break at the end still has to get
+ * through.
+ */
+static int hammer(struct wake *wk, pthread_t tid) {
+    zv_tstamp start = mono_now(), moved = start, now = start;
+    long seen = 0;
+
+    while (now - start < HAMMER) {
+	for (int i=0; i<1000; i++)
+	    zv_loop_wakeup(wk -> lp);
+	now = mono_now();
+	long it = __atomic_load_n(&wk -> iterations, __ATOMIC_ACQUIRE);
+	if (it != seen) {
+	    seen = it;
+	    moved = now;
+	} else if (now - moved > 2.0) {
+	    fprintf(stderr, "the loop stopped waking up after %ld iterations\n", it);
+	    break;
+	}
+    }
+
+    __atomic_store_n(&wk -> stop, 1, __ATOMIC_RELEASE);
+    zv_loop_break(wk -> lp);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    return pthread_timedjoin_np(tid, NULL, &ts);
+}
+
+int main(void) {
+    struct wake wk = { NULL, 0, 0 };
+    pthread_t tid;
+
+    wk.lp = (zv_loop *)zv_calloc(1, sizeof(zv_loop));
+    zv_loop_init(wk.lp);
+    if (pthread_create(&tid, NULL, loop_thread, &wk) != 0) {
+	perror("pthread_create");
+	return 1;
+    }
+
+    check(wake_rounds(&wk) == 0);
+    int err = hammer(&wk, tid);
+    check(err == 0);
+    if (err != 0) {
+	fprintf(stderr, "the loop did not stop: %s\n", strerror(err));
+	return test_result();	/* the thread is stuck in its poll */
+    }
+
+    zv_loop_destroy(wk.lp);
+    zv_free(wk.lp);
+    return test_result();
+}
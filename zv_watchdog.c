@@ -0,0 +1,229 @@
+// slow callback watchdog
+
+#define _GNU_SOURCE
+#include "zv.h"
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif // HAVE_EXECINFO_H
+
+#define WATCHDOG_RING 64	/* must be a power of 2 */
+#define CAPTURE_WAIT 0.01	/* how long to wait for the loop thread's backtrace */
+
+struct zv_watchdog {
+    zv_loop *lp;
+    pthread_t tid;
+    zv_tstamp threshold;
+    int running;
+
+    /* single producer (watchdog thread), single consumer (`zv_watchdog_fetch`) */
+    struct zv_stall ring[WATCHDOG_RING];
+    unsigned head;
+    unsigned tail;
+};
+
+/*
+ * A signal handler has no context of its own, so the slot waiting for a
+ * backtrace lives here. Only one watchdog captures at a time.
+ */
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t capture_once = PTHREAD_ONCE_INIT;
+static struct zv_stall *capture_slot;
+static int capture_done;
+
+static void zv_sleep(zv_tstamp t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	;
+}
+
+#ifdef HAVE_EXECINFO_H
+/* runs on the loop thread, in the middle of the slow callback */
+static void capture_handler(int signo, siginfo_t *si, void *uctx) {
+    (void)signo; (void)si; (void)uctx;	/* unused */
+    int saved = errno;
+
+    struct zv_stall *st = __atomic_exchange_n(&capture_slot, NULL, __ATOMIC_ACQ_REL);
+    if (st) {
+	st -> nframes = backtrace(st -> frames, ZV_STALL_FRAMES);
+	__atomic_store_n(&capture_done, 1, __ATOMIC_RELEASE);
+    }
+    errno = saved;
+}
+
+static void capture_install(void) {
+    struct sigaction sa;
+    void *frame;
+
+    /* backtrace() may allocate on its first call, never do that in the handler */
+    backtrace(&frame, 1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = capture_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(ZV_WATCHDOG_SIGNO, &sa, NULL) < 0)
+	zv_err(0, "sigaction error");
+}
+
+static void capture_backtrace(zv_loop *lp, struct zv_stall *st) {
+    pthread_mutex_lock(&capture_mutex);
+
+    __atomic_store_n(&capture_done, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&capture_slot, st, __ATOMIC_RELEASE);
+    if (pthread_kill(lp -> tid, ZV_WATCHDOG_SIGNO) == 0) {
+	zv_tstamp deadline = zv_time() + CAPTURE_WAIT;
+	while (__atomic_load_n(&capture_slot, __ATOMIC_ACQUIRE) && zv_time() < deadline)
+	    zv_sleep(0.0001);
+    }
+    /* take the slot back, unless the handler already owns it */
+    if (__atomic_exchange_n(&capture_slot, NULL, __ATOMIC_ACQ_REL) == NULL) {
+	while (!__atomic_load_n(&capture_done, __ATOMIC_ACQUIRE))
+	    zv_sleep(0.0001);
+    }
+
+    pthread_mutex_unlock(&capture_mutex);
+}
+#endif // HAVE_EXECINFO_H
+
+static void watchdog_report(struct zv_watchdog *wd, zv_watcher *w, w_cb cb, int loop_cnt,
+			    zv_tstamp started, zv_tstamp now) {
+    unsigned head = wd -> head;
+    if (head - __atomic_load_n(&wd -> tail, __ATOMIC_ACQUIRE) == WATCHDOG_RING)
+	return;			/* ring is full, keep the older stalls */
+
+    struct zv_stall *st = wd -> ring + (head & (WATCHDOG_RING - 1));
+    st -> watcher = w;
+    st -> cb = cb;		/* `w` itself may be gone by now */
+    st -> started = started;
+    st -> detected = now;
+    st -> loop_cnt = loop_cnt;
+    st -> nframes = 0;
+#ifdef HAVE_EXECINFO_H
+    capture_backtrace(wd -> lp, st);
+#endif // HAVE_EXECINFO_H
+
+    __atomic_store_n(&wd -> head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The loop only publishes which watcher is running. A callback is stalled
+ * when the same watcher is still running, in the same loop iteration, one
+ * threshold after the watchdog first saw it.
+ */
+static void *watchdog_thread(void *arg) {
+    struct zv_watchdog *wd = (struct zv_watchdog *)arg;
+    zv_loop *lp = wd -> lp;
+    zv_tstamp period = wd -> threshold / 4;
+    if (period < 0.001)
+	period = 0.001;
+
+    zv_watcher *seen = NULL;
+    int seen_cnt = 0, reported = 0;
+    zv_tstamp since = 0.0;
+
+    while (__atomic_load_n(&wd -> running, __ATOMIC_ACQUIRE)) {
+	zv_sleep(period);
+
+	zv_watcher *w = __atomic_load_n(&lp -> cb_watcher, __ATOMIC_ACQUIRE);
+	w_cb cb = __atomic_load_n(&lp -> cb_fn, __ATOMIC_ACQUIRE);
+	int cnt = __atomic_load_n(&lp -> loop_cnt, __ATOMIC_RELAXED);
+	zv_tstamp now = zv_time();
+
+	/* `cb` may belong to the next callback already */
+	if (__atomic_load_n(&lp -> cb_watcher, __ATOMIC_ACQUIRE) != w)
+	    w = NULL;
+	if (w == NULL || w != seen || cnt != seen_cnt) {
+	    seen = w;
+	    seen_cnt = cnt;
+	    since = now;
+	    reported = 0;
+	    continue;
+	}
+	if (!reported && now - since >= wd -> threshold) {
+	    watchdog_report(wd, w, cb, cnt, since, now);
+	    reported = 1;
+	}
+    }
+    return NULL;
+}
+
+int zv_watchdog_start(zv_loop *lp, zv_tstamp threshold) {
+    assert(lp);
+    assert(threshold > 0.0);
+
+    if (lp -> watchdog)
+	return 0;
+
+#ifdef HAVE_EXECINFO_H
+    pthread_once(&capture_once, capture_install);
+#endif // HAVE_EXECINFO_H
+
+    struct zv_watchdog *wd = (struct zv_watchdog *)zv_calloc(1, sizeof(struct zv_watchdog));
+    wd -> lp = lp;
+    wd -> threshold = threshold;
+    wd -> running = 1;
+
+    int err = pthread_create(&wd -> tid, NULL, watchdog_thread, wd);
+    if (err) {
+	zv_err(0, "pthread_create error: %s", strerror(err));
+	zv_free(wd);
+	return -1;
+    }
+    lp -> watchdog = wd;
+    return 0;
+}
+
+/* unfetched stalls are discarded */
+void zv_watchdog_stop(zv_loop *lp) {
+    assert(lp);
+
+    struct zv_watchdog *wd = lp -> watchdog;
+    if (wd == NULL)
+	return;
+
+    __atomic_store_n(&wd -> running, 0, __ATOMIC_RELEASE);
+    pthread_join(wd -> tid, NULL);
+    lp -> watchdog = NULL;
+    zv_free(wd);
+}
+
+/* in a forked child the thread is gone, start another, unfetched stalls are discarded */
+void watchdog_fork(zv_loop *lp) {
+    struct zv_watchdog *wd = lp -> watchdog;
+
+    /* the parent's watchdog may have held it */
+    pthread_mutex_init(&capture_mutex, NULL);
+    lp -> watchdog = NULL;
+    zv_watchdog_start(lp, wd -> threshold);
+    zv_free(wd);
+}
+
+/* move up to `max` recorded stalls into `stalls`, oldest first */
+int zv_watchdog_fetch(zv_loop *lp, struct zv_stall *stalls, int max) {
+    assert(lp && stalls);
+
+    struct zv_watchdog *wd = lp -> watchdog;
+    if (wd == NULL)
+	return 0;
+
+    unsigned tail = wd -> tail;
+    unsigned head = __atomic_load_n(&wd -> head, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (tail != head && n < max) {
+	stalls[n++] = wd -> ring[tail & (WATCHDOG_RING - 1)];
+	tail++;
+    }
+    __atomic_store_n(&wd -> tail, tail, __ATOMIC_RELEASE);
+    return n;
+}